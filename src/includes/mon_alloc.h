@@ -0,0 +1,50 @@
+#ifndef MON_ALLOC_H
+#define MON_ALLOC_H
+
+#include <stddef.h>
+
+/* Default size of each arena chunk requested from malloc */
+#define MON_ARENA_CHUNK_SIZE (64 * 1024)
+/* Name buffers are handed out in multiples of this many bytes */
+#define MON_NAME_GRAIN 16
+/* Number of name size classes kept on free lists, covers NAME_MAX + 1 */
+#define MON_NAME_CLASSES 16
+
+struct mon_arena_chunk;
+
+/* Per monitor allocator for watch nodes and their name bytes. 
+ * Everything is carved out of large chunks with a bump pointer. Released nodes, and 
+ * names up to MON_NAME_CLASSES * MON_NAME_GRAIN bytes, go on free lists for reuse, 
+ * all chunks are handed back to malloc at once by mon_alloc_release(). 
+ */
+struct mon_alloc {
+    struct mon_arena_chunk *chunks; // chunks carved so far, newest first
+    size_t chunk_size; // size of regular chunks
+    size_t node_size; // size of a node slot, rounded up to MON_NAME_GRAIN
+    void *free_nodes; // released node slots
+    void *free_names[MON_NAME_CLASSES]; // released name buffers by size class
+    size_t bytes_reserved; // bytes malloc'd for chunks
+    size_t bytes_in_use; // bytes handed out and not yet released
+};
+
+/* Set up an empty allocator for nodes of node_size bytes. No memory is reserved until first use */
+void mon_alloc_init(struct mon_alloc *alloc, size_t node_size);
+
+/* Returns a zeroed node slot, or NULL if out of memory */
+void *mon_alloc_node(struct mon_alloc *alloc);
+
+/* Put a node slot back on the free list */
+void mon_free_node(struct mon_alloc *alloc, void *node);
+
+/* Returns a buffer with room for a name of len chars plus the terminating NUL */
+char *mon_alloc_name(struct mon_alloc *alloc, size_t len);
+
+/* Put a name buffer from mon_alloc_name(alloc, len) back for reuse */
+void mon_free_name(struct mon_alloc *alloc, char *name, size_t len);
+
+/* Free every chunk. All nodes and names handed out become invalid, 
+ * the allocator is left empty and can be used again. 
+ */
+void mon_alloc_release(struct mon_alloc *alloc);
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef MON_COALESCE_H
+#define MON_COALESCE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <sys/inotify.h>
+
+struct fs_event_manager;
+struct mon_event;
+
+/* Most (wd, name) keys held back at once. When full, the oldest is delivered early */
+#define MON_COALESCE_MAX_PENDING 1024
+
+/* Events merged by the coalescing stage, everything else passes straight through */
+#define MON_COALESCE_MASK (IN_MODIFY | IN_ATTRIB)
+
+// Held back modify/attrib events for one (wd, name)
+struct coalesce_entry {
+    int wd; // watch descriptor of the event
+    uint32_t mask; // OR of the merged event masks
+    uint32_t merged; // number of events merged into this one
+    uint32_t hash; // hash of (wd, name)
+    uint64_t expires_ns; // monotonic time the entry is delivered, if nothing flushes it sooner
+    struct coalesce_entry *hnext; // next entry in the same hash bucket
+    struct coalesce_entry *next; // next entry in delivery order, or in the free list
+    struct coalesce_entry *prev; // previous entry in delivery order
+    uint32_t name_len; // strlen of name
+    char name[NAME_MAX + 1];
+};
+
+// Coalescing stage between reading events and the monitor's handlers
+struct mon_coalesce {
+    uint32_t window_ms; // how long the first event of a key is held back
+    int timer_fd; // timerfd armed for the oldest entry's expiry
+    uint64_t armed_ns; // expiry the timer is armed for, 0 if disarmed
+    struct coalesce_entry *entries; // MON_COALESCE_MAX_PENDING entries
+    struct coalesce_entry *free_list; // unused entries
+    struct coalesce_entry *head; // oldest entry, delivered first
+    struct coalesce_entry *tail; // newest entry
+    struct coalesce_entry **buckets; // hash buckets keyed by (wd, name)
+    uint32_t bucket_mask; // number of buckets - 1
+    uint64_t events_in; // events handed to the stage
+    uint64_t events_out; // events delivered to the handlers
+    struct mon_event *run; // events of the batch in monitor_coalesce_batch() passed through and not yet handed on, NULL outside it
+    size_t run_len; // number of events in run
+};
+
+/* Enable coalescing of IN_MODIFY/IN_ATTRIB events on the monitor. Repeats of the same 
+ * (wd, name) within window_ms of the first one are merged into a single event. 
+ * The merged event is delivered on IN_CLOSE_WRITE, any other event for the same key, 
+ * or when the window times out. A window of 0 turns coalescing off, delivering 
+ * anything held back first. Returns 0 on success. 
+ */
+int monitor_set_coalesce(struct fs_event_manager *mon, uint32_t window_ms);
+
+/* event_handler that feeds the coalescing stage, data must be the monitor. 
+ * Pass it to read_events_fd() in place of mon->handler when mon->coalesce is set. 
+ * Events for keys with nothing held back keep their order, merged events are 
+ * delivered in the order their first event arrived. 
+ */
+int monitor_coalesce_handler(struct inotify_event *event, void *data);
+
+/* Run a read's decoded events through the stage on their way to mon->batch_handler. 
+ * Events that pass through are handed on together, in runs split wherever a held back 
+ * event is delivered in between, so the order is the same as with monitor_coalesce_handler(). 
+ * events is compacted in place. Returns the batch handler's last return. 
+ */
+int monitor_coalesce_batch(struct fs_event_manager *mon, struct mon_event *events, size_t cnt);
+
+/* timerfd that becomes readable when held back events are due, -1 if coalescing is off. 
+ * Add it to the loop's poll/epoll set, and call monitor_coalesce_flush_expired() when readable. 
+ */
+int monitor_coalesce_fd(struct fs_event_manager *mon);
+
+/* Deliver held back events whose window has passed. Returns the number delivered */
+int monitor_coalesce_flush_expired(struct fs_event_manager *mon);
+
+/* Deliver every held back event now. Returns the number delivered */
+int monitor_coalesce_flush_all(struct fs_event_manager *mon);
+
+/* Free the coalescing stage, dropping anything held back */
+void monitor_coalesce_free(struct fs_event_manager *mon);
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef MON_EPOCH_H
+#define MON_EPOCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct fs_event_manager;
+
+/* Default number of reader threads that can register with a monitor */
+#define MON_EPOCH_MAX_READERS 64
+/* Retired entries the writer lets build up before it tries to reclaim them */
+#define MON_EPOCH_RECLAIM_BATCH 64
+
+// One reader thread's announcement, on its own cache line so readers don't share lines
+struct mon_epoch_slot {
+    uint64_t epoch; // epoch the reader entered at, 0 while it isn't reading
+    int in_use; // claimed by a registered reader
+} __attribute__((aligned(64)));
+
+typedef void (*mon_retire_func)(void *ptr, void *arg);
+
+// Memory unlinked by the writer, freed once no reader can still hold it
+struct mon_retired {
+    void *ptr;
+    mon_retire_func func; // frees ptr, called as func(ptr, arg)
+    void *arg;
+    uint64_t epoch; // global epoch when it was retired
+};
+
+/* Epoch based reclamation with one writer and many readers.
+ * Readers announce the epoch they entered at, and read shared data without locks.
+ * The writer unlinks data, retires it, and only frees it once every reader that
+ * could have seen it has left. Readers never wait, the writer never waits on them
+ * except in mon_epoch_synchronize().
+ */
+struct mon_epoch {
+    uint64_t global; // current epoch, starts at 1
+    struct mon_epoch_slot *slots; // one per registered reader
+    int max_readers; // number of slots
+    struct mon_retired *retired; // waiting to be freed, oldest first
+    size_t retired_cnt; // entries used in retired
+    size_t retired_size; // entries allocated in retired
+    uint64_t reclaimed; // entries freed so far
+};
+
+/* Set up ep for up to max_readers readers, 0 for the default. Returns 0 on success */
+int mon_epoch_init(struct mon_epoch *ep, int max_readers);
+
+/* Free everything retired and the slots. No reader may be registered */
+void mon_epoch_free(struct mon_epoch *ep);
+
+/* Claim a slot for the calling reader thread. Returns NULL if they're all taken */
+struct mon_epoch_slot *mon_epoch_register(struct mon_epoch *ep);
+
+/* Give a slot back, the reader must not be inside a read section */
+void mon_epoch_unregister(struct mon_epoch *ep, struct mon_epoch_slot *slot);
+
+/* Reader: start a read section. Data reachable now stays valid until mon_epoch_exit() */
+static inline void mon_epoch_enter(struct mon_epoch *ep, struct mon_epoch_slot *slot){
+    __atomic_store_n(&slot->epoch, __atomic_load_n(&ep->global, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    // The announcement must be visible before any shared data is read, one full fence
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Reader: end a read section, nothing read in it may be used afterwards */
+static inline void mon_epoch_exit(struct mon_epoch_slot *slot){
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Writer: free ptr with func(ptr, arg) once no reader can hold it. ptr must already
+ * be unreachable for readers that start now. Returns 0, or -1 if it had to wait for
+ * the readers and free it right away.
+ */
+int mon_epoch_retire(struct mon_epoch *ep, void *ptr, mon_retire_func func, void *arg);
+
+/* Writer: advance the epoch and free what no reader can still see. Returns the number freed */
+size_t mon_epoch_reclaim(struct mon_epoch *ep);
+
+/* Writer: wait for every reader inside a read section to leave it, then free everything retired */
+void mon_epoch_synchronize(struct mon_epoch *ep);
+
+/* Turn on lock-free path lookups for mon. From then on nodes, names and the wd index
+ * are retired through mon->epoch instead of freed in place. Call before any reader
+ * starts. Returns 0 on success.
+ */
+int monitor_enable_readers(struct fs_event_manager *mon, int max_readers);
+
+/* Register the calling thread as a reader of mon. Returns its slot, or NULL */
+struct mon_epoch_slot *monitor_reader_register(struct fs_event_manager *mon);
+
+/* Unregister a reader of mon. Readers must be unregistered before the monitor is destroyed */
+void monitor_reader_unregister(struct fs_event_manager *mon, struct mon_epoch_slot *slot);
+
+#endif
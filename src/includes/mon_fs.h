@@ -1,27 +1,72 @@
+#include <stdint.h>
+#include <sys/types.h>
 #include <sys/inotify.h>
 #include <pthread.h>
 #include <jansson.h>
+#include "mon_alloc.h"
 
 #define INOT_EVENT_SIZE  (sizeof (struct inotify_event))
 #define INOT_DEFAULT_EVENT_BUF_LEN  (1024 * ( INOT_EVENT_SIZE + 16 ))
+/* Initial number of slots in the wd index, grown by doubling as wds are handed out */
+#define WD_TABLE_MIN_LEN 64
+/* inotify doesn't reuse wds, so churn spreads them ever higher. Once a dense wd index 
+ * would be this many times the number of watches, it's turned into a hash */
+#define WD_TABLE_SPARSE_RATIO 8
+/* Marks a removed entry in a hashed wd index, lookups probe past it */
+#define WD_INDEX_TOMBSTONE ((struct w_dir *)(uintptr_t)1)
+/* Initial number of buckets in the child index, doubled when entries outnumber buckets */
+#define CHILD_TABLE_MIN_LEN 64
+/* How long an IN_MOVED_FROM for a watched dir waits for its IN_MOVED_TO */
+#define MOVE_PAIR_WINDOW_MS 500
+/* Max number of dir moves waiting for their IN_MOVED_TO at once */
+#define MOVE_PAIR_MAX_PENDING 64
+/* Upper bound on mon->discovery_threads */
+#define DISCOVERY_MAX_THREADS 64
 
 
 struct w_dir;
 struct fs_event_manager;
+struct mon_coalesce;
+struct mon_reader;
+struct mon_shard_set;
+struct mon_epoch;
+struct mon_trace;
+struct mon_metrics;
+struct mon_mqtt;
 
 /* Call back to handle detected events. If using the default loop routine, 
  * a return value of anything other than 0 will stop loop 
  */
 typedef int (*event_handler)(struct inotify_event *event, void *data);
+
+// Decoded event handed to a batch_event_handler
+struct mon_event {
+    struct inotify_event *event; // raw event, valid until the handler returns
+    struct w_dir *wdir; // watched dir the event happened in, resolved from event->wd. NULL if unknown
+    const char *name; // name of the entry within wdir, "" if the event is for wdir itself
+    uint32_t name_len; // strlen of name
+};
+/* Call back to handle every event from one read() at once. wdir was resolved before the 
+ * call, so if the handler removes dirs part way through, later entries may point at freed 
+ * nodes and should be looked up again with get_dir_by_wd(). 
+ * A return value other than 0 will stop the default loop. 
+ */
+typedef int (*batch_event_handler)(struct mon_event *events, size_t cnt, void *data);
 /* Call back to control event loop. Return 0 to continue, else stop the loop
  */
 typedef int (*loopctl_func)(struct fs_event_manager *mon);
 /* Call back to handle when this dir is removed from watchers 
  */
 typedef int (*removed_dir_handler)(struct fs_event_manager *mon, struct w_dir *wdir);
+/* Call back used instead of inotify_add_watch() to get the wd for a dir, e.g. to build 
+ * a watch tree without an inotify instance. Returns the wd, or -1 on error 
+ */
+typedef int (*watch_add_func)(struct fs_event_manager *mon, const char *path, uint32_t mask);
 
 
-//Stucture to map inotify watch descriptors to fs paths
+//Stucture to map inotify watch descriptors to fs paths. 
+//Watched dirs form a tree rooted at the monitor's base dir. Each node only holds its 
+//own name component, full paths are built on demand by walking up the parents. 
 struct w_dir {
     int wd; // inotify watch descriptor
     uint32_t mask; // inotify mask to filter events
@@ -29,28 +74,90 @@ struct w_dir {
     int base_wd; // base watch descriptor
     struct fs_event_manager *evt_mon; // parent event monitor
     removed_dir_handler handle_removed; // Callback to handle when this dir is removed from watchlist 
-    struct w_dir *next; // next w_dir in list
-    char path[1]; // path of directory being monitored
+    struct w_dir *parent; // parent dir, NULL for the base dir
+    struct w_dir *children; // first watched sub dir
+    struct w_dir *next; // next sibling under the same parent
+    struct w_dir *prev; // previous sibling under the same parent
+    struct w_dir *hnext; // next w_dir in the same child index bucket
+    uint32_t name_hash; // precomputed hash of name, used by the child index
+    uint32_t name_len; // strlen of name
+    uint32_t resync_gen; // marks the dir as still present while its parent is re-listed by a resync
+    uint32_t stat_drained; // 0 if ino/mtime_ns come from a listing, else mon->drained_reads when an event refreshed them
+    uint64_t ino; // inode of the dir when its sub dirs were last listed or refreshed, 0 if never listed
+    int64_t mtime_ns; // mtime of the dir when its sub dirs were last listed or refreshed, saved in snapshots
+    char *name; // name of this dir within its parent. The base dir holds the full base path
+};
+
+//Index of watched dirs by watch descriptor. Replaced whole when it grows, so lock-free 
+//readers always see slots and len that go together
+struct wd_index {
+    size_t len; // number of slots, a power of 2
+    size_t used; // hashed only, slots holding a dir or WD_INDEX_TOMBSTONE
+    int hashed; // 0: slots[wd] is the dir. 1: open addressing from a hash of the wd, for sparse wds
+    struct w_dir *slots[];
+};
+
+//Watched dir seen in an IN_MOVED_FROM, waiting for the IN_MOVED_TO with the same cookie
+struct pending_move {
+    uint32_t cookie; // inotify cookie shared by the IN_MOVED_FROM/IN_MOVED_TO pair
+    int wd; // watch descriptor of the moved dir
+    uint64_t expires_ns; // monotonic time after which the dir is treated as moved out of the tree
 };
 
 //event_mon env 
 struct fs_event_manager {
-    int ifd; // inotify instance fd
+    int ifd; // inotify instance fd, non-blocking
+    unsigned int ifd_gen; // bumped each time ifd is replaced, e.g. by reset_monitor()
     int restore_base_dir; // if the base dir is found to not exist, is deleted, etc. will automatically mkdir
     mode_t base_mode; // Dir mode for base dir if created at init defaults to S_IRWXU | S_IRGRP (740). 
     int base_wd; // base dir watch descriptor
     int recursive; // Recursively discover and add sub dirs to monitor 
+    int discovery_threads; // Threads used by monitor_init() to discover the tree. 0 or 1 scans on the calling thread
+    char *snapshot_path; // If set, monitor_init() restores the tree from this snapshot and destroy saves it. Not freed by the monitor
     int needs_destroy; // flag to indicate this mon is in the destroy process
     int config_wd; // config file watch descriptor
     float interval; // inotify monitor select/poll timeout in seconds
     uint32_t mask; // Default watch mask filter for inotify events
     pthread_mutex_t lock; // Monitor Lock
-    pthread_t *thread_id; // Event loop thread for optional threaded loop
+    pthread_t *thread_id; // Reader thread in threaded mode, see monitor_start_thread()
+    struct mon_reader *reader; // Reader thread state in threaded mode, NULL otherwise
     char *base_path; // path to base directroy to be monitored
     json_t *jconfig; // config json object 
     loopctl_func loopctl; // call back used when event loop is finished
     event_handler handler; // call back used to handle individual events
-    struct w_dir *watch_list; // list mapping watch descriptors to fs paths 
+    batch_event_handler batch_handler; // if set, handles events a read() at a time instead of handler
+    struct mon_event *batch; // decoded events of the last read, reused across reads
+    size_t batch_size; // number of entries allocated in batch
+    char *path_buf; // scratch for monitor_event_path(), reused across events
+    size_t path_buf_size; // bytes allocated in path_buf
+    uint64_t path_allocs; // allocations made resolving event paths
+    uint64_t events_read; // events decoded by read_events_batch()
+    uint64_t ifd_reads; // read() calls made on ifd by read_events_batch()
+    struct w_dir *watch_root; // tree of watched dirs, rooted at the base dir
+    size_t watch_count; // number of dirs in watch_root
+    struct wd_index *wd_index; // watch_root nodes by watch descriptor, NULL until the first watch
+    struct w_dir **child_table; // hash buckets of watch_root nodes keyed by (parent, name)
+    size_t child_table_len; // number of buckets in child_table, always a power of 2
+    struct mon_alloc wdir_alloc; // slab/arena backing watch_root nodes and their names
+    uint32_t move_window_ms; // how long a dir move waits for its IN_MOVED_TO, defaults to MOVE_PAIR_WINDOW_MS
+    int pending_move_cnt; // number of entries used in pending_moves
+    struct pending_move pending_moves[MOVE_PAIR_MAX_PENDING]; // dir moves waiting to be paired, oldest first
+    int resync_pending; // set on IN_Q_OVERFLOW, the tree is being checked against the fs
+    size_t resync_cursor; // next wd_index slot the resync checks
+    uint32_t resync_gen; // last mark handed out by the resync
+    uint64_t resync_start_ns; // monotonic time the current resync started
+    uint32_t drained_reads; // reads of ifd that found the kernel queue empty and held no overflow, never 0
+    uint32_t resync_drained; // drained_reads when the overflow that started the resync was handled
+    struct mon_coalesce *coalesce; // modify/attrib coalescing stage, NULL unless set with monitor_set_coalesce()
+    struct mon_shard_set *shards; // set this monitor is a shard of, NULL unless created by monitor_shard_create()
+    int shard_cnt; // number of shards the top level dirs are spread over, 0 or 1 when not sharded
+    int shard_idx; // this monitor's shard, it only watches top level dirs whose name hashes to it
+    uint32_t root_mask; // watch mask for the base dir itself, 0 to use mask
+    struct mon_epoch *epoch; // lock-free path lookups from other threads, NULL unless monitor_enable_readers()
+    struct mon_trace *trace; // trace being recorded or replayed, NULL otherwise. See mon_trace.h
+    watch_add_func watch_add; // if set, hands out wds instead of the inotify instance. NULL by default
+    struct mon_metrics *metrics; // counters and histograms, NULL unless monitor_enable_metrics(). See mon_metrics.h
+    struct mon_mqtt *mqtt; // MQTT bridge publishing this monitor's events, NULL unless mon_mqtt_create(). See mon_mqtt.h
     size_t buf_len; // length of event buffer 
     char event_buffer[1]; // buffer for reading in inotify events 
 };
@@ -59,7 +166,7 @@ struct fs_event_manager *create_event_monitor(char *base_path, uint32_t mask, in
 
 struct fs_event_manager *destroy_event_monitor(struct fs_event_manager *mon); 
 
-/* iterates over mon->watch_list removes watchers and free's each w_dir entry. */
+/* iterates over mon->watch_root removes watchers and free's each w_dir entry. */
 struct w_dir *destroy_wdir_list(struct fs_event_manager *mon);
 
 /*remove monitors and rebuild from the base dir up */
@@ -67,6 +174,9 @@ int reset_monitor(struct fs_event_manager *mon);
 
 /* Starts the inotify monitor, adds the base dir to be monitored, as well as 
  * any recursively discovered sub dirs. 
+ * If mon->discovery_threads > 1, sub dirs are discovered by that many threads sharing 
+ * mon->ifd. Dirs created during discovery are either found by the threads or show up 
+ * as IN_CREATE events, since each dir is watched before it's listed. 
  * If monitor_init() returns 0 then mon->ifd can be used to read in inotify events. 
  */
 int monitor_init(struct fs_event_manager *mon);
@@ -80,6 +190,53 @@ int start_monitor_loop_example(struct fs_event_manager *mon);
  */
 int read_events_fd(int events_fd, char *buffer, size_t buflen, event_handler handler, void *data);
 
+/* Read events from mon->ifd into mon->event_buffer, decode them all and hand them to 
+ * mon->batch_handler in a single call, through the coalescing stage if it's on. Without a 
+ * batch handler, monitor_batch_adapter() feeds them to mon->handler one at a time. 
+ * Returns the number of bytes read, or -1 on error. 
+ */
+int read_events_batch(struct fs_event_manager *mon);
+
+/* Decode length bytes of events already read into mon->event_buffer, e.g. by io_uring, 
+ * and hand them to the batch handler like read_events_batch() does. Returns 0 on success. 
+ */
+int monitor_handle_events(struct fs_event_manager *mon, size_t length);
+
+/* batch_event_handler that calls mon->handler for each event in order, through the 
+ * coalescing stage if it's on and there's no mon->batch_handler, whose batches have been 
+ * through it already. Stops at the first non-zero return. data must be the monitor. 
+ */
+int monitor_batch_adapter(struct mon_event *events, size_t cnt, void *data);
+
+/* Hand one event that didn't come from a read, e.g. made up by resync or held back by 
+ * coalescing, to mon->batch_handler as a batch of one, or else to mon->handler. 
+ * Returns the handler's return. 
+ */
+int monitor_deliver_event(struct fs_event_manager *mon, struct inotify_event *event);
+
+/* Whether wdir's ino/mtime_ns describe the sub dirs in the tree, given drained reads 
+ * of the monitor's ifd have been made. True if they come from a listing. A stat taken 
+ * while an event was applied also sees later changes, so it only counts once a read 
+ * after it found the kernel queue empty, or the events of those changes may be lost. 
+ */
+int monitor_dir_stat_current(struct w_dir *wdir, uint32_t drained);
+
+/* Lock-free version of create_wd_full_path() for threads other than the one handling 
+ * events, inside a read section on mon->epoch (see mon_epoch.h). Writes the full path of 
+ * name in the dir watched by wd into buf, name may be NULL. Returns the path length, or 
+ * 0 if wd isn't watched or the path doesn't fit in buflen. A dir moved during the call 
+ * can show up under its old or new path. 
+ */
+size_t monitor_wd_path(struct fs_event_manager *mon, int wd, const char *name, char *buf, size_t buflen);
+
+/* Shard a top level dir called name belongs to, out of mon->shard_cnt */
+int monitor_shard_index(struct fs_event_manager *mon, const char *name, size_t name_len);
+
+/* Returns 1 if a sub dir name of parent belongs in mon's tree. Only top level dirs 
+ * are split between shards, everything below one stays with its shard. 
+ */
+int monitor_shard_owns(struct fs_event_manager *mon, struct w_dir *parent, const char *name, size_t name_len);
+
 /* Adds the current dir 
  *  if mon->recursive flag is set, then subdirectories will automatically be 
  *  discoverd and added recursively. 
@@ -90,42 +247,90 @@ struct w_dir *monitor_dir(char *dpath, struct fs_event_manager *mon);
  */
 struct w_dir *add_watch_dir_to_monitor(char *dpath, struct fs_event_manager *mon);
 
-/* Create/allocate new watch dir.  
- * To be free'd by caller
+/* Create/allocate new watch dir from the monitor's allocator. 
+ * The returned node is not linked into the tree. To be released by caller with free_watch_dir()
  */
 struct w_dir * create_watch_dir(char *dpath, struct fs_event_manager *mon);
 
+/* Remove the inotify watch of a node from create_watch_dir() and hand its memory back */
+void free_watch_dir(struct w_dir *wdir, struct fs_event_manager *mon);
+
+/* Bytes of watch tree memory in use: nodes, names and the wd/child indexes. 
+ * If reserved is provided it's set to the bytes actually allocated for them. 
+ */
+size_t monitor_mem_in_use(struct fs_event_manager *mon, size_t *reserved);
+
 /* Fetch w_dir with matchng watch descriptor attribute from provided w_dir list */
 struct w_dir *get_dir_by_wd(int wd, struct fs_event_manager *mon);
 
-/* Fetch w_dir with matching 'path' from provided w_dir list */
+/* Fetch w_dir with matching 'path' by walking the tree one path component at a time */
 struct w_dir *get_dir_by_path(char *path, struct fs_event_manager *mon);
 
-/*'if' found in list, removes w_dir from list, free's w_dir */
+/* Fetch the watched sub dir 'name' of parent */
+struct w_dir *get_child_dir(struct w_dir *parent, char *name, struct fs_event_manager *mon);
+
+/* Pre-order walk of the watch tree. Returns the node after wdir within the 
+ * subtree rooted at top, or NULL once the subtree is exhausted. 
+ */
+struct w_dir *watch_tree_next(struct w_dir *wdir, struct w_dir *top);
+
+/*'if' found in tree, removes w_dir and all of its sub dirs from the tree, free's them */
 int remove_watch_dir(struct w_dir *wdir, struct fs_event_manager *mon);
-/*'if' w_dir with matching path is found in list, i
- * removes w_dir from list, free's w_dir */
+/*'if' w_dir with matching path is found in tree, 
+ * removes w_dir and its sub dirs, free's them */
 int remove_watch_dir_by_path(char *path, struct fs_event_manager *mon);
 
-/* Finds parent directory using w_dir list mappings to build current event's
+/* Relocate wdir, along with its whole subtree, to new_name under new_parent. 
+ * inotify watches follow the inode, so no watches are added or removed. 
+ * A watched dir already at the destination is replaced. 
+ * Returns 0, or -1 with wdir left where it was. 
+ */
+int move_watch_dir(struct w_dir *wdir, struct w_dir *new_parent, char *new_name, struct fs_event_manager *mon);
+
+/* Dir moves whose IN_MOVED_TO didn't show up within mon->move_window_ms were moved 
+ * out of the tree, remove their subtrees. Loops driving the monitor should call this 
+ * periodically, start_monitor_loop_example() does so on every iteration. 
+ */
+void monitor_expire_moves(struct fs_event_manager *mon);
+
+/* Writes the full path of wdir into buf, truncating to buflen. 
+ * Returns the length of the full path (like snprintf), so a return >= buflen means 
+ * the buffer was too small. 
+ */
+size_t get_wdir_path(struct w_dir *wdir, char *buf, size_t buflen);
+
+/* Finds parent directory using the watch tree to build current event's
  * full path. 
  * Returned buffer must be free'd later by caller
  */ 
 char *create_wd_full_path(int wd, char *name, struct fs_event_manager *mon);
 
+/* Same as create_wd_full_path(), but builds the path into the monitor's scratch buffer. 
+ * The buffer only grows when a longer path shows up, so steady state event handling 
+ * allocates nothing. Returns the path, valid until the next call on this monitor, 
+ * or NULL if wd isn't watched. If len is not NULL it's set to the length of the path. 
+ */
+char *monitor_event_path(struct fs_event_manager *mon, int wd, const char *name, size_t *len);
+
+/* Allocations made resolving event paths, per event read so far */
+double monitor_allocs_per_event(struct fs_event_manager *mon);
+
 /*************************************************************/
 /* Debug, log related utils */
 /*************************************************************/
-/* Iterate over a provided watchlist and print items */
+/* Walk the provided watch tree and print items */
 void debug_show_list(struct w_dir *list);
 
 /* print event attributes, and textual version of mask */
 void print_event(struct inotify_event *event);
 
+/* Name of a single inotify mask bit, e.g. "IN_CREATE". NULL if it isn't one */
+const char *monitor_mask_name(uint32_t mask);
+
 /*************************************************************/
 /* General, Misc, utils */
 /*************************************************************/
-/* Check to make sure a dir at dpath exists, is accessible on the fs. */
+/* Wait up to sec + usec for fd to become readable. Returns 1 if it is, else 0 */
 int mon_fd_has_events(int fd, float sec, float usec);
 int example_event_handler(struct inotify_event *event, void *data);
 
@@ -0,0 +1,49 @@
+#ifndef MON_LOG_H
+#define MON_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <syslog.h>
+
+/* Most verbose level compiled in. Build with e.g. -DMON_LOG_COMPILE_LEVEL=LOG_INFO and
+ * every LOGDEBUG() call is removed by the compiler, arguments included. */
+#ifndef MON_LOG_COMPILE_LEVEL
+#define MON_LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+/* Runtime level until mon_log_set_level() or set_local_debug_enabled() change it */
+#define MON_LOG_DEFAULT_LEVEL LOG_INFO
+
+/* Longest message kept by the async backend, longer ones are cut */
+#define MON_LOG_MSG_MAX 240
+/* Default number of messages each thread can queue for the async writer */
+#define MON_LOG_DEFAULT_SLOTS 1024
+/* How long the async writer sleeps when every queue is empty */
+#define MON_LOG_FLUSH_MS 10
+
+/* Most verbose level currently logged. Read without a lock on every log call */
+extern int mon_log_level;
+
+/* One predictable branch at runtime, none at all for levels compiled out */
+#define MON_LOG_ENABLED(lev) ((lev) <= MON_LOG_COMPILE_LEVEL && \
+                              __builtin_expect((lev) <= mon_log_level, (lev) <= LOG_WARNING))
+
+/* Set the runtime level, LOG_EMERG to LOG_DEBUG. Returns the previous one */
+int mon_log_set_level(int level);
+
+/* Format and log a message that already passed MON_LOG_ENABLED(). Queued for the
+ * async writer if it's running, otherwise written to syslog right away. */
+void mon_log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/* Start the async backend. Each logging thread gets its own lock-free queue of slots
+ * messages (0 for the default), drained to syslog by one background writer. A full
+ * queue drops the message rather than block the caller. Returns 0 on success. */
+int mon_log_start_async(size_t slots);
+
+/* Write out everything queued, stop the writer and free the queues */
+void mon_log_stop_async(void);
+
+/* Messages dropped by the async backend because a queue was full */
+uint64_t mon_log_dropped(void);
+
+#endif
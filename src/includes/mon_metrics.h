@@ -0,0 +1,161 @@
+#ifndef MON_METRICS_H
+#define MON_METRICS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <jansson.h>
+
+struct fs_event_manager;
+
+/* Log-linear histogram, HDR style: exact below MON_HIST_SUB, then MON_HIST_SUB buckets
+ * per power of 2, so any value is within 1/MON_HIST_SUB of its bucket. One writer, any
+ * number of readers merging it. */
+#define MON_HIST_SUB_BITS 4
+#define MON_HIST_SUB (1 << MON_HIST_SUB_BITS)
+#define MON_HIST_BUCKETS ((64 - MON_HIST_SUB_BITS + 1) * MON_HIST_SUB)
+
+struct mon_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[MON_HIST_BUCKETS];
+};
+
+static inline size_t mon_hist_bucket(uint64_t val){
+    if (val < MON_HIST_SUB){
+        return val;
+    }
+    int bits = 63 - __builtin_clzll(val);
+    return (size_t)(bits - MON_HIST_SUB_BITS + 1) * MON_HIST_SUB + ((val >> (bits - MON_HIST_SUB_BITS)) & (MON_HIST_SUB - 1));
+}
+
+/* Add cnt values of val. Only the owning thread writes, readers see whole counters */
+static inline void mon_hist_record_n(struct mon_hist *hist, uint64_t val, uint64_t cnt){
+    size_t idx = mon_hist_bucket(val);
+    __atomic_store_n(&hist->buckets[idx], hist->buckets[idx] + cnt, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum, hist->sum + val * cnt, __ATOMIC_RELAXED);
+    if (val > hist->max){
+        __atomic_store_n(&hist->max, val, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&hist->count, hist->count + cnt, __ATOMIC_RELAXED);
+}
+
+static inline void mon_hist_record(struct mon_hist *hist, uint64_t val){
+    mon_hist_record_n(hist, val, 1);
+}
+
+/* Add src into dst, src may be written to meanwhile */
+void mon_hist_merge(struct mon_hist *dst, const struct mon_hist *src);
+
+/* Value at fraction pct (0 to 1) of the recorded values, the low end of its bucket */
+uint64_t mon_hist_percentile(const struct mon_hist *hist, double pct);
+
+/* count, mean, p50, p90, p99, p999 and max of hist as a json object */
+json_t *mon_hist_json(const struct mon_hist *hist);
+
+// Counters kept per monitor
+enum mon_metric {
+    MON_METRIC_EVENTS, // events read
+    MON_METRIC_BYTES_READ, // bytes of events read
+    MON_METRIC_READS, // event buffers handled, one per read()
+    MON_METRIC_OVERFLOWS, // IN_Q_OVERFLOW events
+    MON_METRIC_WATCHES_ADDED,
+    MON_METRIC_WATCHES_FAILED, // dirs that could not be watched
+    MON_METRIC_WATCHES_REMOVED,
+    MON_METRIC_SCANS, // sub dir discovery runs
+    MON_METRIC_CNT,
+};
+
+// Histograms kept per monitor
+enum mon_metric_hist {
+    MON_METRIC_HANDLER_NS, // handler time per event
+    MON_METRIC_SCAN_NS, // time per sub dir discovery run
+    MON_METRIC_EVENTS_PER_READ,
+    MON_METRIC_HIST_CNT,
+};
+
+// One thread's share of a monitor's metrics, only written by that thread
+struct mon_metrics_shard {
+    pthread_t owner;
+    struct mon_metrics_shard *next;
+    uint64_t counters[MON_METRIC_CNT];
+    uint64_t mask_bits[32]; // events read per inotify mask bit
+    struct mon_hist hists[MON_METRIC_HIST_CNT];
+} __attribute__((aligned(64)));
+
+/* Metrics of one monitor, mon->metrics. Every thread that touches the monitor counts
+ * into its own shard without locks or shared cache lines, reads merge the shards.
+ */
+struct mon_metrics {
+    uint64_t id; // unique, keys the per-thread shard cache
+    pthread_mutex_t lock; // guards adding shards
+    struct mon_metrics_shard *shards; // one per thread, never removed until the monitor is destroyed
+    uint64_t start_ns; // monotonic time metrics were enabled
+};
+
+/* Per-thread cache of the shards a thread last used */
+#define MON_METRICS_TLS_SLOTS 4
+struct mon_metrics_tls {
+    uint64_t id;
+    struct mon_metrics_shard *shard;
+};
+extern __thread struct mon_metrics_tls mon_metrics_tls[MON_METRICS_TLS_SLOTS];
+
+/* Slow path of mon_metrics_local(), finds or adds the calling thread's shard */
+struct mon_metrics_shard *mon_metrics_shard_get(struct mon_metrics *metrics);
+
+/* The calling thread's shard of metrics, or NULL if it could not be allocated */
+static inline struct mon_metrics_shard *mon_metrics_local(struct mon_metrics *metrics){
+    for (int i = 0; i < MON_METRICS_TLS_SLOTS; i++){
+        if (mon_metrics_tls[i].id == metrics->id){
+            return mon_metrics_tls[i].shard;
+        }
+    }
+    return mon_metrics_shard_get(metrics);
+}
+
+/* Hot path updates, no-ops when metrics is NULL */
+static inline void mon_metric_add(struct mon_metrics *metrics, enum mon_metric id, uint64_t cnt){
+    struct mon_metrics_shard *shard = metrics ? mon_metrics_local(metrics) : NULL;
+    if (shard){
+        __atomic_store_n(&shard->counters[id], shard->counters[id] + cnt, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void mon_metric_hist(struct mon_metrics *metrics, enum mon_metric_hist id, uint64_t val, uint64_t cnt){
+    struct mon_metrics_shard *shard = metrics ? mon_metrics_local(metrics) : NULL;
+    if (shard){
+        mon_hist_record_n(&shard->hists[id], val, cnt);
+    }
+}
+
+// Count an event under each bit of its mask
+static inline void mon_metric_mask(struct mon_metrics_shard *shard, uint32_t mask){
+    for (; mask; mask &= mask - 1){
+        int bit = __builtin_ctz(mask);
+        __atomic_store_n(&shard->mask_bits[bit], shard->mask_bits[bit] + 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Merged totals of every shard */
+struct mon_metrics_totals {
+    uint64_t counters[MON_METRIC_CNT];
+    uint64_t mask_bits[32];
+    struct mon_hist hists[MON_METRIC_HIST_CNT];
+};
+
+/* Turn on metrics for mon. Returns 0 on success */
+int monitor_enable_metrics(struct fs_event_manager *mon);
+
+/* Free mon's metrics. No other thread may be using the monitor */
+void monitor_metrics_free(struct fs_event_manager *mon);
+
+/* Merge mon's shards into totals. Returns 0, or -1 if metrics are off */
+int monitor_metrics_read(struct fs_event_manager *mon, struct mon_metrics_totals *totals);
+
+/* Snapshot of mon's metrics as a new json object, to be json_decref()ed by the caller.
+ * NULL if metrics are off. */
+json_t *monitor_metrics_json(struct fs_event_manager *mon);
+
+#endif
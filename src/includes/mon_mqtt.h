@@ -0,0 +1,162 @@
+#ifndef MON_MQTT_H
+#define MON_MQTT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/inotify.h>
+#include <jansson.h>
+#include "mon_metrics.h"
+
+/* Needs mon_fs.h included first, for event_handler */
+struct fs_event_manager;
+struct mon_reactor;
+struct reactor_source;
+struct mosquitto;
+
+/* MQTT bridge. Changes under a monitor's base path are published to the broker, each
+ * event as one message on <topic_prefix>/<path relative to the base dir>, with payload
+ *   {"event":"IN_CREATE","dir":true,"path":"<relative path>"}
+ * '+' and '#' in paths are published as '_'. An IN_Q_OVERFLOW is published on
+ * topic_prefix itself so subscribers know they missed events.
+ * The mosquitto socket is driven from the same mon_reactor as the monitor's inotify fd,
+ * with mosquitto_loop_read()/loop_write() on readiness and loop_misc() from a reactor
+ * timer. Nothing blocks or sleeps, a publish is written out from the handler or at the
+ * latest on the next pass of the loop. Needs -lmosquitto.
+ *
+ * Publishes go through a bounded queue. At most max_inflight QoS1 messages are out
+ * waiting for their PUBACK, and nothing more is handed to mosquitto while its socket is
+ * backed up, so mosquitto's own buffers stay small. Once queue_len messages are waiting,
+ * backpressure reaches the monitor, see enum mon_mqtt_backpressure.
+ */
+
+/* How often the bridge timer runs loop_misc(), retries connecting and checks the stats interval */
+#define MQTT_TICK_MS 500
+/* Window publish and ack rates are measured over */
+#define MQTT_RATE_WINDOW_MS 1000
+/* Reconnect back off, doubling from the first to the max */
+#define MQTT_RECONNECT_MIN_MS 500
+#define MQTT_RECONNECT_MAX_MS 30000
+/* Pipeline defaults */
+#define MQTT_DEFAULT_INFLIGHT 1024
+#define MQTT_DEFAULT_QUEUE_LEN 16384
+
+// What happens to new events once the queue holds queue_len messages
+enum mon_mqtt_backpressure {
+    MQTT_BACKPRESSURE_PAUSE = 0, // stop reading the monitor until the queue is half empty, events wait in the kernel
+    MQTT_BACKPRESSURE_CONFLATE, // keep reading, a message replaces one queued on the same topic, others are dropped while full
+};
+
+struct mon_mqtt_config {
+    const char *host; // broker host, defaults to localhost
+    int port; // defaults to 1883, or 8883 with cafile
+    int keepalive; // seconds, defaults to 60
+    const char *client_id; // NULL for one made from the pid
+    const char *username; // NULL for no login
+    const char *password;
+    const char *cafile; // turns on TLS if set
+    const char *topic_prefix; // topic events are published under, defaults to "event_kitchen"
+    int qos; // 0 or 1
+    int retain; // publish events retained
+    const char *stats_topic; // if set, mon_mqtt_stats_json() is published here every stats_interval_ms
+    uint32_t stats_interval_ms; // defaults to 10000
+    uint32_t max_inflight; // QoS1 messages sent and not yet acked, defaults to MQTT_DEFAULT_INFLIGHT
+    uint32_t queue_len; // queued messages that trigger backpressure, defaults to MQTT_DEFAULT_QUEUE_LEN
+    enum mon_mqtt_backpressure backpressure;
+};
+
+// Bridge counters, only touched from the reactor's thread
+struct mon_mqtt_stats {
+    uint64_t published; // messages handed to mosquitto
+    uint64_t acked; // QoS1 messages the broker acked
+    uint64_t unacked; // QoS1 messages in flight when the connection dropped, mosquitto may still resend them
+    uint64_t dropped; // messages that could not be queued or were rejected by mosquitto
+    uint64_t conflated; // messages replaced by a newer one on the same topic while queued
+    uint64_t bytes; // payload bytes published
+    uint64_t pauses; // times the monitor was paused by backpressure
+    uint64_t paused_ns; // time spent paused, up to the last resume
+    uint64_t connects; // successful CONNACKs
+    uint64_t disconnects; // connections lost or refused
+};
+
+// Message waiting in the outgoing queue. Slot buffers are kept and reused
+struct mqtt_msg {
+    char *buf; // topic, NUL, then payload
+    size_t buf_size; // bytes allocated in buf
+    uint32_t topic_len;
+    uint32_t payload_len;
+    uint32_t hash; // of the topic, for conflation
+    struct mqtt_msg *hnext; // next queued message in the same conflation bucket
+    uint8_t qos;
+    uint8_t retain;
+};
+
+// QoS1 message handed to mosquitto, waiting for its PUBACK
+struct mqtt_inflight {
+    int mid; // mosquitto message id, 0 once acked
+    uint64_t sent_ns; // monotonic time it was handed to mosquitto
+};
+
+struct mon_mqtt {
+    struct mosquitto *mosq;
+    struct mon_reactor *reactor; // loop driving both the monitor and the socket
+    struct fs_event_manager *mon; // monitor whose events are published
+    size_t base_len; // strlen of the monitor's base path, cut from event paths
+    struct reactor_source *sock_src; // mosquitto socket, NULL while there is none
+    struct reactor_source *timer; // MQTT_TICK_MS timer
+    int sock; // fd sock_src was registered for, -1 if none
+    int sock_closed; // mosquitto closed the socket, sock_src goes even if the number comes back
+    int connected; // CONNACK received and not lost since
+    uint32_t backoff_ms; // wait before the next connect attempt
+    uint64_t next_connect_ns; // monotonic time of the next connect attempt, 0 when connected or connecting
+    uint64_t next_stats_ns; // monotonic time stats are published next
+    event_handler next_handler; // mon->handler before the bridge hooked in, called after publishing
+    char *topic; // scratch for topics, grows to the longest seen
+    size_t topic_size;
+    char *payload; // scratch for payloads
+    size_t payload_size;
+    struct mqtt_msg *queue; // ring of messages waiting for the window or the connection
+    uint32_t queue_cap; // slots in queue, queue_len plus room for the rest of a read
+    uint32_t queue_head; // oldest queued message
+    uint32_t queued; // messages in queue
+    struct mqtt_msg **buckets; // conflation index of queued messages by topic hash. NULL unless conflating
+    uint32_t bucket_mask; // buckets - 1, a power of 2
+    struct mqtt_inflight *inflight; // ring of QoS1 messages in send order, PUBACKs come back in that order
+    uint32_t inflight_head; // oldest message not known to be acked
+    uint32_t inflight_len; // entries in use, window is full at cfg.max_inflight
+    int paused; // monitor is paused by backpressure
+    uint64_t paused_at_ns; // monotonic time it was paused
+    uint64_t rate_start_ns; // start of the current rate window
+    uint64_t rate_published; // stats.published at rate_start_ns
+    uint64_t rate_acked; // stats.acked at rate_start_ns
+    double publish_rate; // messages/s published over the last full window
+    double ack_rate; // acks/s over the last full window
+    struct mon_hist ack_ns; // PUBLISH to PUBACK latency
+    struct mon_mqtt_config cfg; // copy of the config, strings owned by the bridge
+    struct mon_mqtt_stats stats;
+};
+
+/* Bridge mon's events to the broker in cfg. mon must be initialized and should be
+ * registered with reactor, the bridge hooks in ahead of mon->handler and adds the mosquitto
+ * socket and a timer to reactor. Connecting starts right away and is retried with back off
+ * from the timer, events seen while disconnected wait in the queue.
+ * Returns the bridge, or NULL on error.
+ */
+struct mon_mqtt *mon_mqtt_create(struct mon_reactor *reactor, struct fs_event_manager *mon, const struct mon_mqtt_config *cfg);
+
+/* Disconnect, remove the bridge's sources from the reactor and restore mon->handler.
+ * Must be called before the monitor or reactor is destroyed.
+ */
+void mon_mqtt_destroy(struct mon_mqtt *mqtt);
+
+/* Queue payload for topic, it's sent as soon as the window and socket allow. Returns 0 if
+ * it was sent or queued, -1 if it was dropped */
+int mon_mqtt_publish(struct mon_mqtt *mqtt, const char *topic, const void *payload, size_t len, int qos, int retain);
+
+/* event_handler installed on the bridged monitor, data is the monitor */
+int mon_mqtt_event_handler(struct inotify_event *event, void *data);
+
+/* Bridge stats, plus monitor_metrics_json() of the monitor if metrics are on, as a new
+ * json object to be json_decref()ed by the caller */
+json_t *mon_mqtt_stats_json(struct mon_mqtt *mqtt);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef MON_REACTOR_H
+#define MON_REACTOR_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+struct fs_event_manager;
+struct mon_reactor;
+struct reactor_source;
+
+/* Default number of ready fds handled per epoll_wait() */
+#define REACTOR_DEFAULT_MAX_EVENTS 64
+
+/* Call back for a ready fd or an expired timer. events holds the EPOLL* flags that fired. 
+ * Sources may be removed from inside any call back, including their own. 
+ */
+typedef void (*reactor_cb)(struct mon_reactor *reactor, struct reactor_source *src, uint32_t events, void *data);
+
+enum reactor_source_type {
+    REACTOR_SRC_FD = 0, // any fd, e.g. the mosquitto socket
+    REACTOR_SRC_MONITOR, // an fs_event_manager's inotify fd, drained edge triggered
+    REACTOR_SRC_COALESCE, // an fs_event_manager's coalesce timerfd
+    REACTOR_SRC_TIMER, // periodic timerfd owned by the reactor
+};
+
+// One fd registered with the reactor
+struct reactor_source {
+    enum reactor_source_type type;
+    int fd; // registered fd
+    uint32_t events; // EPOLL* flags registered for fd
+    reactor_cb cb; // call back, NULL for monitors
+    void *data; // call back data, the fs_event_manager for monitor sources
+    unsigned int ifd_gen; // monitor's ifd_gen when fd was registered
+    int removed; // set once removed, freed after the current dispatch
+    int busy; // monitor is on the busy list
+    int paused; // monitor isn't read until resumed, see mon_reactor_pause_monitor()
+    struct reactor_source *coalesce; // monitor's coalesce timer source
+    struct reactor_source *next; // next registered source
+    struct reactor_source *prev; // previous registered source
+    struct reactor_source *busy_next; // next monitor with pending moves or a resync
+};
+
+// Single threaded epoll loop driving any number of monitors, sockets and timers
+struct mon_reactor {
+    int epfd; // epoll instance
+    int running; // cleared by mon_reactor_stop()
+    int max_events; // size of events
+    struct epoll_event *events; // ready list filled by epoll_wait()
+    struct reactor_source *sources; // every registered source
+    size_t source_cnt; // number of registered sources
+    struct reactor_source *busy; // monitors needing periodic work, moves to expire or a resync
+    struct reactor_source *dead; // removed sources, freed once dispatch is done
+    uint64_t waits; // epoll_wait() calls made
+};
+
+/* Create a reactor handling up to max_events ready fds per wait, 0 for the default */
+struct mon_reactor *mon_reactor_create(int max_events);
+
+/* Remove every source and free the reactor. Monitors are left running, timers are closed */
+void mon_reactor_destroy(struct mon_reactor *reactor);
+
+/* Register fd for events (EPOLLIN, EPOLLOUT, EPOLLET...), cb is called when it's ready. 
+ * The fd stays owned by the caller. Returns the source or NULL. 
+ */
+struct reactor_source *mon_reactor_add_fd(struct mon_reactor *reactor, int fd, uint32_t events, reactor_cb cb, void *data);
+
+/* Change the events registered for a source, e.g. adding EPOLLOUT while a socket wants to write */
+int mon_reactor_mod_fd(struct mon_reactor *reactor, struct reactor_source *src, uint32_t events);
+
+/* Register an initialized monitor. Its inotify fd is drained edge triggered with 
+ * read_events_batch(), and its coalesce timer is registered while coalescing is on. 
+ * Pending moves and resyncs are driven by the reactor. If the monitor replaces its 
+ * inotify fd, e.g. in reset_monitor(), the new one is registered automatically, and so 
+ * is a coalesce timer from monitor_set_coalesce() called after the monitor was added. 
+ * Monitors with a reader thread (monitor_start_thread()) are refused. 
+ * Remove the monitor before destroying it. 
+ */
+struct reactor_source *mon_reactor_add_monitor(struct mon_reactor *reactor, struct fs_event_manager *mon);
+
+/* Stop (paused 1) or restart (paused 0) reading a registered monitor's inotify fd, e.g. while
+ * whatever consumes its events is backed up. Events queue in the kernel meanwhile, up to
+ * max_queued_events before it reports an IN_Q_OVERFLOW. Nothing else reaches the handlers
+ * while paused either, resync steps, move expiry and coalesced events wait for the restart.
+ * Returns 0, or -1 if mon isn't registered.
+ */
+int mon_reactor_pause_monitor(struct mon_reactor *reactor, struct fs_event_manager *mon, int paused);
+
+/* Add a timer firing every interval_ms, first after interval_ms. The timerfd is owned by the reactor */
+struct reactor_source *mon_reactor_add_timer(struct mon_reactor *reactor, uint32_t interval_ms, reactor_cb cb, void *data);
+
+/* Remove a source. Safe from inside call backs, the source is freed after the current dispatch */
+int mon_reactor_remove(struct mon_reactor *reactor, struct reactor_source *src);
+
+/* Wait up to timeout_ms (-1 for no limit) and dispatch whatever is ready. 
+ * The wait is shortened while monitors have moves to expire or a resync running. 
+ * Returns the number of ready fds dispatched, or -1 on error. 
+ */
+int mon_reactor_run_once(struct mon_reactor *reactor, int timeout_ms);
+
+/* Dispatch until mon_reactor_stop() is called */
+int mon_reactor_run(struct mon_reactor *reactor);
+
+/* Make mon_reactor_run() return after the current dispatch */
+void mon_reactor_stop(struct mon_reactor *reactor);
+
+#endif
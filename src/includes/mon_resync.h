@@ -0,0 +1,30 @@
+#ifndef MON_RESYNC_H
+#define MON_RESYNC_H
+
+#include <stddef.h>
+
+struct fs_event_manager;
+
+/* Number of dirs checked per monitor_resync_step() call from the example loop */
+#define MON_RESYNC_BATCH 256
+
+/* Start checking the watch tree against the fs, after an IN_Q_OVERFLOW lost events. 
+ * example_event_handler() calls this itself, custom handlers should call it on IN_Q_OVERFLOW. 
+ * A resync already running is restarted from the first dir. 
+ */
+void monitor_start_resync(struct fs_event_manager *mon);
+
+/* Check up to budget watched dirs against the fs, so event reading can go on between calls. 
+ * Each dir is stat()ed, and only listed if its inode or mtime differs from when it was 
+ * last listed. What changed is fed to mon->handler as synthetic events: 
+ *  IN_CREATE|IN_ISDIR on the parent for sub dirs that showed up, 
+ *  IN_DELETE|IN_ISDIR on the parent for sub dirs that are gone, 
+ *  IN_MODIFY|IN_ISDIR with no name on a dir whose entries changed. 
+ *  IN_DELETE_SELF for the base dir if it's gone. 
+ * File changes in dirs whose entries didn't change can't be seen from dir mtimes and 
+ * are not reported. 
+ * Returns 1 while dirs are left to check, 0 once the resync is done or none is running. 
+ */
+int monitor_resync_step(struct fs_event_manager *mon, size_t budget);
+
+#endif
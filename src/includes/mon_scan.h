@@ -0,0 +1,43 @@
+#ifndef MON_SCAN_H
+#define MON_SCAN_H
+
+#include <stddef.h>
+
+/* Size of the per thread buffer handed to getdents64() */
+#define MON_SCAN_BUF_SIZE (128 * 1024)
+
+/* Dir listing backends. getdents64 is the default, readdir is kept as a fallback 
+ * for kernels/filesystems where the raw syscall isn't usable, and for benchmarking. 
+ */
+enum mon_scan_backend {
+    SCAN_BACKEND_GETDENTS = 0,
+    SCAN_BACKEND_READDIR,
+};
+
+/* Called for each sub dir found while listing a dir. dirfd is the fd of the dir being 
+ * listed and can be used with openat() etc. Return non-zero to stop the listing. 
+ */
+typedef int (*scan_subdir_cb)(int dirfd, const char *name, size_t name_len, void *data);
+
+/* Open the dir at path for listing, O_RDONLY | O_DIRECTORY, following symlinks like 
+ * opendir(). Paths longer than PATH_MAX are opened piecewise with openat(), so any 
+ * length works. Returns the fd or -1. 
+ */
+int mon_open_dir(const char *path, size_t len);
+
+/* Lists the sub dirs of the dir open at fd, calling cb for each one. 
+ * '.', '..', files and symlinks are skipped. d_type is trusted when the fs fills it in, 
+ * fstatat() is only used for DT_UNKNOWN entries. 
+ * Takes ownership of fd, it's closed before returning. 
+ * Returns the number of sub dirs found, or -1 if the dir could not be read. 
+ */
+int mon_scan_subdirs(int fd, scan_subdir_cb cb, void *data);
+
+/* Same as mon_scan_subdirs(), forcing a specific backend */
+int mon_scan_subdirs_getdents(int fd, scan_subdir_cb cb, void *data);
+int mon_scan_subdirs_readdir(int fd, scan_subdir_cb cb, void *data);
+
+/* Select the backend used by mon_scan_subdirs() for every tree walk. Returns the previous one */
+enum mon_scan_backend mon_scan_set_backend(enum mon_scan_backend backend);
+
+#endif
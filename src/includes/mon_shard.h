@@ -0,0 +1,69 @@
+#ifndef MON_SHARD_H
+#define MON_SHARD_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/inotify.h>
+
+struct fs_event_manager;
+
+/* Most shards a tree can be split into */
+#define MON_SHARD_MAX 64
+
+/* Base dir watch mask of every shard but the first. They only need to know when it goes */
+#define MON_SHARD_ROOT_MASK (IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* A tree split into shards by top level dir. Each shard is a full monitor of the base
+ * dir with its own inotify instance, kernel queue and reader thread, watching only the top
+ * level dirs whose name hashes to it. The first shard also gets the base dir's own events.
+ * Every dir lives in exactly one shard, so its events keep their order when the shards
+ * are merged by monitor_shard_consume(). Watch descriptors are per shard, handlers get
+ * the shard's monitor as data to resolve them with.
+ */
+struct mon_shard_set {
+    int nshards; // number of monitors in mons
+    struct fs_event_manager **mons; // one monitor per shard, mons[0] gets the base dir's events
+    struct pollfd *fds; // per shard reader wakeup and coalesce timer fds, for monitor_shard_wait()
+    int stop; // set by monitor_shard_stop() to end monitor_shard_run()
+    uint64_t consumed; // events handed to the handlers by monitor_shard_consume()
+};
+
+/* Create nshards monitors of base_path, sharing mask and handler like create_event_monitor().
+ * Shard monitors are always recursive. Set any other options on set->mons[] before
+ * monitor_shard_start(). To be freed with monitor_shard_destroy().
+ */
+struct mon_shard_set *monitor_shard_create(char *base_path, uint32_t mask, int nshards,
+                                           event_handler handler, size_t event_buf_len);
+
+/* monitor_init() each shard and start its reader thread with a ring of slots events,
+ * 0 for the default. Returns 0 on success.
+ */
+int monitor_shard_start(struct mon_shard_set *set, size_t slots);
+
+/* Stop the reader threads, destroy the shard monitors and free set. Returns NULL */
+struct mon_shard_set *monitor_shard_destroy(struct mon_shard_set *set);
+
+/* Wait up to timeout_ms for any shard to have events, delivering coalesced events that
+ * come due. Returns the number of shards with events ready, 0 on timeout.
+ */
+int monitor_shard_wait(struct mon_shard_set *set, int timeout_ms);
+
+/* Merge the shards' streams: hand every event their readers have published to the
+ * handlers, shard by shard, on the calling thread. Returns the number of events handled.
+ */
+int monitor_shard_consume(struct mon_shard_set *set);
+
+/* Loop waiting on and consuming the shards until monitor_shard_stop() */
+int monitor_shard_run(struct mon_shard_set *set);
+
+/* Make monitor_shard_run() return, safe to call from a handler */
+void monitor_shard_stop(struct mon_shard_set *set);
+
+/* Monitor of mon's shard set that watches the top level dir called name */
+struct fs_event_manager *monitor_shard_route(struct fs_event_manager *mon, const char *name);
+
+/* Number of dirs watched by all the shards */
+size_t monitor_shard_watch_count(struct mon_shard_set *set);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef MON_SNAPSHOT_H
+#define MON_SNAPSHOT_H
+
+#include <stdint.h>
+
+struct fs_event_manager;
+
+/* Snapshot file layout. Everything is fixed width and little endian as written by 
+ * this host, so a snapshot is used straight from mmap() without parsing. 
+ *   [snap_header][snap_record * record_cnt][name bytes]
+ * Records are in pre-order, so a record's parent always comes before it. 
+ * Record 0 is the base dir, its name is the full base path. 
+ */
+#define SNAP_MAGIC "MONSNAP\0"
+#define SNAP_VERSION 1
+#define SNAP_NO_PARENT UINT32_MAX
+
+struct snap_header {
+    char magic[8]; // SNAP_MAGIC
+    uint32_t version; // SNAP_VERSION
+    uint32_t header_size; // sizeof(struct snap_header)
+    uint32_t record_size; // sizeof(struct snap_record)
+    uint32_t checksum; // FNV-1a of the records and name bytes
+    uint64_t record_cnt; // number of records
+    uint64_t records_off; // file offset of the first record
+    uint64_t names_off; // file offset of the name bytes
+    uint64_t names_len; // length of the name bytes
+    uint64_t file_size; // total file size
+};
+
+struct snap_record {
+    uint64_t ino; // inode of the dir when it was last listed
+    int64_t mtime_ns; // mtime of the dir when it was last listed
+    uint32_t parent; // index of the parent record, SNAP_NO_PARENT for the base dir
+    uint32_t name_off; // offset of the name in the name bytes
+    uint32_t name_len; // length of the name, not NUL terminated
+    uint32_t reserved;
+};
+
+/* Write the monitor's watch tree, with each dir's inode and mtime, to path. 
+ * The file is written next to path and renamed over it, so readers never see a partial one. 
+ * Returns 0 on success. 
+ */
+int monitor_save_snapshot(struct fs_event_manager *mon, const char *path);
+
+/* Rebuild the watch tree from the snapshot at path, instead of listing every dir. 
+ * Each dir in the snapshot is watched and stat()ed. Only dirs whose mtime or inode 
+ * changed are listed again, new sub dirs found there are scanned in full. 
+ * The monitor's inotify instance must be set up and its tree empty. 
+ * Returns 0 if the tree was restored. Returns -1, with the tree left empty, if the snapshot 
+ * is missing, corrupt or for another base dir, and the caller should do a full scan. 
+ */
+int monitor_load_snapshot(struct fs_event_manager *mon, const char *path);
+
+#endif
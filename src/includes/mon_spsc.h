@@ -0,0 +1,54 @@
+#ifndef MON_SPSC_H
+#define MON_SPSC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MON_CACHE_LINE 64
+
+/* Lock-free single producer/single consumer ring of fixed size slots. 
+ * head and tail only ever grow, slot i lives at (i & mask). Each side keeps a cached 
+ * copy of the other side's index on its own cache line, so it only reads the shared 
+ * one when the cached value says the ring looks full (producer) or empty (consumer). 
+ */
+struct mon_spsc {
+    // Consumer side
+    size_t head __attribute__((aligned(MON_CACHE_LINE))); // next slot to consume
+    size_t cached_tail; // consumer's last look at tail
+    // Producer side
+    size_t tail __attribute__((aligned(MON_CACHE_LINE))); // next slot to produce
+    size_t cached_head; // producer's last look at head
+    size_t high_water; // most slots ever in use, written by the producer
+    uint64_t pushed; // slots published
+    uint64_t full_waits; // times the producer found the ring full
+    // Read only after init
+    char *slots __attribute__((aligned(MON_CACHE_LINE)));
+    size_t mask; // number of slots - 1
+    size_t slot_size; // bytes per slot
+};
+
+/* Set up a ring of at least nslots slots (rounded up to a power of 2) of slot_size bytes. Returns 0 on success */
+int mon_spsc_init(struct mon_spsc *ring, size_t nslots, size_t slot_size);
+
+/* Free the ring's slots */
+void mon_spsc_free(struct mon_spsc *ring);
+
+/* Producer: next free slot to fill, or NULL if the ring is full. Counts a full wait when NULL */
+void *mon_spsc_reserve(struct mon_spsc *ring);
+
+/* Producer: make the slot from mon_spsc_reserve() visible to the consumer */
+void mon_spsc_publish(struct mon_spsc *ring);
+
+/* Consumer: oldest published slot, or NULL if the ring is empty */
+void *mon_spsc_peek(struct mon_spsc *ring);
+
+/* Consumer: hand the slot from mon_spsc_peek() back to the producer */
+void mon_spsc_release(struct mon_spsc *ring);
+
+/* Slots in use right now. Exact from either side, a snapshot from anywhere else */
+size_t mon_spsc_occupancy(struct mon_spsc *ring);
+
+/* Number of slots */
+size_t mon_spsc_capacity(struct mon_spsc *ring);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef MON_THREAD_H
+#define MON_THREAD_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include "mon_spsc.h"
+
+struct fs_event_manager;
+
+/* Default number of events the reader thread can get ahead of the handlers */
+#define MON_READER_DEFAULT_SLOTS 4096
+/* Longest the reader holds the ifd lock waiting for events */
+#define MON_READER_POLL_MS 50
+
+// One event in the handoff ring
+struct mon_event_slot {
+    struct inotify_event event;
+    char name[NAME_MAX + 1];
+    unsigned int ifd_gen; // mon->ifd_gen of the fd the event was read from
+};
+
+// Reader thread of a monitor in threaded mode
+struct mon_reader {
+    struct fs_event_manager *mon;
+    struct mon_spsc ring; // events read, waiting for the handlers
+    int wake_fd; // eventfd, readable when the reader published events
+    int stop; // set to make the reader exit
+    pthread_mutex_t ifd_lock; // held by the reader around each poll/read of mon->ifd, and while mon->ifd is replaced
+    pthread_t thread;
+    char *buf; // the reader's own read buffer, mon->event_buffer belongs to the consumer
+    size_t buf_len;
+};
+
+// Handoff ring usage, for sizing it
+struct mon_reader_stats {
+    size_t capacity; // slots in the ring
+    size_t occupancy; // slots in use right now
+    size_t high_water; // most slots ever in use
+    uint64_t pushed; // events handed to the consumer
+    uint64_t full_waits; // times the reader found the ring full and had to wait for the handlers
+};
+
+/* Start threaded mode on an initialized monitor. A reader thread drains mon->ifd as fast 
+ * as it can into a lock-free ring of slots events (0 for the default). The handlers then 
+ * run on whichever thread calls monitor_consume(), start_monitor_loop_example() does. 
+ * The watch tree is only touched by the consumer. Returns 0 on success. 
+ */
+int monitor_start_thread(struct fs_event_manager *mon, size_t slots);
+
+/* Stop and join the reader thread, events still in the ring are dropped */
+void monitor_stop_thread(struct fs_event_manager *mon);
+
+/* Consumer: hand every event the reader has published to the monitor's handlers, 
+ * in batches like read_events_batch(). Wait on mon->reader->wake_fd for more. 
+ * Returns the number of events handled. 
+ */
+int monitor_consume(struct fs_event_manager *mon);
+
+/* Fill stats with the handoff ring's usage. Returns 0, or -1 if the monitor isn't threaded */
+int monitor_thread_stats(struct fs_event_manager *mon, struct mon_reader_stats *stats);
+
+/* Hold off the reader while mon->ifd is closed or replaced. No-ops unless threaded */
+void monitor_lock_ifd(struct fs_event_manager *mon);
+void monitor_unlock_ifd(struct fs_event_manager *mon);
+
+#endif
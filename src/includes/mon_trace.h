@@ -0,0 +1,114 @@
+#ifndef MON_TRACE_H
+#define MON_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "mon_metrics.h"
+
+/* Needs mon_fs.h included first, for event_handler */
+struct fs_event_manager;
+struct w_dir;
+
+/* Trace file layout. Fixed width and little endian as written by this host, replayed
+ * straight from mmap().
+ *   [trace_header][base path][trace_record + payload]...
+ * The records start with the watch tree as it was when recording started, as
+ * TRACE_WATCH_ADD records in pre-order, then follow the monitor in the order things
+ * happened. Tree changes made while handling a read come after its TRACE_READ.
+ */
+#define TRACE_MAGIC "MONTRACE"
+#define TRACE_VERSION 1
+/* stdio buffer of a trace being recorded, records hit the disk in chunks this big */
+#define TRACE_WRITE_BUF (1024 * 1024)
+
+enum trace_record_type {
+    TRACE_READ = 1, // payload: the raw inotify_event buffer of one read
+    TRACE_WATCH_ADD, // payload: trace_watch, then the name
+    TRACE_WATCH_RM, // payload: trace_watch, the dir and everything below it were removed
+    TRACE_WATCH_MOVE, // payload: trace_watch with the new parent, then the new name
+    TRACE_RESET, // no payload, the whole tree was dropped, e.g. by reset_monitor()
+};
+
+struct trace_header {
+    char magic[8]; // TRACE_MAGIC, not NUL terminated
+    uint32_t version; // TRACE_VERSION
+    uint32_t header_size; // sizeof(struct trace_header)
+    uint32_t mask; // watch mask of the recorded monitor
+    uint32_t base_len; // length of the base path that follows the header
+    uint64_t start_ns; // monotonic time recording started
+};
+
+struct trace_record {
+    uint32_t type; // enum trace_record_type
+    uint32_t len; // payload bytes that follow
+    uint64_t ts_ns; // monotonic time of the read or change
+};
+
+struct trace_watch {
+    int32_t wd; // watch descriptor of the dir
+    int32_t parent_wd; // its parent's, -1 for the base dir
+};
+
+// Replay timing, from monitor_replay()
+struct mon_replay_stats {
+    uint64_t reads; // TRACE_READ records replayed
+    uint64_t events; // events handed to the handlers
+    uint64_t changes; // recorded tree changes applied
+    uint64_t fake_wds; // watches the handlers added that were matched to the trace
+    uint64_t elapsed_ns; // wall time of the replay
+    uint64_t handler_ns; // time spent in the handlers
+    uint64_t latency_max_ns; // slowest single event
+    uint64_t latency_p50_ns; // median event handling time
+    uint64_t latency_p99_ns;
+    double events_per_sec; // events / elapsed
+};
+
+// Recording or replay in progress on a monitor, mon->trace
+struct mon_trace {
+    int replay; // 0 when recording, 1 when replaying
+    FILE *file; // recording: the trace being written
+    uint64_t records; // recording: records written
+    int failed; // recording: a write failed, nothing more is written
+    // Replay state
+    const char *map; // the mmap()ed trace
+    size_t map_len;
+    size_t pending_off; // first tree change made while handling the current read
+    size_t pending_end; // end of those changes
+    int next_wd; // wd handed to the next watch added while applying a recorded change, -1 if none
+    char *path; // scratch for matching paths to pending changes
+    size_t path_size;
+    event_handler orig_handler; // mon->handler, wrapped to time each event
+    struct mon_hist latency; // event handling time
+    struct mon_replay_stats stats;
+};
+
+/* Start recording everything mon reads and each change to its watch tree to path.
+ * The current tree is written first. Returns 0 on success.
+ */
+int monitor_trace_start(struct fs_event_manager *mon, const char *path);
+
+/* Stop recording and close the trace */
+void monitor_trace_stop(struct fs_event_manager *mon);
+
+/* Recording hooks, no-ops unless mon is recording */
+void monitor_trace_read(struct fs_event_manager *mon, const char *buf, size_t len);
+void monitor_trace_watch(struct fs_event_manager *mon, enum trace_record_type type, struct w_dir *wdir);
+
+/* Replay hook. The wd a handler's watch of path was given when recording, or -1 */
+int monitor_trace_fake_wd(struct fs_event_manager *mon, const char *path);
+
+/* Drive mon's handlers from the trace at path, without an inotify instance. mon must
+ * be created for the trace's base dir and not initialized. speed 1.0 replays at the
+ * recorded pace, 2.0 twice as fast, 0 as fast as possible. The recorded tree changes
+ * are applied after each read's handlers, and watches the handlers add themselves
+ * get the recorded wds. Fills stats if not NULL. Returns 0 on success.
+ */
+int monitor_replay(struct fs_event_manager *mon, const char *path, double speed, struct mon_replay_stats *stats);
+
+/* Copy the base path and watch mask of the trace at path into base and mask, to create 
+ * the monitor to replay it with. Returns 0 on success. 
+ */
+int monitor_trace_info(const char *path, char *base, size_t base_size, uint32_t *mask);
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef MON_URING_H
+#define MON_URING_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/time_types.h>
+
+struct fs_event_manager;
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/* Default number of submission queue entries */
+#define MON_URING_DEFAULT_ENTRIES 256
+
+struct uring_file_batch;
+
+// One changed file to read with mon_uring_read_files()
+struct uring_file_req {
+    const char *path; // file to read
+    char *buf; // destination for the file's first buflen bytes
+    size_t buflen; // bytes available in buf
+    ssize_t result; // bytes read, or -errno if the open or read failed
+    int fd; // internal, fd while the file is open
+    struct uring_file_batch *batch; // internal, batch this request belongs to
+};
+
+/* Called once every file of a batch has been read and closed */
+typedef void (*uring_files_cb)(struct uring_file_req *reqs, size_t cnt, void *data);
+
+// State of one mon_uring_read_files() call
+struct uring_file_batch {
+    struct uring_file_req *reqs;
+    size_t cnt;
+    size_t pending; // requests not closed yet
+    uring_files_cb cb;
+    void *data;
+};
+
+// Monitor driven by the ring
+struct uring_monitor {
+    struct fs_event_manager *mon;
+    unsigned int armed_gen; // mon->ifd_gen of the fd the read in flight was issued on
+    int armed; // a poll+read of mon->ifd is in flight
+    int cancelled; // a cancel of the in flight read was submitted
+    int timer_armed; // a poll of the coalesce timerfd is in flight
+    int failed; // the poll or read on the armed_gen fd failed for good, it's re-armed once the fd is replaced
+};
+
+// io_uring instance, set up with raw syscalls
+struct mon_uring {
+    int ring_fd;
+    unsigned int sq_entries;
+    unsigned int cq_entries;
+    void *sq_ring; // mmap of the submission ring
+    size_t sq_ring_len;
+    void *cq_ring; // mmap of the completion ring, same as sq_ring with IORING_FEAT_SINGLE_MMAP
+    size_t cq_ring_len;
+    struct io_uring_sqe *sqes; // mmap of the submission entries
+    size_t sqes_len;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned int to_submit; // entries queued since the last io_uring_enter()
+    int timeout_armed; // a timeout bounding the wait is in flight
+    struct __kernel_timespec timeout_ts; // duration of that timeout, must outlive the submit
+    int running; // cleared by mon_uring_stop()
+    struct uring_monitor **mons; // registered monitors
+    size_t mon_cnt;
+    size_t mon_size;
+    uint64_t enters; // io_uring_enter() calls made
+    uint64_t completions; // completions reaped
+};
+
+/* Set up an io_uring with entries submission slots, 0 for the default. 
+ * Returns NULL if the kernel has no io_uring, it's disabled, or it lacks an op the backend 
+ * uses (needs 5.6+). Callers then fall back to the epoll reactor, see mon_reactor.h. 
+ */
+struct mon_uring *mon_uring_create(unsigned int entries);
+
+/* Tear down the ring. Registered monitors are left running. Reads of files in flight are dropped */
+void mon_uring_destroy(struct mon_uring *ring);
+
+/* Read events of an initialized monitor through the ring. Each read is queued as a poll 
+ * linked to a read, so inotify's non-blocking fd is only read once it has events. 
+ * Coalesce timers, pending moves and resyncs are driven too. Monitors with a reader 
+ * thread are refused. Returns 0 on success. 
+ */
+int mon_uring_add_monitor(struct mon_uring *ring, struct fs_event_manager *mon);
+
+/* Read the first buflen bytes of each file in reqs, with every open, read and close going 
+ * through the ring. All opens are submitted together, then each read is hard linked to its close. 
+ * cb is called from mon_uring_run_once() once all are done, reqs must stay valid until then. 
+ * With a NULL ring the files are read with open/read/close right away and cb called before 
+ * returning. Returns 0 if the batch was queued. 
+ */
+int mon_uring_read_files(struct mon_uring *ring, struct uring_file_req *reqs, size_t cnt, 
+                         uring_files_cb cb, void *data);
+
+/* Submit what's queued, wait up to timeout_ms (-1 for no limit) for completions and handle them. 
+ * Returns the number of completions handled, or -1 on error. 
+ */
+int mon_uring_run_once(struct mon_uring *ring, int timeout_ms);
+
+/* Run until mon_uring_stop() is called */
+int mon_uring_run(struct mon_uring *ring);
+
+/* Make mon_uring_run() return after the current pass */
+void mon_uring_stop(struct mon_uring *ring);
+
+#endif
@@ -1,14 +1,17 @@
 #include <syslog.h>
+#include <stdint.h>
 #include <jansson.h>
+#include "mon_log.h"
 
-int _LOCAL_DEBUG;
+extern int _LOCAL_DEBUG;
+/* Also print log messages to stdout. Enabling it turns on LOG_DEBUG, disabling goes back to MON_LOG_DEFAULT_LEVEL */
 int set_local_debug_enabled(int enabled);    
 int _local_debug_enabled(void);
 
+// Arguments are only evaluated when the level is enabled, see mon_log.h
 #define MONLOG(lev, fmt, args...) do {\
-    syslog(lev, "[%s:%d:%s()] " fmt, __FILE__, __LINE__, __func__, ##args);\
-    if (_local_debug_enabled() != 0) \
-        printf("%s:%s:%d:%s():" fmt, #lev, __FILE__, __LINE__, __func__, ##args);\
+    if (MON_LOG_ENABLED(lev)) \
+        mon_log_write(lev, "[%s:%d:%s()] " fmt, __FILE__, __LINE__, __func__, ##args);\
 } while(0)
 
 #define LOGDEBUG(a, args...) MONLOG(LOG_DEBUG, a, ##args)
@@ -28,3 +31,6 @@ int delete_file(char *fpath);
 
 json_t *json_from_file(char *path);
 
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t mon_monotonic_ns(void);
+
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "includes/mon_alloc.h"
+#include "includes/mon_utils.h"
+
+/* Slab/arena allocator backing the watch tree. 
+ * A tree of 100k+ dirs means 100k+ small allocations of nodes and names, which are 
+ * created and dropped constantly on busy trees. Carving them from a few large chunks 
+ * keeps malloc out of the event path, and lets the whole tree be dropped in one pass. 
+ */
+
+struct mon_arena_chunk {
+    struct mon_arena_chunk *next; // next (older) chunk
+    size_t size; // usable bytes in data
+    size_t used; // bytes bumped so far
+    char data[] __attribute__((aligned(MON_NAME_GRAIN)));
+};
+
+// Link stored in the first bytes of a released node or name
+struct mon_free_slot {
+    struct mon_free_slot *next;
+};
+
+static size_t _round_grain(size_t len){
+    return (len + MON_NAME_GRAIN - 1) & ~((size_t)MON_NAME_GRAIN - 1);
+}
+
+void mon_alloc_init(struct mon_alloc *alloc, size_t node_size){
+    memset(alloc, 0, sizeof(*alloc));
+    alloc->chunk_size = MON_ARENA_CHUNK_SIZE;
+    if (node_size < sizeof(struct mon_free_slot)){
+        node_size = sizeof(struct mon_free_slot);
+    }
+    alloc->node_size = _round_grain(node_size);
+}
+
+/* Bump len bytes (a multiple of MON_NAME_GRAIN) off the newest chunk, 
+ * starting a new chunk when it doesn't fit */
+static void *_arena_bump(struct mon_alloc *alloc, size_t len){
+    struct mon_arena_chunk *chunk = alloc->chunks;
+    if (!chunk || chunk->size - chunk->used < len){
+        size_t size = len > alloc->chunk_size ? len : alloc->chunk_size;
+        chunk = malloc(sizeof(struct mon_arena_chunk) + size);
+        if (!chunk){
+            LOGERROR("Failed to alloc arena chunk of '%zu' bytes\n", size);
+            return NULL;
+        }
+        chunk->size = size;
+        chunk->used = 0;
+        alloc->bytes_reserved += sizeof(struct mon_arena_chunk) + size;
+        if (alloc->chunks && len > alloc->chunk_size){
+            // Oversized one-off, keep bumping from the current chunk afterwards
+            chunk->next = alloc->chunks->next;
+            alloc->chunks->next = chunk;
+        }else{
+            chunk->next = alloc->chunks;
+            alloc->chunks = chunk;
+        }
+    }
+    void *ret = chunk->data + chunk->used;
+    chunk->used += len;
+    return ret;
+}
+
+void *mon_alloc_node(struct mon_alloc *alloc){
+    void *node = alloc->free_nodes;
+    if (node){
+        alloc->free_nodes = ((struct mon_free_slot *)node)->next;
+    }else{
+        node = _arena_bump(alloc, alloc->node_size);
+        if (!node){
+            return NULL;
+        }
+    }
+    memset(node, 0, alloc->node_size);
+    alloc->bytes_in_use += alloc->node_size;
+    return node;
+}
+
+void mon_free_node(struct mon_alloc *alloc, void *node){
+    if (!node){
+        return;
+    }
+    ((struct mon_free_slot *)node)->next = alloc->free_nodes;
+    alloc->free_nodes = node;
+    alloc->bytes_in_use -= alloc->node_size;
+}
+
+char *mon_alloc_name(struct mon_alloc *alloc, size_t len){
+    size_t size = _round_grain(len + 1);
+    size_t class = size / MON_NAME_GRAIN - 1;
+    char *name = NULL;
+    if (class < MON_NAME_CLASSES && alloc->free_names[class]){
+        name = alloc->free_names[class];
+        alloc->free_names[class] = ((struct mon_free_slot *)name)->next;
+    }else{
+        name = _arena_bump(alloc, size);
+        if (!name){
+            return NULL;
+        }
+    }
+    alloc->bytes_in_use += size;
+    return name;
+}
+
+void mon_free_name(struct mon_alloc *alloc, char *name, size_t len){
+    if (!name){
+        return;
+    }
+    size_t size = _round_grain(len + 1);
+    size_t class = size / MON_NAME_GRAIN - 1;
+    alloc->bytes_in_use -= size;
+    if (class < MON_NAME_CLASSES){
+        ((struct mon_free_slot *)(void *)name)->next = alloc->free_names[class];
+        alloc->free_names[class] = name;
+    }
+    // Longer names (only ever a base path) stay in the arena until release
+}
+
+void mon_alloc_release(struct mon_alloc *alloc){
+    struct mon_arena_chunk *chunk = alloc->chunks;
+    while (chunk != NULL){
+        struct mon_arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    mon_alloc_init(alloc, alloc->node_size);
+}
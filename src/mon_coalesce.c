@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/timerfd.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_coalesce.h"
+#include "includes/mon_utils.h"
+
+/* Coalescing/debounce stage. 
+ * Writing a large file produces an IN_MODIFY per write() call. Held back events are 
+ * kept in a fixed pool, indexed by a hash of (wd, name) and linked in arrival order. 
+ * Since every key is held for the same window, arrival order is also expiry order, 
+ * so the timerfd only ever needs arming for the list head. 
+ */
+
+static uint32_t _coalesce_hash(int wd, const char *name, size_t len){
+    uint32_t hash = 2166136261u ^ (uint32_t)wd;
+    hash *= 16777619u;
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void _coalesce_arm(struct mon_coalesce *co){
+    uint64_t expires = co->head ? co->head->expires_ns : 0;
+    if (expires == co->armed_ns){
+        return;
+    }
+    // An all zero it_value disarms the timer
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = expires / 1000000000ull;
+    its.it_value.tv_nsec = expires % 1000000000ull;
+    if (timerfd_settime(co->timer_fd, TFD_TIMER_ABSTIME, &its, NULL)){
+        LOGERROR("Failed to arm coalesce timer, err:'%s'\n", strerror(errno));
+    }
+    co->armed_ns = expires;
+}
+
+static struct coalesce_entry *_coalesce_find(struct mon_coalesce *co, int wd, const char *name, size_t len, uint32_t hash){
+    struct coalesce_entry *entry = co->buckets[hash & co->bucket_mask];
+    for (; entry != NULL; entry = entry->hnext){
+        if (entry->hash == hash && entry->wd == wd && entry->name_len == len && !memcmp(entry->name, name, len)){
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Hand the batch handler the events that passed through ahead of one about to be delivered
+static int _coalesce_run_flush(struct fs_event_manager *mon){
+    struct mon_coalesce *co = mon->coalesce;
+    if (!co || !co->run_len){
+        return 0;
+    }
+    struct mon_event *run = co->run;
+    size_t len = co->run_len;
+    co->run += len;
+    co->run_len = 0;
+    return mon->batch_handler(run, len, mon);
+}
+
+/* Unlink entry from the stage, deliver it to the handlers, and return it to the free list */
+static void _coalesce_deliver(struct fs_event_manager *mon, struct coalesce_entry *entry){
+    struct mon_coalesce *co = mon->coalesce;
+    struct coalesce_entry **pptr = &co->buckets[entry->hash & co->bucket_mask];
+    while (*pptr != entry){
+        pptr = &(*pptr)->hnext;
+    }
+    *pptr = entry->hnext;
+    if (entry->prev){
+        entry->prev->next = entry->next;
+    }else{
+        co->head = entry->next;
+    }
+    if (entry->next){
+        entry->next->prev = entry->prev;
+    }else{
+        co->tail = entry->prev;
+    }
+    union {
+        struct inotify_event event;
+        char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+    } ev;
+    memset(&ev.event, 0, sizeof(ev.event));
+    ev.event.wd = entry->wd;
+    ev.event.mask = entry->mask;
+    if (entry->name_len){
+        ev.event.len = entry->name_len + 1;
+        memcpy(ev.event.name, entry->name, entry->name_len + 1);
+    }
+    if (entry->merged > 1){
+        LOGDEBUG("Delivering '%u' merged events for wd:'%d', name:'%s'\n", entry->merged, entry->wd, entry->name);
+    }
+    entry->next = co->free_list;
+    co->free_list = entry;
+    co->events_out++;
+    _coalesce_run_flush(mon);
+    monitor_deliver_event(mon, &ev.event);
+}
+
+// Deliver everything held back for wd, its watch is going away
+static void _coalesce_flush_wd(struct fs_event_manager *mon, int wd){
+    struct coalesce_entry *entry = mon->coalesce->head;
+    struct coalesce_entry *next = NULL;
+    for (; entry != NULL; entry = next){
+        next = entry->next;
+        if (entry->wd == wd){
+            _coalesce_deliver(mon, entry);
+            // The handler may have flushed more, restart from the head
+            next = mon->coalesce ? mon->coalesce->head : NULL;
+        }
+    }
+}
+
+/* Enable coalescing of IN_MODIFY/IN_ATTRIB events on the monitor */
+int monitor_set_coalesce(struct fs_event_manager *mon, uint32_t window_ms){
+    if (!mon){
+        LOGERROR("Null monitor provided to coalesce\n");
+        return -1;
+    }
+    if (!window_ms){
+        monitor_coalesce_flush_all(mon);
+        monitor_coalesce_free(mon);
+        return 0;
+    }
+    if (mon->coalesce){
+        mon->coalesce->window_ms = window_ms;
+        return 0;
+    }
+    struct mon_coalesce *co = calloc(1, sizeof(struct mon_coalesce));
+    if (!co){
+        LOGERROR("Failed to alloc coalesce stage\n");
+        return -1;
+    }
+    co->window_ms = window_ms;
+    co->bucket_mask = MON_COALESCE_MAX_PENDING * 2 - 1;
+    co->entries = calloc(MON_COALESCE_MAX_PENDING, sizeof(struct coalesce_entry));
+    co->buckets = calloc(co->bucket_mask + 1, sizeof(struct coalesce_entry *));
+    co->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!co->entries || !co->buckets || co->timer_fd < 0){
+        LOGERROR("Failed to create coalesce stage, err:'%s'\n", strerror(errno));
+        if (co->timer_fd >= 0){
+            close(co->timer_fd);
+        }
+        free(co->entries);
+        free(co->buckets);
+        free(co);
+        return -1;
+    }
+    for (int i = MON_COALESCE_MAX_PENDING - 1; i >= 0; i--){
+        co->entries[i].next = co->free_list;
+        co->free_list = &co->entries[i];
+    }
+    mon->coalesce = co;
+    return 0;
+}
+
+/* Feed event to the stage. Returns 1 if it was held back, 0 if it passes through, after 
+ * anything held back for its key has been delivered */
+static int _coalesce_add(struct fs_event_manager *mon, struct inotify_event *event){
+    struct mon_coalesce *co = mon->coalesce;
+    co->events_in++;
+    const char *name = event->len ? event->name : "";
+    size_t len = strnlen(name, event->len);
+    uint32_t hash = _coalesce_hash(event->wd, name, len);
+    struct coalesce_entry *entry = _coalesce_find(co, event->wd, name, len, hash);
+    if ((event->mask & ~IN_ISDIR) && !(event->mask & ~(MON_COALESCE_MASK | IN_ISDIR))){
+        if (entry){
+            entry->mask |= event->mask;
+            entry->merged++;
+            return 1;
+        }
+        if (!co->free_list){
+            // Pool is full, make room by delivering the oldest early
+            _coalesce_deliver(mon, co->head);
+            if (!(co = mon->coalesce)){
+                return 0;
+            }
+        }
+        entry = co->free_list;
+        co->free_list = entry->next;
+        entry->wd = event->wd;
+        entry->mask = event->mask;
+        entry->merged = 1;
+        entry->hash = hash;
+        entry->expires_ns = mon_monotonic_ns() + (uint64_t)co->window_ms * 1000000ull;
+        entry->name_len = len;
+        memcpy(entry->name, name, len);
+        entry->name[len] = '\0';
+        entry->hnext = co->buckets[hash & co->bucket_mask];
+        co->buckets[hash & co->bucket_mask] = entry;
+        entry->next = NULL;
+        entry->prev = co->tail;
+        if (co->tail){
+            co->tail->next = entry;
+        }else{
+            co->head = entry;
+        }
+        co->tail = entry;
+        _coalesce_arm(co);
+        return 1;
+    }
+    // Anything else for the key ends the burst, deliver what was held back before it
+    if (entry){
+        _coalesce_deliver(mon, entry);
+    }
+    if ((event->mask & (IN_IGNORED | IN_DELETE_SELF)) && mon->coalesce){
+        _coalesce_flush_wd(mon, event->wd);
+    }
+    if (mon->coalesce){
+        mon->coalesce->events_out++;
+        _coalesce_arm(mon->coalesce);
+    }
+    return 0;
+}
+
+/* event_handler that feeds the coalescing stage, data must be the monitor */
+int monitor_coalesce_handler(struct inotify_event *event, void *data){
+    struct fs_event_manager *mon = data;
+    if (!event || !mon){
+        LOGERROR("Null event or monitor passed to coalesce handler\n");
+        return -1;
+    }
+    if (mon->coalesce && _coalesce_add(mon, event)){
+        return 0;
+    }
+    return monitor_deliver_event(mon, event);
+}
+
+/* Run a read's events through the stage, handing the ones that pass through to mon->batch_handler */
+int monitor_coalesce_batch(struct fs_event_manager *mon, struct mon_event *events, size_t cnt){
+    struct mon_coalesce *co = mon->coalesce;
+    size_t i = 0;
+    if (!co){
+        return mon->batch_handler(events, cnt, mon);
+    }
+    co->run = events;
+    co->run_len = 0;
+    for (; i < cnt; i++){
+        struct mon_event mev = events[i];
+        if ((co = mon->coalesce) && co->run && _coalesce_add(mon, mev.event)){
+            continue;
+        }
+        if (!(co = mon->coalesce) || !co->run){
+            /* A handler turned coalescing off, or back on with a new stage. Whatever 
+             * passed through before was handed on first, the rest goes straight on */
+            return mon->batch_handler(&events[i], cnt - i, mon);
+        }
+        // Passes through, the run never gets ahead of i so the slot is free
+        co->run[co->run_len++] = mev;
+    }
+    int ret = _coalesce_run_flush(mon);
+    if (mon->coalesce){
+        mon->coalesce->run = NULL;
+    }
+    return ret;
+}
+
+/* timerfd that becomes readable when held back events are due */
+int monitor_coalesce_fd(struct fs_event_manager *mon){
+    return (mon && mon->coalesce) ? mon->coalesce->timer_fd : -1;
+}
+
+/* Deliver held back events whose window has passed */
+int monitor_coalesce_flush_expired(struct fs_event_manager *mon){
+    int cnt = 0;
+    uint64_t expirations;
+    if (!mon || !mon->coalesce){
+        return 0;
+    }
+    // Drain the timerfd, it's re-armed below for whatever is left
+    if (read(mon->coalesce->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN){
+        LOGERROR("Failed to read coalesce timer, err:'%s'\n", strerror(errno));
+    }
+    mon->coalesce->armed_ns = UINT64_MAX;
+    uint64_t now = mon_monotonic_ns();
+    while (mon->coalesce && mon->coalesce->head && mon->coalesce->head->expires_ns <= now){
+        _coalesce_deliver(mon, mon->coalesce->head);
+        cnt++;
+    }
+    if (mon->coalesce){
+        _coalesce_arm(mon->coalesce);
+    }
+    return cnt;
+}
+
+/* Deliver every held back event now */
+int monitor_coalesce_flush_all(struct fs_event_manager *mon){
+    int cnt = 0;
+    while (mon && mon->coalesce && mon->coalesce->head){
+        _coalesce_deliver(mon, mon->coalesce->head);
+        cnt++;
+    }
+    if (mon && mon->coalesce){
+        _coalesce_arm(mon->coalesce);
+    }
+    return cnt;
+}
+
+/* Free the coalescing stage, dropping anything held back */
+void monitor_coalesce_free(struct fs_event_manager *mon){
+    if (!mon || !mon->coalesce){
+        return;
+    }
+    struct mon_coalesce *co = mon->coalesce;
+    LOGDEBUG("Coalesce stage took '%llu' events, delivered '%llu'\n", 
+             (unsigned long long)co->events_in, (unsigned long long)co->events_out);
+    mon->coalesce = NULL;
+    close(co->timer_fd);
+    free(co->entries);
+    free(co->buckets);
+    free(co);
+}
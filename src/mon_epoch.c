@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_epoch.h"
+#include "includes/mon_utils.h"
+
+/* Epoch based reclamation.
+ * An object retired at epoch r was unlinked before the writer moved the epoch past r,
+ * so a reader that announces r + 1 or later can't reach it. Once every reader in a
+ * read section announced a later epoch than r, or there are none, it can be freed.
+ */
+
+/* Set up ep for up to max_readers readers */
+int mon_epoch_init(struct mon_epoch *ep, int max_readers){
+    if (!ep){
+        return -1;
+    }
+    memset(ep, 0, sizeof(struct mon_epoch));
+    ep->max_readers = max_readers > 0 ? max_readers : MON_EPOCH_MAX_READERS;
+    if (posix_memalign((void **)&ep->slots, 64, ep->max_readers * sizeof(struct mon_epoch_slot))){
+        LOGERROR("Failed to alloc '%d' epoch reader slots\n", ep->max_readers);
+        ep->slots = NULL;
+        return -1;
+    }
+    memset(ep->slots, 0, ep->max_readers * sizeof(struct mon_epoch_slot));
+    ep->global = 1;
+    return 0;
+}
+
+/* Free everything retired and the slots */
+void mon_epoch_free(struct mon_epoch *ep){
+    if (!ep){
+        return;
+    }
+    mon_epoch_synchronize(ep);
+    free(ep->retired);
+    free(ep->slots);
+    ep->retired = NULL;
+    ep->slots = NULL;
+    ep->retired_cnt = 0;
+    ep->retired_size = 0;
+}
+
+/* Claim a slot for the calling reader thread */
+struct mon_epoch_slot *mon_epoch_register(struct mon_epoch *ep){
+    for (int i = 0; ep && ep->slots && i < ep->max_readers; i++){
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ep->slots[i].in_use, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+            return &ep->slots[i];
+        }
+    }
+    LOGERROR("No free epoch reader slots\n");
+    return NULL;
+}
+
+/* Give a slot back */
+void mon_epoch_unregister(struct mon_epoch *ep, struct mon_epoch_slot *slot){
+    (void)ep;
+    if (!slot){
+        return;
+    }
+    __atomic_store_n(&slot->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Oldest epoch a reader is still reading in, or the current epoch if none is
+static uint64_t _epoch_oldest(struct mon_epoch *ep, uint64_t now){
+    uint64_t oldest = now;
+    for (int i = 0; i < ep->max_readers; i++){
+        uint64_t epoch = __atomic_load_n(&ep->slots[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest){
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+// Free the retired entries from before epoch, they're in retire order
+static size_t _epoch_free_before(struct mon_epoch *ep, uint64_t epoch){
+    size_t cnt = 0;
+    while (cnt < ep->retired_cnt && ep->retired[cnt].epoch < epoch){
+        struct mon_retired *entry = &ep->retired[cnt];
+        entry->func(entry->ptr, entry->arg);
+        cnt++;
+    }
+    if (cnt){
+        ep->retired_cnt -= cnt;
+        memmove(ep->retired, ep->retired + cnt, ep->retired_cnt * sizeof(struct mon_retired));
+        ep->reclaimed += cnt;
+    }
+    return cnt;
+}
+
+/* Writer: advance the epoch and free what no reader can still see */
+size_t mon_epoch_reclaim(struct mon_epoch *ep){
+    if (!ep || !ep->retired_cnt){
+        return 0;
+    }
+    uint64_t now = __atomic_add_fetch(&ep->global, 1, __ATOMIC_SEQ_CST);
+    return _epoch_free_before(ep, _epoch_oldest(ep, now));
+}
+
+/* Writer: free ptr once no reader can hold it */
+int mon_epoch_retire(struct mon_epoch *ep, void *ptr, mon_retire_func func, void *arg){
+    if (!ep || !ptr || !func){
+        return -1;
+    }
+    if (ep->retired_cnt >= MON_EPOCH_RECLAIM_BATCH && ep->retired_cnt == ep->retired_size){
+        mon_epoch_reclaim(ep);
+    }
+    if (ep->retired_cnt == ep->retired_size){
+        size_t size = ep->retired_size ? ep->retired_size * 2 : MON_EPOCH_RECLAIM_BATCH;
+        struct mon_retired *retired = realloc(ep->retired, size * sizeof(struct mon_retired));
+        if (!retired){
+            LOGERROR("Failed to grow epoch retire list to '%zu' entries, waiting on readers\n", size);
+            mon_epoch_synchronize(ep);
+            func(ptr, arg);
+            return -1;
+        }
+        ep->retired = retired;
+        ep->retired_size = size;
+    }
+    struct mon_retired *entry = &ep->retired[ep->retired_cnt++];
+    entry->ptr = ptr;
+    entry->func = func;
+    entry->arg = arg;
+    entry->epoch = __atomic_load_n(&ep->global, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Writer: wait for every reader inside a read section to leave it, then free everything retired */
+void mon_epoch_synchronize(struct mon_epoch *ep){
+    if (!ep || !ep->slots){
+        return;
+    }
+    uint64_t now = __atomic_add_fetch(&ep->global, 1, __ATOMIC_SEQ_CST);
+    // Readers that enter from here on see nothing retired so far, only wait on the ones already in
+    while (_epoch_oldest(ep, now) < now){
+        sched_yield();
+    }
+    _epoch_free_before(ep, now);
+}
+
+/* Turn on lock-free path lookups for mon */
+int monitor_enable_readers(struct fs_event_manager *mon, int max_readers){
+    if (!mon){
+        LOGERROR("Null monitor provided to enable readers\n");
+        return -1;
+    }
+    if (mon->epoch){
+        return 0;
+    }
+    struct mon_epoch *ep = malloc(sizeof(struct mon_epoch));
+    if (!ep || mon_epoch_init(ep, max_readers)){
+        LOGERROR("Failed to set up readers for:'%s'\n", mon->base_path ?: "");
+        free(ep);
+        return -1;
+    }
+    mon->epoch = ep;
+    return 0;
+}
+
+/* Register the calling thread as a reader of mon */
+struct mon_epoch_slot *monitor_reader_register(struct fs_event_manager *mon){
+    if (!mon || !mon->epoch){
+        LOGERROR("Readers not enabled on monitor, see monitor_enable_readers()\n");
+        return NULL;
+    }
+    return mon_epoch_register(mon->epoch);
+}
+
+/* Unregister a reader of mon */
+void monitor_reader_unregister(struct fs_event_manager *mon, struct mon_epoch_slot *slot){
+    if (mon && mon->epoch){
+        mon_epoch_unregister(mon->epoch, slot);
+    }
+}
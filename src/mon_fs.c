@@ -8,8 +8,20 @@
 #include <sys/types.h>
 #include <sys/inotify.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
 #include <jansson.h>
 #include "includes/mon_fs.h"
+#include "includes/mon_scan.h"
+#include "includes/mon_snapshot.h"
+#include "includes/mon_resync.h"
+#include "includes/mon_coalesce.h"
+#include "includes/mon_thread.h"
+#include "includes/mon_shard.h"
+#include "includes/mon_epoch.h"
+#include "includes/mon_trace.h"
+#include "includes/mon_metrics.h"
 #include "includes/mon_utils.h"
 
 /* POC to show how inotify events can be used to monitor a directory and dynamically + recursively add/remove triggers
@@ -39,10 +51,17 @@
  */
 
 
+static int _scan_subtree(struct w_dir *top, struct fs_event_manager *mon);
+static int _scan_subtree_parallel(struct w_dir *top, struct fs_event_manager *mon, int nthreads);
+
 void debug_show_list(struct w_dir *list){
     struct w_dir *wlist = list;
     int cnt = 0;
     struct w_dir *ptr = wlist;
+    if (!MON_LOG_ENABLED(LOG_DEBUG)){
+        // Don't walk the whole tree for nothing
+        return;
+    }
     //LOGERROR("---- WATCHED DIRS:\n");
     LOGDEBUG("---- WATCHED DIRS:\n");
     if (!wlist){
@@ -50,11 +69,9 @@ void debug_show_list(struct w_dir *list){
         LOGDEBUG("\tWATCH_LIST EMPTY\n");
     }else{
         while(ptr != NULL) {
-            //LOGERROR("\tLIST[%d] = PATH:'%s', WD:'%d', mask:'0x%lx', ptr:'%p', next:'%p'\n", 
-            //    cnt,  ptr->path, ptr->wd, (unsigned long)ptr->mask, ptr, ptr->next);
-            LOGDEBUG("\tLIST[%d] = PATH:'%s', WD:'%d', mask:'0x%lx', ptr:'%p', next:'%p'\n", 
-                cnt,  ptr->path, ptr->wd, (unsigned long)ptr->mask, ptr, ptr->next);
-            ptr = ptr->next;
+            LOGDEBUG("\tLIST[%d] = NAME:'%s', WD:'%d', PARENT WD:'%d', mask:'0x%lx', ptr:'%p'\n", 
+                cnt,  ptr->name, ptr->wd, ptr->parent ? ptr->parent->wd : -1, (unsigned long)ptr->mask, ptr);
+            ptr = watch_tree_next(ptr, wlist);
             cnt++;
         }
     }
@@ -84,15 +101,17 @@ int monitor_init(struct fs_event_manager *mon){
         LOGERROR("Monitor inotify instance already assigned for mon:'%s'\n", mon->base_path);
     }else{
         // Create the inotify watch instance
-        int ifd = inotify_init();
+        // Non-blocking, so an edge triggered reactor can drain it until EAGAIN
+        int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
         /*checking for error*/
         if (ifd < 0 ) {
             LOGERROR("inotify_init error for path:'%s'\n", mon->base_path);
             return -1; 
         }
         mon->ifd = ifd;
+        mon->ifd_gen++;
     }
-    // Add the base dir to the monitor, this initializes the watch_list with this w_dir 
+    // Add the base dir to the monitor, this initializes the watch_root with this w_dir 
     if (!mon_dir_exists(mon->base_path)){
         // If dir does not exist and this monitor has the restore flag set, we can mkdir here...
         if (mon->restore_base_dir){
@@ -109,7 +128,22 @@ int monitor_init(struct fs_event_manager *mon){
             mon->base_mode = st.st_mode;
         }
     }
-    struct w_dir *wdir = monitor_dir(mon->base_path, mon);
+    struct w_dir *wdir = NULL;
+    if (mon->recursive && mon->snapshot_path && !monitor_load_snapshot(mon, mon->snapshot_path)){
+        // Warm restart, only dirs changed since the snapshot was saved were listed
+        wdir = mon->watch_root;
+    }else if (mon->recursive && mon->discovery_threads > 1){
+        // Watch the base dir here, and let the threads discover everything below it
+        wdir = add_watch_dir_to_monitor(mon->base_path, mon);
+        if (wdir){
+            int nthreads = mon->discovery_threads > DISCOVERY_MAX_THREADS ? DISCOVERY_MAX_THREADS : mon->discovery_threads;
+            if (_scan_subtree_parallel(wdir, mon, nthreads)){
+                _scan_subtree(wdir, mon);
+            }
+        }
+    }else{
+        wdir = monitor_dir(mon->base_path, mon);
+    }
     if (!wdir){
         LOGERROR("Error adding base dir to event monitor:'%s'\n", mon->base_path);
         close(mon->ifd);
@@ -119,10 +153,6 @@ int monitor_init(struct fs_event_manager *mon){
     // Assign the base watch descriptor so there's a starting reference point, 
     // and we dont accidently delete it later
     mon->base_wd = wdir->wd;
-    // our list of watched dirs starts with this  base dir...
-    if (!mon->watch_list){
-        mon->watch_list = wdir;
-    }
     
     return 0;  
 }
@@ -137,15 +167,43 @@ void stop_monitor_loop(struct fs_event_manager *mon){
     mon->loopctl = _stop_loop_callback; 
 }
 
+/* Wait up to mon->interval for inotify events, delivering coalesced events that come due. 
+ * While resyncing, only wait briefly so the resync keeps moving between reads. 
+ * Returns 1 if mon->ifd is readable. 
+ */
+static int _loop_wait(struct fs_event_manager *mon){
+    struct pollfd fds[2];
+    int nfds = 1;
+    int timeout = mon->interval > 0 ? (int)(mon->interval * 1000) : 1000;
+    if (mon->resync_pending){
+        timeout = 1;
+    }
+    // In threaded mode the reader thread reads ifd, wait for it to hand events over
+    fds[0].fd = mon->reader ? mon->reader->wake_fd : mon->ifd;
+    fds[0].events = POLLIN;
+    fds[1].fd = monitor_coalesce_fd(mon);
+    fds[1].events = POLLIN;
+    if (fds[1].fd >= 0){
+        nfds++;
+    }
+    if (poll(fds, nfds, timeout) <= 0){
+        return 0;
+    }
+    if (nfds > 1 && (fds[1].revents & POLLIN)){
+        monitor_coalesce_flush_expired(mon);
+    }
+    return (fds[0].revents & POLLIN) ? 1 : 0;
+}
+
 int start_monitor_loop_example(struct fs_event_manager *mon){
     int cnt = 0;
-    if (!mon || !mon->handler){
+    if (!mon || (!mon->handler && !mon->batch_handler)){
        LOGERROR("Err starting mon loop. Mon null:'%s', mon->handler null:'%s'\n", 
-                mon ? "Y":"N", mon->handler ? "Y":"N"); 
+                mon ? "Y":"N", (mon && (mon->handler || mon->batch_handler)) ? "N":"Y"); 
         return -1;
     }
     LOGDEBUG("Start Monitor Loop with following dirs...\n");
-    debug_show_list(mon->watch_list);
+    debug_show_list(mon->watch_root);
     for (;;){
         if (mon->needs_destroy){
             LOGDEBUG("monitor marked as needs_destroy ending loop\n");
@@ -156,15 +214,21 @@ int start_monitor_loop_example(struct fs_event_manager *mon){
                 break;
             }
         } else {
-            if (mon_fd_has_events(mon->ifd, mon->interval, 0)){
+            if (_loop_wait(mon)){
                 LOGDEBUG("<<< start loop %d handlers >>>\n", cnt);
-                read_events_fd(mon->ifd, mon->event_buffer, mon->buf_len, mon->handler, mon);
+                if (mon->reader){
+                    monitor_consume(mon);
+                }else{
+                    read_events_batch(mon);
+                }
                 LOGDEBUG("<<< end loop %d handlers >>>\n", cnt);
                 cnt++;
             }else{
                 //printf("NO EVENTS DETECTED during interval\n");
-                //debug_show_list(mon->watch_list);
+                //debug_show_list(mon->watch_root);
             }
+            monitor_expire_moves(mon);
+            monitor_resync_step(mon, MON_RESYNC_BATCH);
         }  
     }  
     return 0;
@@ -182,12 +246,22 @@ int reset_monitor(struct fs_event_manager *mon){
     }    
     LOGERROR("RESETING MONITOR for:'%s'\n", mon->base_path ?: "");
     mon->base_wd = -1;
-    destroy_wdir_list(mon);
+    mon->pending_move_cnt = 0;
+    mon->resync_pending = 0;
+    if (mon->trace && mon->trace->replay){
+        // No inotify instance while replaying, the recorded changes that follow rebuild the tree
+        destroy_wdir_list(mon);
+        return 0;
+    }
+    // In threaded mode the reader must not touch ifd while it's replaced
+    monitor_lock_ifd(mon);
     if (mon->ifd >= 0){
         close(mon->ifd);
         mon->ifd = -1;
     } 
+    destroy_wdir_list(mon);
     monitor_init(mon); 
+    monitor_unlock_ifd(mon);
     return 0; 
 }
 
@@ -235,6 +309,7 @@ struct fs_event_manager *create_event_monitor(char *base_path,
     // Set the event_monitor instance's starting values. See header for more info... 
     mon->buf_len = buflen;;
     mon->ifd = -1;
+    mon->ifd_gen = 0;
     mon->base_wd = -1;
     mon->config_wd = -1;
     mon->recursive = 1;
@@ -254,7 +329,40 @@ struct fs_event_manager *create_event_monitor(char *base_path,
     mon->base_path = mon_base_path;
     mon->jconfig = NULL;
     mon->thread_id = NULL;
-    mon->watch_list = NULL;
+    mon->watch_root = NULL;
+    mon->watch_count = 0;
+    mon->wd_index = NULL;
+    mon->child_table = NULL;
+    mon->child_table_len = 0;
+    mon_alloc_init(&mon->wdir_alloc, sizeof(struct w_dir));
+    mon->move_window_ms = MOVE_PAIR_WINDOW_MS;
+    mon->discovery_threads = 0;
+    mon->snapshot_path = NULL;
+    mon->pending_move_cnt = 0;
+    mon->resync_pending = 0;
+    mon->resync_cursor = 0;
+    mon->resync_gen = 0;
+    mon->drained_reads = 1;
+    mon->resync_drained = 0;
+    mon->coalesce = NULL;
+    mon->reader = NULL;
+    mon->batch_handler = NULL;
+    mon->batch = NULL;
+    mon->batch_size = 0;
+    mon->path_buf = NULL;
+    mon->path_buf_size = 0;
+    mon->path_allocs = 0;
+    mon->events_read = 0;
+    mon->ifd_reads = 0;
+    mon->shards = NULL;
+    mon->shard_cnt = 0;
+    mon->shard_idx = 0;
+    mon->root_mask = 0;
+    mon->epoch = NULL;
+    mon->trace = NULL;
+    mon->watch_add = NULL;
+    mon->metrics = NULL;
+    mon->mqtt = NULL;
     
     return mon;
 }
@@ -262,17 +370,59 @@ struct fs_event_manager *create_event_monitor(char *base_path,
 // Remove and free all the watch dirs 
 struct w_dir *destroy_wdir_list(struct fs_event_manager *mon){
     LOGDEBUG("Destroy watch list start\n");
-    struct w_dir *ptr = mon->watch_list;
-    struct w_dir *cur = mon->watch_list;
-    while (ptr != NULL){
-        cur = ptr;
-        ptr = ptr->next;
-        // remove() also frees the w_dir
-        remove_watch_dir(cur, mon);
+    monitor_trace_watch(mon, TRACE_RESET, NULL);
+    struct w_dir *ptr = mon->watch_root;
+    if (mon->ifd >= 0){
+        // Closing the inotify fd drops every watch, only remove them one by one if it stays open
+        while (ptr != NULL){
+            inotify_rm_watch(mon->ifd, ptr->wd);
+            ptr = watch_tree_next(ptr, mon->watch_root);
+        }
+    }
+    // Nodes and names all live in the monitor's arena, drop them in one go 
+    // rather than unlinking the tree node by node
+    // A hashed wd index is dropped, wds of the next inotify fd start small again
+    struct wd_index *index = mon->wd_index;
+    if (index && index->hashed){
+        __atomic_store_n(&mon->wd_index, NULL, __ATOMIC_RELEASE);
+    }
+    if (mon->epoch){
+        // Readers may be resolving paths, unpublish every node then wait them out
+        for (size_t i = 0; index && !index->hashed && i < index->len; i++){
+            __atomic_store_n(&index->slots[i], NULL, __ATOMIC_RELEASE);
+        }
+        mon_epoch_synchronize(mon->epoch);
+    }else if (index && !index->hashed){
+        memset(index->slots, 0, index->len * sizeof(struct w_dir *));
     }
+    if (index && index->hashed){
+        free(index);
+    }
+    if (mon->child_table_len){
+        memset(mon->child_table, 0, mon->child_table_len * sizeof(struct w_dir *));
+    }
+    mon->watch_root = NULL;
+    mon_metric_add(mon->metrics, MON_METRIC_WATCHES_REMOVED, mon->watch_count);
+    mon->watch_count = 0;
+    mon_alloc_release(&mon->wdir_alloc);
     LOGDEBUG("Done with destroy. List should be empty...\n");
-    debug_show_list(mon->watch_list);
-    return ptr;
+    debug_show_list(mon->watch_root);
+    return mon->watch_root;
+}
+
+/* Bytes of watch tree memory in use: nodes, names and the wd/child indexes */
+size_t monitor_mem_in_use(struct fs_event_manager *mon, size_t *reserved){
+    if (!mon){
+        return 0;
+    }
+    size_t tables = mon->child_table_len * sizeof(struct w_dir *);
+    if (mon->wd_index){
+        tables += sizeof(struct wd_index) + mon->wd_index->len * sizeof(struct w_dir *);
+    }
+    if (reserved){
+        *reserved = mon->wdir_alloc.bytes_reserved + tables;
+    }
+    return mon->wdir_alloc.bytes_in_use + tables;
 }
 
 /* Destroy and free an event_mon instance. 
@@ -288,27 +438,63 @@ struct fs_event_manager *destroy_event_monitor(struct fs_event_manager *mon){
         LOGERROR("destroy_event_monitor provided a null monitor\n");
         return NULL;
     }
-    LOGDEBUG("Destroying mon path:'%s', list:'%p'\n", mon->base_path ?:"", mon->watch_list ?: 0); 
+    LOGDEBUG("Destroying mon path:'%s', list:'%p'\n", mon->base_path ?:"", mon->watch_root ?: 0); 
+    // Stop the reader thread before its fd goes away
+    monitor_stop_thread(mon);
+    monitor_trace_stop(mon);
     pthread_mutex_lock(&mon->lock);
     mon->needs_destroy = 1;
     stop_monitor_loop(mon);
+    // Save the tree before it's torn down, so the next start can skip the full scan
+    if (mon->snapshot_path && mon->watch_root){
+        monitor_save_snapshot(mon, mon->snapshot_path);
+    }
     // Close our inotify event fd
     if (mon->ifd >= 0){
         close(mon->ifd);
+        mon->ifd = -1;
     }
     // decrement ref to monitor's json obj(s)
     if (mon->jconfig){
         json_decref(mon->jconfig);
     }
     LOGDEBUG("Destroy removing the following watched dirs...\n"); 
-    debug_show_list(mon->watch_list);
+    debug_show_list(mon->watch_root);
    
+    monitor_coalesce_free(mon);
+    LOGDEBUG("Read '%llu' events, '%.4f' path allocs per event\n", 
+             (unsigned long long)mon->events_read, monitor_allocs_per_event(mon));
     // Remove and free all the watch dirs 
-    mon->watch_list = destroy_wdir_list(mon);
+    mon->watch_root = destroy_wdir_list(mon);
+    if (mon->epoch){
+        mon_epoch_free(mon->epoch);
+        free(mon->epoch);
+        mon->epoch = NULL;
+    }
+    monitor_metrics_free(mon);
     if (mon->thread_id){
         pthread_join (*mon->thread_id, NULL);
     } 
     pthread_mutex_destroy(&mon->lock);
+    if (mon->wd_index){
+        free(mon->wd_index);
+        mon->wd_index = NULL;
+    }
+    if (mon->path_buf){
+        free(mon->path_buf);
+        mon->path_buf = NULL;
+        mon->path_buf_size = 0;
+    }
+    if (mon->batch){
+        free(mon->batch);
+        mon->batch = NULL;
+        mon->batch_size = 0;
+    }
+    if (mon->child_table){
+        free(mon->child_table);
+        mon->child_table = NULL;
+        mon->child_table_len = 0;
+    }
     if (mon->base_path){
         free(mon->base_path);
         mon->base_path = NULL;
@@ -317,267 +503,1261 @@ struct fs_event_manager *destroy_event_monitor(struct fs_event_manager *mon){
     return NULL;
 }
 
-/* Create/allocate new watch dir.  
- * To be free'd by caller
- */
-struct w_dir * create_watch_dir(char *dpath, struct fs_event_manager *mon){
-    int inotify_fd;
-    uint32_t mask;
-    if (!dpath || !strlen(dpath)){
-        LOGERROR("Null dir name provided\n");
-        return NULL;
+/* FNV-1a hash of a name component, stored in w_dir->name_hash */
+static uint32_t _name_hash(const char *name, size_t len){
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/* Shard a top level dir called name belongs to */
+int monitor_shard_index(struct fs_event_manager *mon, const char *name, size_t name_len){
+    if (!mon || mon->shard_cnt <= 1){
+        return 0;
     }
-    if (!mon){
-        LOGERROR("Null event monitor provided\n");
-        return NULL;
+    return (int)(_name_hash(name, name_len) % (uint32_t)mon->shard_cnt);
+}
+
+/* Returns 1 if a sub dir name of parent belongs in mon's tree */
+int monitor_shard_owns(struct fs_event_manager *mon, struct w_dir *parent, const char *name, size_t name_len){
+    if (!mon || mon->shard_cnt <= 1 || !parent || parent->parent){
+        return 1;
+    }
+    return monitor_shard_index(mon, name, name_len) == mon->shard_idx;
+}
+
+/* Number of separator chars between parent's path and a child name. Only a base 
+ * dir of "/" already ends with one */
+static size_t _sep_len(struct w_dir *parent){
+    return (parent->name_len && parent->name[parent->name_len - 1] == '/') ? 0 : 1;
+}
+
+/* Add fullpath to the monitor's inotify instance. Returns the wd, or -1 on error. 
+ * Only touches the kernel, so it's safe to call from several threads at once. 
+ */
+static int _watch_add_path(struct fs_event_manager *mon, char *fullpath){
+    int inotify_fd = mon->ifd;
+    uint32_t mask = mon->mask; //IN_CREATE | IN_DELETE | IN_MODIFY
+    if (!mon->watch_root && mon->root_mask){
+        // Adding the base dir
+        mask = mon->root_mask;
+    }
+    if (mon->trace && mon->trace->replay){
+        // No inotify instance while replaying, the dir gets the wd it had when recorded
+        return monitor_trace_fake_wd(mon, fullpath);
+    }
+    if (mon->watch_add){
+        int wd = mon->watch_add(mon, fullpath, mask);
+        if (wd < 0){
+            LOGERROR("Could not add watcher for path:'%s'\n", fullpath);
+            mon_metric_add(mon->metrics, MON_METRIC_WATCHES_FAILED, 1);
+        }
+        return wd;
     }
-    inotify_fd = mon->ifd;
-    mask = mon->mask; //IN_CREATE | IN_DELETE | IN_MODIFY
     if (inotify_fd < 0){
         LOGERROR("Bad inotify instance fd provided:'%d'\n", inotify_fd);
-        return NULL;
+        return -1;
     }
     // Add dir path to our watcher
-    int wd = inotify_add_watch( inotify_fd, dpath, mask);
+    int wd = -1;
+    size_t path_len = strlen(fullpath);
+    if (path_len >= PATH_MAX){
+        // inotify only takes paths, reach a long one through an fd instead
+        char fdpath[64];
+        int fd = mon_open_dir(fullpath, path_len);
+        if (fd >= 0){
+            snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", fd);
+            wd = inotify_add_watch( inotify_fd, fdpath, mask);
+            close(fd);
+        }
+    }else{
+        wd = inotify_add_watch( inotify_fd, fullpath, mask);
+    }
     if (wd < 0){
-        LOGERROR("Could not add watcher for path:'%s', instance fd:'%d'\n", dpath ?: "", inotify_fd);
-        return NULL;
+        LOGERROR("Could not add watcher for path:'%s', instance fd:'%d'\n", fullpath ?: "", inotify_fd);
+        mon_metric_add(mon->metrics, MON_METRIC_WATCHES_FAILED, 1);
+    }
+    return wd;
+}
+
+/* Allocate an unlinked watch node for name, for an already added wd */
+static struct w_dir *_alloc_watch_node(struct fs_event_manager *mon, int wd, const char *name, size_t name_len){
+    struct w_dir *newd = mon_alloc_node(&mon->wdir_alloc);
+    char *newname = newd ? mon_alloc_name(&mon->wdir_alloc, name_len) : NULL;
+    if (newd && !newname){
+        mon_free_node(&mon->wdir_alloc, newd);
+        newd = NULL;
     }
-    struct w_dir *newd = calloc(1, sizeof(struct w_dir) + strlen(dpath));
     if (newd != NULL){
         newd->wd = wd;
-        newd->mask = mask;
-        newd->ifd = inotify_fd;
+        newd->mask = mon->mask;
+        newd->ifd = mon->ifd;
+        newd->base_wd = mon->base_wd;
         newd->evt_mon = mon;
+        newd->parent = NULL;
+        newd->children = NULL;
         newd->next = NULL;
-        strcpy(newd->path, dpath);
+        newd->prev = NULL;
+        newd->hnext = NULL;
+        newd->name_hash = _name_hash(name, name_len);
+        newd->name_len = name_len;
+        newd->name = newname;
+        memcpy(newd->name, name, name_len);
+        newd->name[name_len] = '\0';
+    }else{
+        LOGERROR("Failed to alloc watch node for:'%s'\n", name);
     }
     return newd;
 }
 
-/* Fetch w_dir with matchng watch descriptor attribute from provided w_dir list */
-struct w_dir * get_dir_by_wd(int wd, struct fs_event_manager *mon){
-    if (!mon || !mon->watch_list){
-        return NULL;;
+/* Allocate a watch node for name, adding fullpath to the monitor's inotify instance */
+static struct w_dir *_create_watch_node(struct fs_event_manager *mon, char *fullpath, 
+                                        const char *name, size_t name_len){
+    int wd = _watch_add_path(mon, fullpath);
+    if (wd < 0){
+        return NULL;
     }
-    struct w_dir *ptr = mon->watch_list;
-    while(ptr != NULL) {
-        if (ptr->wd == wd){
-            return ptr;
-        }
-        ptr = ptr->next;
+    struct w_dir *newd = _alloc_watch_node(mon, wd, name, name_len);
+    if (!newd){
+        inotify_rm_watch(mon->ifd, wd);
     }
-    return NULL;
+    return newd;
 }
 
-/* Fetch w_dir with matching 'path' from provided w_dir list */
-struct w_dir * get_dir_by_path(char *path, struct fs_event_manager *mon){
-    if (!mon || !mon->watch_list){
-        return NULL;
-    }
-    struct w_dir *ptr = mon->watch_list;
-    while(ptr != NULL) {
-        if (ptr->path && !strcmp(ptr->path, path)){
-            return ptr;
-        }
-        ptr = ptr->next;
-    }
-    return NULL;
+/* mon_retire_func for a node, hands it and its name back to the monitor's allocator */
+static void _free_watch_node(void *ptr, void *arg){
+    struct w_dir *wdir = ptr;
+    struct fs_event_manager *mon = arg;
+    mon_free_name(&mon->wdir_alloc, wdir->name, wdir->name_len);
+    mon_free_node(&mon->wdir_alloc, wdir);
 }
 
+/* mon_retire_func for a name replaced by a move */
+static void _free_watch_name(void *ptr, void *arg){
+    struct fs_event_manager *mon = arg;
+    mon_free_name(&mon->wdir_alloc, ptr, strlen(ptr));
+}
 
-// Create mapping for dir to watch descriptor and add to the event_monitor list...
-struct w_dir *add_watch_dir_to_monitor(char *dpath, struct fs_event_manager *mon){
-    if (!mon){
-        LOGERROR("Was provided null event_mon\n");
-        return NULL;
+/* Hand a node and its name back to the monitor's allocator. With lock-free readers 
+ * on, that waits until none of them can still be walking through it */
+static void _release_watch_node(struct w_dir *wdir, struct fs_event_manager *mon){
+    if (mon->epoch){
+        mon_epoch_retire(mon->epoch, wdir, _free_watch_node, mon);
+    }else{
+        _free_watch_node(wdir, mon);
     }
-    struct w_dir *wdir = NULL;
+}
+
+/* Create/allocate new watch dir from the monitor's allocator.  
+ * The returned node is not linked into the monitor's tree, and holds dpath as its name. 
+ * To be released by caller with free_watch_dir()
+ */
+struct w_dir * create_watch_dir(char *dpath, struct fs_event_manager *mon){
     if (!dpath || !strlen(dpath)){
         LOGERROR("Null dir name provided\n");
         return NULL;
     }
-    
-    struct w_dir *ptr = NULL;;
-    if (!mon->watch_list){
-        //printf("Adding first item in list! ('%s')\n", dpath);
-        mon->watch_list = create_watch_dir(dpath, mon);
-        //debug_show_list(mon->watch_list);
-        return mon->watch_list;
-    }else{
-        wdir = get_dir_by_path(dpath, mon);
-        if (wdir){
-            LOGDEBUG("Dir already in watchlist:'%s', wd:'%d'\n", wdir->path, wdir->wd);
+    if (!mon){
+        LOGERROR("Null event monitor provided\n");
+        return NULL;
+    }
+    return _create_watch_node(mon, dpath, dpath, strlen(dpath));
+}
+
+/* Remove the inotify watch of a node from create_watch_dir() and hand its memory back */
+void free_watch_dir(struct w_dir *wdir, struct fs_event_manager *mon){
+    if (!wdir || !mon){
+        return;
+    }
+    if (get_dir_by_wd(wdir->wd, mon) == wdir){
+        LOGERROR("wdir:'%s' is linked in the watch tree, use remove_watch_dir()\n", wdir->name);
+        return;
+    }
+    if (mon->ifd >= 0){
+        inotify_rm_watch(mon->ifd, wdir->wd);
+    }
+    _release_watch_node(wdir, mon);
+}
+
+/* mon_retire_func for plain malloc'd memory */
+static void _free_retired(void *ptr, void *arg){
+    (void)arg;
+    free(ptr);
+}
+
+/* Slot a wd's probe starts from in a hashed wd index */
+static size_t _wd_index_bucket(int wd, size_t len){
+    uint64_t key = (uint64_t)(uint32_t)wd * 0x9E3779B97F4A7C15ull;
+    return (size_t)(key >> 32) & (len - 1);
+}
+
+/* Find the dir watched by wd in index. Slots are loaded atomically so this is also 
+ * safe for lock-free readers, a dir being added or removed may or may not be seen */
+static struct w_dir *_wd_index_find(struct wd_index *index, int wd){
+    if (!index->hashed){
+        return (size_t)wd < index->len ? __atomic_load_n(&index->slots[wd], __ATOMIC_ACQUIRE) : NULL;
+    }
+    for (size_t i = _wd_index_bucket(wd, index->len), n = 0; n < index->len; i = (i + 1) & (index->len - 1), n++){
+        struct w_dir *wdir = __atomic_load_n(&index->slots[i], __ATOMIC_ACQUIRE);
+        if (!wdir){
+            break;
+        }
+        if (wdir != WD_INDEX_TOMBSTONE && wdir->wd == wd){
             return wdir;
         }
     }
-    //Create a new item and add it to the end of the list...
-    wdir = create_watch_dir(dpath, mon);
-    if (!wdir){
-        LOGERROR("Failed to creat new wdir for path:'%s'\n", dpath);
-    }else{
-        LOGDEBUG("Inserting element to watch list: path:'%s', wd:'%d'\n", wdir->path, wdir->wd);
-        ptr = mon->watch_list;
-        while(ptr != NULL) {
-            if (!ptr->next){
-                ptr->next = wdir;
-                break;
+    return NULL;
+}
+
+/* Put wdir in index under wd. The caller makes sure a hashed index has a free slot */
+static void _wd_index_put(struct wd_index *index, int wd, struct w_dir *wdir){
+    if (!index->hashed){
+        __atomic_store_n(&index->slots[wd], wdir, __ATOMIC_RELEASE);
+        return;
+    }
+    struct w_dir **free_slot = NULL;
+    size_t i = _wd_index_bucket(wd, index->len);
+    for (;; i = (i + 1) & (index->len - 1)){
+        struct w_dir *cur = index->slots[i];
+        if (!cur){
+            break;
+        }
+        if (cur == WD_INDEX_TOMBSTONE){
+            if (!free_slot){
+                free_slot = &index->slots[i];
             }
-            ptr = ptr->next;
+        }else if (cur->wd == wd){
+            __atomic_store_n(&index->slots[i], wdir, __ATOMIC_RELEASE);
+            return;
         }
     }
-    //debug_show_list(mon->watch_list);
-    return wdir;
+    if (!free_slot){
+        free_slot = &index->slots[i];
+        index->used++;
+    }
+    __atomic_store_n(free_slot, wdir, __ATOMIC_RELEASE);
 }
 
-/*'if' found in list, removes w_dir from list, free's w_dir */ 
-int remove_watch_dir(struct w_dir *wdir, struct fs_event_manager *mon){
-    int base_removed = 0;
-    if (!mon){
-        LOGERROR("Null monitor provided to remove_remove_watch_dir()\n");
-        return -1;
-    }
-    struct w_dir *wlist = mon->watch_list;
-    if (!wdir){
-        LOGERROR("Null dir provided to remove_watch_dir()\n");
-        return -1;
-    }
-    if (!wlist){
-        LOGERROR("Empty list provided\n");
+/* Store wdir in the monitor's wd index. inotify hands out small, increasing 
+ * watch descriptors per instance, so a dense table indexed by wd is used and 
+ * grown by doubling when a larger wd shows up. wds aren't reused though, so 
+ * with dirs coming and going they creep up while the watch count doesn't. Once 
+ * the dense table would be WD_TABLE_SPARSE_RATIO times the watches, the index is 
+ * rebuilt as a hash sized to the watches instead. 
+ */
+static int _wd_index_set(struct fs_event_manager *mon, int wd, struct w_dir *wdir){
+    if (wd < 0){
+        LOGERROR("Invalid wd:'%d' provided to wd index\n", wd);
         return -1;
     }
-    struct w_dir *cur = wlist;
-    struct w_dir *last = NULL;
-    LOGDEBUG("Attempting to remove wdir->path:'%s', wdir:'%p', next:'%p', list:'%p'\n",
-                 wdir->path ?: "", wdir, wdir->next ?: 0, wlist ?: 0);
-    int cnt = 0;
-    while(cur != NULL) {
-        if (cur == wdir){
-            if ((mon->base_wd) >= 0 && (wdir->wd == mon->base_wd)) {
-                base_removed = 1;
-            }
-            LOGDEBUG("Found wdir to remove at position:'%d'\n", cnt);
-            if (last){
-                last->next = cur->next;
-            }else{
-                mon->watch_list = cur->next;
+    struct wd_index *old = mon->wd_index;
+    if (!old || (!old->hashed && (size_t)wd >= old->len) || (old->hashed && (old->used + 1) * 4 > old->len * 3)){
+        size_t watches = mon->watch_count + 1;
+        size_t newlen = WD_TABLE_MIN_LEN;
+        int hashed = 0;
+        while (newlen <= (size_t)wd){
+            newlen *= 2;
+        }
+        if (newlen > WD_TABLE_MIN_LEN && newlen / WD_TABLE_SPARSE_RATIO > watches){
+            hashed = 1;
+            newlen = WD_TABLE_MIN_LEN;
+            while (newlen < watches * 2){
+                newlen *= 2;
             }
-            if (mon->ifd >= 0){
-                inotify_rm_watch( mon->ifd, wdir->wd);
+        }
+        // Always a new index, readers may be in the old one and a rehash moves entries anyway
+        struct wd_index *index = calloc(1, sizeof(struct wd_index) + newlen * sizeof(struct w_dir *));
+        if (!index){
+            LOGERROR("Failed to grow wd index to '%zu' slots\n", newlen);
+            return -1;
+        }
+        index->len = newlen;
+        index->hashed = hashed;
+        for (size_t i = 0; old && i < old->len; i++){
+            if (old->slots[i] && old->slots[i] != WD_INDEX_TOMBSTONE){
+                _wd_index_put(index, old->slots[i]->wd, old->slots[i]);
             }
-            if (cur){
-                free(cur);
-                cur = NULL;
+        }
+        if (hashed || (old && old->hashed)){
+            // Entries changed slots, a running resync starts its pass over
+            mon->resync_cursor = 0;
+        }
+        __atomic_store_n(&mon->wd_index, index, __ATOMIC_RELEASE);
+        if (old){
+            if (mon->epoch){
+                mon_epoch_retire(mon->epoch, old, _free_retired, NULL);
+            }else{
+                free(old);
             }
-            break;
-        }else{
-            last = cur;
-            cur = cur->next;
-            cnt++;
         }
     }
-    if (base_removed){
-        LOGERROR("Deleted base dir:'%s'\n", mon->base_path ?: ""); 
-        if (!mon->needs_destroy){
-            reset_monitor(mon);
+    _wd_index_put(mon->wd_index, wd, wdir);
+    return 0;
+}
+
+/* Clear wdir's slot in the wd index, if it still owns it */
+static void _wd_index_clear(struct fs_event_manager *mon, struct w_dir *wdir){
+    struct wd_index *index = mon->wd_index;
+    if (!index || wdir->wd < 0){
+        return;
+    }
+    if (!index->hashed){
+        if ((size_t)wdir->wd < index->len && index->slots[wdir->wd] == wdir){
+            __atomic_store_n(&index->slots[wdir->wd], NULL, __ATOMIC_RELEASE);
+        }
+        return;
+    }
+    for (size_t i = _wd_index_bucket(wdir->wd, index->len); index->slots[i]; i = (i + 1) & (index->len - 1)){
+        if (index->slots[i] == wdir){
+            // Tombstone rather than NULL, later entries of the probe stay reachable
+            __atomic_store_n(&index->slots[i], WD_INDEX_TOMBSTONE, __ATOMIC_RELEASE);
+            return;
         }
     }
-    LOGDEBUG("Done removing wdir, list after...\n");
-    debug_show_list(mon->watch_list);
-    return -1;
 }
 
-int remove_watch_dir_by_path(char *path, struct fs_event_manager *mon){
-    if (!mon){
-        LOGERROR("Empty mon provided\n");
+/* Fetch w_dir with matchng watch descriptor attribute from the monitor's wd index */
+struct w_dir * get_dir_by_wd(int wd, struct fs_event_manager *mon){
+    if (!mon || wd < 0 || !mon->wd_index){
+        return NULL;
+    }
+    return _wd_index_find(mon->wd_index, wd);
+}
+
+/* Child index bucket for a name under parent. The parent's address is mixed in so 
+ * the same name under different dirs spreads across buckets */
+static size_t _child_bucket(struct w_dir *parent, uint32_t name_hash, size_t table_len){
+    uint64_t key = ((uint64_t)(uintptr_t)parent >> 4) ^ name_hash;
+    key *= 0x9E3779B97F4A7C15ull;
+    return (size_t)(key >> 32) & (table_len - 1);
+}
+
+/* Double the number of child index buckets and rehash the existing entries 
+ * using their precomputed hashes */
+static int _child_index_grow(struct fs_event_manager *mon){
+    size_t newlen = mon->child_table_len ? mon->child_table_len * 2 : CHILD_TABLE_MIN_LEN;
+    struct w_dir **table = calloc(newlen, sizeof(struct w_dir *));
+    if (!table){
+        LOGERROR("Failed to grow child index to '%zu' buckets\n", newlen);
         return -1;
     }
-    struct w_dir *wdir = get_dir_by_path(path, mon);
-    if (!wdir){
-        LOGERROR("Could not find watched dir by path:'%s'\n", path ?: "");
-        debug_show_list(mon->watch_list);
+    for (size_t i = 0; i < mon->child_table_len; i++){
+        struct w_dir *ptr = mon->child_table[i];
+        while (ptr != NULL){
+            struct w_dir *next = ptr->hnext;
+            size_t bucket = _child_bucket(ptr->parent, ptr->name_hash, newlen);
+            ptr->hnext = table[bucket];
+            table[bucket] = ptr;
+            ptr = next;
+        }
+    }
+    free(mon->child_table);
+    mon->child_table = table;
+    mon->child_table_len = newlen;
+    return 0;
+}
+
+/* Make sure the child index can take one more dir, so _child_index_link() can't fail */
+static int _child_index_reserve(struct fs_event_manager *mon){
+    if (mon->watch_count >= mon->child_table_len && _child_index_grow(mon)){
+        // An undersized table still works, only slower. Fail only if there's none at all
+        if (!mon->child_table_len){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Link wdir under its parent and name, after _child_index_reserve() succeeded */
+static void _child_index_link(struct fs_event_manager *mon, struct w_dir *wdir){
+    size_t bucket = _child_bucket(wdir->parent, wdir->name_hash, mon->child_table_len);
+    wdir->hnext = mon->child_table[bucket];
+    mon->child_table[bucket] = wdir;
+}
+
+static int _child_index_add(struct fs_event_manager *mon, struct w_dir *wdir){
+    if (_child_index_reserve(mon)){
         return -1;
     }
-    return remove_watch_dir(wdir, mon);
+    _child_index_link(mon, wdir);
+    return 0;
 }
 
+static void _child_index_remove(struct fs_event_manager *mon, struct w_dir *wdir){
+    if (!mon->child_table_len){
+        return;
+    }
+    struct w_dir **pptr = &mon->child_table[_child_bucket(wdir->parent, wdir->name_hash, mon->child_table_len)];
+    while (*pptr != NULL){
+        if (*pptr == wdir){
+            *pptr = wdir->hnext;
+            wdir->hnext = NULL;
+            return;
+        }
+        pptr = &(*pptr)->hnext;
+    }
+}
 
-/* Finds parent directory using w_dir list mappings to build current event's
- * full path. 
- * Returned buffer must be free'd later by caller
- */ 
-char *create_wd_full_path(int wd, char *name, struct fs_event_manager *mon){
-    char *ret = NULL;
-    struct w_dir *wdir = get_dir_by_wd(wd, mon);
-    if (!wdir){
-        LOGERROR("Failed to find wd:'%d' for full path. name:'%s'\n", wd, name ?: "");
-        debug_show_list(NULL);
+static struct w_dir *_child_lookup(struct fs_event_manager *mon, struct w_dir *parent, 
+                                   const char *name, size_t name_len){
+    if (!mon->child_table_len){
         return NULL;
     }
-    size_t total = strlen(wdir->path) + strlen(name) + 2;
-    ret = malloc(total);
-    if (!ret){
-        LOGERROR("Failed to alloc full path for wd\n");
-        return NULL;
+    uint32_t hash = _name_hash(name, name_len);
+    struct w_dir *ptr = mon->child_table[_child_bucket(parent, hash, mon->child_table_len)];
+    while (ptr != NULL){
+        if (ptr->parent == parent && ptr->name_hash == hash && ptr->name_len == name_len 
+            && !memcmp(ptr->name, name, name_len)){
+            return ptr;
+        }
+        ptr = ptr->hnext;
     }
-    snprintf(ret, total, "%s%s%s", wdir->path, name ? "/" : "",  name ?: "");
-    return ret;
+    return NULL;
 }
 
-
-/* Adds the current dir 
- *  if mon->recursive flag is set, then subdirectories will automatically be 
- *  discoverd and added recursively. 
- */
-struct w_dir *monitor_dir(char *dpath, struct fs_event_manager *mon){
-    DIR *folder;
-    char subdir[512];
-    struct dirent *entry;
-    struct stat filestat;
-    struct w_dir *wdir = NULL;
-    if (!dpath || !strlen(dpath)){
-        LOGERROR("Null dir name provided\n");
+/* Fetch the watched sub dir 'name' of parent */
+struct w_dir *get_child_dir(struct w_dir *parent, char *name, struct fs_event_manager *mon){
+    if (!mon || !parent || !name){
         return NULL;
     }
-    if (!mon){
-        LOGERROR("Null event monitor  provided\n");
+    return _child_lookup(mon, parent, name, strlen(name));
+}
+
+/* Resolve the first len chars of path against the tree, starting from the base dir 
+ * and looking up one component at a time */
+static struct w_dir *_get_dir_by_path_len(const char *path, size_t len, struct fs_event_manager *mon){
+    struct w_dir *root = mon->watch_root;
+    if (!root || len < root->name_len || memcmp(path, root->name, root->name_len)){
         return NULL;
     }
-    folder = opendir(dpath);
-    if(folder == NULL){
-        LOGERROR("Unable to read directory:'%s'\n", dpath);
+    size_t pos = root->name_len;
+    if (pos < len && path[pos] != '/' && _sep_len(root)){
+        // path only shares a prefix with the base dir's name 
         return NULL;
     }
-    wdir = add_watch_dir_to_monitor(dpath, mon);
-    if (!wdir) {
-        LOGERROR("Error, adding Dir to watchlist:'%s'\n",dpath);
-    }else{
-        LOGDEBUG("Added Dir to watchlist:'%s', wd:'%d'\n", wdir->path, wdir->wd);
-    }
-    if (!mon->recursive){
-        // No need to recursively discover and add sub dirs, return this w_dir now...
-        return(wdir);
-    }
-    /* Read directory entries */
-    entry=readdir(folder);
-    while(entry)
-    {
-        if (!entry->d_name || !strcmp(".", entry->d_name) || !strcmp("..", entry->d_name)){
-            //printf("skipping dir:'%s'\n", entry->d_name);
-        }else{
-            snprintf(subdir, sizeof(subdir), "%s/%s", dpath, entry->d_name);
-            stat(subdir, &filestat);
-            if( S_ISDIR(filestat.st_mode)) {
-                LOGDEBUG("Found sub dir for path:'%s'\n", entry->d_name);
-                if (!monitor_dir(subdir, mon)){
-                    LOGERROR("Error adding dir to watchlist:'%s'\n", entry->d_name);
-                };
-            }
+    struct w_dir *wdir = root;
+    while (pos < len){
+        while (pos < len && path[pos] == '/'){
+            pos++;
         }
-        entry=readdir(folder);
-    }
-    closedir(folder);
-    return(wdir);
+        if (pos >= len){
+            break;
+        }
+        size_t start = pos;
+        while (pos < len && path[pos] != '/'){
+            pos++;
+        }
+        wdir = _child_lookup(mon, wdir, path + start, pos - start);
+        if (!wdir){
+            return NULL;
+        }
+    }
+    return wdir;
+}
+
+/* Fetch w_dir with matching 'path' by walking the tree one path component at a time */
+struct w_dir * get_dir_by_path(char *path, struct fs_event_manager *mon){
+    if (!mon || !path){
+        return NULL;
+    }
+    return _get_dir_by_path_len(path, strlen(path), mon);
+}
+
+/* Pre-order walk of the watch tree. Returns the node after wdir within the 
+ * subtree rooted at top, or NULL once the subtree is exhausted. 
+ */
+struct w_dir *watch_tree_next(struct w_dir *wdir, struct w_dir *top){
+    if (!wdir){
+        return NULL;
+    }
+    if (wdir->children){
+        return wdir->children;
+    }
+    while (wdir && wdir != top){
+        if (wdir->next){
+            return wdir->next;
+        }
+        wdir = wdir->parent;
+    }
+    return NULL;
+}
+
+/* Create a node for an already added wd as 'name' under parent, and link it into the 
+ * tree and indexes. Returns the existing node if the wd is already mapped. 
+ */
+static struct w_dir *_insert_watch_node(struct fs_event_manager *mon, struct w_dir *parent, int wd, 
+                                        const char *name, size_t name_len){
+    // inotify returns the existing wd when the same inode is added under another path
+    struct w_dir *wdir = get_dir_by_wd(wd, mon);
+    if (wdir){
+        LOGDEBUG("Dir '%s' already watched as:'%s', wd:'%d'\n", name, wdir->name, wdir->wd);
+        return wdir;
+    }
+    wdir = _alloc_watch_node(mon, wd, name, name_len);
+    if (!wdir){
+        inotify_rm_watch(mon->ifd, wd);
+        return NULL;
+    }
+    wdir->parent = parent;
+    if (_wd_index_set(mon, wdir->wd, wdir)){
+        free_watch_dir(wdir, mon);
+        return NULL;
+    }
+    if (_child_index_add(mon, wdir)){
+        _wd_index_clear(mon, wdir);
+        free_watch_dir(wdir, mon);
+        return NULL;
+    }
+    if (parent){
+        LOGDEBUG("Inserting element to watch tree: name:'%s', wd:'%d', parent wd:'%d'\n", 
+                 wdir->name, wdir->wd, parent->wd);
+        wdir->next = parent->children;
+        if (parent->children){
+            parent->children->prev = wdir;
+        }
+        parent->children = wdir;
+    }else{
+        mon->watch_root = wdir;
+    }
+    mon->watch_count++;
+    mon_metric_add(mon->metrics, MON_METRIC_WATCHES_ADDED, 1);
+    monitor_trace_watch(mon, TRACE_WATCH_ADD, wdir);
+    return wdir;
+}
+
+/* Watch fullpath as 'name' under parent, and link it into the tree and indexes. 
+ * Returns the existing node if already watched. 
+ */
+static struct w_dir *_add_watch_child(struct fs_event_manager *mon, struct w_dir *parent, char *fullpath, 
+                                      const char *name, size_t name_len){
+    struct w_dir *wdir = NULL;
+    if (parent){
+        wdir = _child_lookup(mon, parent, name, name_len);
+        if (wdir){
+            LOGDEBUG("Dir already in watchlist:'%s', wd:'%d'\n", fullpath, wdir->wd);
+            return wdir;
+        }
+    }
+    int wd = _watch_add_path(mon, fullpath);
+    if (wd < 0){
+        LOGERROR("Failed to creat new wdir for path:'%s'\n", fullpath);
+        return NULL;
+    }
+    return _insert_watch_node(mon, parent, wd, name, name_len);
+}
+
+// Create mapping for dir to watch descriptor and add to the event_monitor tree...
+struct w_dir *add_watch_dir_to_monitor(char *dpath, struct fs_event_manager *mon){
+    if (!mon){
+        LOGERROR("Was provided null event_mon\n");
+        return NULL;
+    }
+    if (!dpath || !strlen(dpath)){
+        LOGERROR("Null dir name provided\n");
+        return NULL;
+    }
+    // Ignore trailing slashes, the name stored for each node never has one
+    size_t len = strlen(dpath);
+    while (len > 1 && dpath[len - 1] == '/'){
+        len--;
+    }
+    if (!mon->watch_root){
+        // The first dir added becomes the root of the tree and keeps its full path as name
+        return _add_watch_child(mon, NULL, dpath, dpath, len);
+    }
+    struct w_dir *wdir = _get_dir_by_path_len(dpath, len, mon);
+    if (wdir){
+        LOGDEBUG("Dir already in watchlist:'%s', wd:'%d'\n", dpath, wdir->wd);
+        return wdir;
+    }
+    size_t slash = len;
+    while (slash > 0 && dpath[slash - 1] != '/'){
+        slash--;
+    }
+    struct w_dir *parent = slash ? _get_dir_by_path_len(dpath, slash - 1 ?: 1, mon) : NULL;
+    if (!parent){
+        LOGERROR("Parent dir of '%s' is not watched by monitor:'%s'\n", dpath, mon->base_path ?: "");
+        return NULL;
+    }
+    return _add_watch_child(mon, parent, dpath, dpath + slash, len - slash);
+}
+
+/* Remove wdir and every dir below it from the tree and indexes, and free them. 
+ * Nodes are released leaf first, so no stack is needed to walk the subtree. 
+ */
+static void _remove_subtree(struct w_dir *wdir, struct fs_event_manager *mon){
+    monitor_trace_watch(mon, TRACE_WATCH_RM, wdir);
+    if (wdir->prev){
+        wdir->prev->next = wdir->next;
+    }else if (wdir->parent){
+        wdir->parent->children = wdir->next;
+    }
+    if (wdir->next){
+        wdir->next->prev = wdir->prev;
+    }
+    if (mon->watch_root == wdir){
+        mon->watch_root = NULL;
+    }
+    wdir->next = NULL;
+    wdir->prev = NULL;
+    struct w_dir *cur = wdir;
+    while (cur != NULL){
+        while (cur->children){
+            cur = cur->children;
+        }
+        struct w_dir *parent = cur->parent;
+        if (cur != wdir){
+            parent->children = cur->next;
+            if (cur->next){
+                cur->next->prev = NULL;
+            }
+        }
+        _child_index_remove(mon, cur);
+        _wd_index_clear(mon, cur);
+        if (mon->ifd >= 0){
+            inotify_rm_watch( mon->ifd, cur->wd);
+        }
+        mon->watch_count--;
+        mon_metric_add(mon->metrics, MON_METRIC_WATCHES_REMOVED, 1);
+        _release_watch_node(cur, mon);
+        if (cur == wdir){
+            break;
+        }
+        cur = parent;
+    }
+}
+
+/*'if' found in tree, removes w_dir and all of its sub dirs from the tree, free's them */ 
+int remove_watch_dir(struct w_dir *wdir, struct fs_event_manager *mon){
+    int base_removed = 0;
+    if (!mon){
+        LOGERROR("Null monitor provided to remove_remove_watch_dir()\n");
+        return -1;
+    }
+    if (!wdir){
+        LOGERROR("Null dir provided to remove_watch_dir()\n");
+        return -1;
+    }
+    if (!mon->watch_root){
+        LOGERROR("Empty list provided\n");
+        return -1;
+    }
+    LOGDEBUG("Attempting to remove wdir->name:'%s', wdir:'%p', wd:'%d', parent:'%p'\n",
+                 wdir->name, wdir, wdir->wd, wdir->parent ?: 0);
+    // Only nodes owned by this monitor's wd index are linked into its tree
+    if (get_dir_by_wd(wdir->wd, mon) != wdir){
+        LOGERROR("wdir:'%s' not found in watch tree\n", wdir->name);
+        return -1;
+    }
+    if (wdir == mon->watch_root || ((mon->base_wd) >= 0 && (wdir->wd == mon->base_wd))) {
+        base_removed = 1;
+    }
+    _remove_subtree(wdir, mon);
+    if (base_removed){
+        LOGERROR("Deleted base dir:'%s'\n", mon->base_path ?: ""); 
+        if (!mon->needs_destroy){
+            reset_monitor(mon);
+        }
+    }
+    LOGDEBUG("Done removing wdir, list after...\n");
+    debug_show_list(mon->watch_root);
+    return 0;
+}
+
+int remove_watch_dir_by_path(char *path, struct fs_event_manager *mon){
+    if (!mon){
+        LOGERROR("Empty mon provided\n");
+        return -1;
+    }
+    struct w_dir *wdir = get_dir_by_path(path, mon);
+    if (!wdir){
+        LOGERROR("Could not find watched dir by path:'%s'\n", path ?: "");
+        debug_show_list(mon->watch_root);
+        return -1;
+    }
+    return remove_watch_dir(wdir, mon);
+}
+
+/* Relocate wdir, along with its whole subtree, to new_name under new_parent. 
+ * Only wdir itself is touched, descendants keep pointing at it as their parent. 
+ */
+int move_watch_dir(struct w_dir *wdir, struct w_dir *new_parent, char *new_name, struct fs_event_manager *mon){
+    if (!mon || !wdir || !new_parent || !new_name || !strlen(new_name)){
+        LOGERROR("Invalid args for move. mon:'%p', wdir:'%p', new parent:'%p'\n", mon, wdir, new_parent);
+        return -1;
+    }
+    if (!wdir->parent){
+        LOGERROR("Can not move the base dir:'%s'\n", wdir->name);
+        return -1;
+    }
+    for (struct w_dir *ptr = new_parent; ptr != NULL; ptr = ptr->parent){
+        if (ptr == wdir){
+            LOGERROR("Can not move dir:'%s' below itself\n", wdir->name);
+            return -1;
+        }
+    }
+    size_t name_len = strlen(new_name);
+    struct w_dir *existing = _child_lookup(mon, new_parent, new_name, name_len);
+    if (existing == wdir){
+        return 0;
+    }
+    // Everything that can fail is done before the tree is touched, there's no putting it back after
+    char *name = wdir->name;
+    if (name_len != wdir->name_len || memcmp(name, new_name, name_len)){
+        name = mon_alloc_name(&mon->wdir_alloc, name_len);
+        if (!name){
+            LOGERROR("Failed to alloc name for move of:'%s' to:'%s'\n", wdir->name, new_name);
+            return -1;
+        }
+        memcpy(name, new_name, name_len + 1);
+    }
+    if (_child_index_reserve(mon)){
+        LOGERROR("No child index for move of:'%s' to:'%s'\n", wdir->name, new_name);
+        if (name != wdir->name){
+            mon_free_name(&mon->wdir_alloc, name, name_len);
+        }
+        return -1;
+    }
+    if (existing){
+        // rename(2) only replaces an empty dir, but its watch still needs to go
+        LOGDEBUG("Move replaces watched dir:'%s', wd:'%d'\n", existing->name, existing->wd);
+        _remove_subtree(existing, mon);
+    }
+    _child_index_remove(mon, wdir);
+    if (wdir->prev){
+        wdir->prev->next = wdir->next;
+    }else{
+        wdir->parent->children = wdir->next;
+    }
+    if (wdir->next){
+        wdir->next->prev = wdir->prev;
+    }
+    if (name != wdir->name){
+        char *old = wdir->name;
+        // Lock-free readers only follow name and parent, publish them whole
+        __atomic_store_n(&wdir->name, name, __ATOMIC_RELEASE);
+        wdir->name_len = name_len;
+        wdir->name_hash = _name_hash(name, name_len);
+        if (mon->epoch){
+            mon_epoch_retire(mon->epoch, old, _free_watch_name, mon);
+        }else{
+            _free_watch_name(old, mon);
+        }
+    }
+    __atomic_store_n(&wdir->parent, new_parent, __ATOMIC_RELEASE);
+    wdir->prev = NULL;
+    wdir->next = new_parent->children;
+    if (new_parent->children){
+        new_parent->children->prev = wdir;
+    }
+    new_parent->children = wdir;
+    _child_index_link(mon, wdir);
+    monitor_trace_watch(mon, TRACE_WATCH_MOVE, wdir);
+    return 0;
+}
+
+/* Remember a dir seen in IN_MOVED_FROM until its IN_MOVED_TO arrives */
+static void _move_pending_add(struct fs_event_manager *mon, uint32_t cookie, struct w_dir *wdir){
+    // Evicting below may free wdir if it's under the oldest entry, only its wd is used from here
+    int wd = wdir->wd;
+    if (mon->pending_move_cnt >= MOVE_PAIR_MAX_PENDING){
+        // Oldest entry has waited longest for its pair, give up on it now
+        struct w_dir *oldest = get_dir_by_wd(mon->pending_moves[0].wd, mon);
+        mon->pending_move_cnt--;
+        memmove(&mon->pending_moves[0], &mon->pending_moves[1], mon->pending_move_cnt * sizeof(struct pending_move));
+        if (oldest){
+            LOGDEBUG("Too many pending moves, dropping:'%s'\n", oldest->name);
+            remove_watch_dir(oldest, mon);
+            if (!get_dir_by_wd(wd, mon)){
+                // It went with the evicted subtree, nothing is left to pair
+                return;
+            }
+        }
+    }
+    struct pending_move *move = &mon->pending_moves[mon->pending_move_cnt++];
+    move->cookie = cookie;
+    move->wd = wd;
+    move->expires_ns = mon_monotonic_ns() + (uint64_t)mon->move_window_ms * 1000000ull;
+}
+
+/* Pop the pending move matching cookie. Returns its wd, or -1 if there's none */
+static int _move_pending_take(struct fs_event_manager *mon, uint32_t cookie){
+    for (int i = 0; i < mon->pending_move_cnt; i++){
+        if (mon->pending_moves[i].cookie == cookie){
+            int wd = mon->pending_moves[i].wd;
+            mon->pending_move_cnt--;
+            memmove(&mon->pending_moves[i], &mon->pending_moves[i + 1], 
+                    (mon->pending_move_cnt - i) * sizeof(struct pending_move));
+            return wd;
+        }
+    }
+    return -1;
+}
+
+/* Forget any pending move of wd, it's known to still be in the tree */
+static void _move_pending_drop(struct fs_event_manager *mon, int wd){
+    for (int i = 0; i < mon->pending_move_cnt; i++){
+        if (mon->pending_moves[i].wd == wd){
+            mon->pending_move_cnt--;
+            memmove(&mon->pending_moves[i], &mon->pending_moves[i + 1], 
+                    (mon->pending_move_cnt - i) * sizeof(struct pending_move));
+            return;
+        }
+    }
+}
+
+/* Dir moves whose IN_MOVED_TO didn't show up within mon->move_window_ms were moved 
+ * out of the tree, remove their subtrees. 
+ */
+void monitor_expire_moves(struct fs_event_manager *mon){
+    if (!mon || !mon->pending_move_cnt){
+        return;
+    }
+    uint64_t now = mon_monotonic_ns();
+    // Entries are added in time order, so only the front can be expired
+    while (mon->pending_move_cnt && mon->pending_moves[0].expires_ns <= now){
+        struct w_dir *wdir = get_dir_by_wd(mon->pending_moves[0].wd, mon);
+        mon->pending_move_cnt--;
+        memmove(&mon->pending_moves[0], &mon->pending_moves[1], mon->pending_move_cnt * sizeof(struct pending_move));
+        if (wdir){
+            LOGDEBUG("Dir moved out of the watch tree:'%s', wd:'%d'\n", wdir->name, wdir->wd);
+            remove_watch_dir(wdir, mon);
+        }
+    }
+}
+
+/* Writes the full path of wdir into buf by walking up to the base dir. 
+ * Returns the length of the full path. If that is >= buflen nothing is written. 
+ */
+size_t get_wdir_path(struct w_dir *wdir, char *buf, size_t buflen){
+    size_t total = 0;
+    struct w_dir *ptr = NULL;
+    for (ptr = wdir; ptr != NULL; ptr = ptr->parent){
+        total += ptr->name_len + (ptr->parent ? _sep_len(ptr->parent) : 0);
+    }
+    if (!buf || total >= buflen){
+        return total;
+    }
+    size_t pos = total;
+    buf[pos] = '\0';
+    for (ptr = wdir; ptr != NULL; ptr = ptr->parent){
+        pos -= ptr->name_len;
+        memcpy(buf + pos, ptr->name, ptr->name_len);
+        if (ptr->parent && _sep_len(ptr->parent)){
+            buf[--pos] = '/';
+        }
+    }
+    return total;
+}
+
+/* Lock-free path lookup for threads other than the one handling events. Each name and 
+ * parent is loaded once, and the path is written back to front so a concurrent move 
+ * can't make it overrun buf. 
+ */
+size_t monitor_wd_path(struct fs_event_manager *mon, int wd, const char *name, char *buf, size_t buflen){
+    if (!mon || wd < 0 || !buf || !buflen){
+        return 0;
+    }
+    struct wd_index *index = __atomic_load_n(&mon->wd_index, __ATOMIC_ACQUIRE);
+    struct w_dir *wdir = index ? _wd_index_find(index, wd) : NULL;
+    if (!wdir){
+        return 0;
+    }
+    size_t pos = buflen - 1;
+    buf[pos] = '\0';
+    if (name){
+        size_t nlen = strlen(name);
+        if (nlen + 1 > pos){
+            return 0;
+        }
+        pos -= nlen;
+        memcpy(buf + pos, name, nlen);
+        buf[--pos] = '/';
+    }
+    for (struct w_dir *ptr = wdir; ptr != NULL; ){
+        const char *dname = __atomic_load_n(&ptr->name, __ATOMIC_ACQUIRE);
+        struct w_dir *parent = __atomic_load_n(&ptr->parent, __ATOMIC_ACQUIRE);
+        size_t dlen = strlen(dname);
+        if (dlen > pos){
+            return 0;
+        }
+        pos -= dlen;
+        memcpy(buf + pos, dname, dlen);
+        if (parent){
+            if (!pos){
+                return 0;
+            }
+            buf[--pos] = '/';
+        }else if (dlen && dname[dlen - 1] == '/' && pos < buflen - 1 && buf[pos + dlen] == '/'){
+            // A base dir of "/" already ends with the separator
+            memmove(buf + pos + 1, buf + pos, dlen);
+            pos++;
+        }
+        ptr = parent;
+    }
+    size_t len = buflen - 1 - pos;
+    memmove(buf, buf + pos, len + 1);
+    return len;
+}
+
+/* Finds parent directory using the watch tree to build current event's
+ * full path. 
+ * Returned buffer must be free'd later by caller
+ */ 
+char *create_wd_full_path(int wd, char *name, struct fs_event_manager *mon){
+    char *ret = NULL;
+    struct w_dir *wdir = get_dir_by_wd(wd, mon);
+    if (!wdir){
+        LOGERROR("Failed to find wd:'%d' for full path. name:'%s'\n", wd, name ?: "");
+        return NULL;
+    }
+    size_t dlen = get_wdir_path(wdir, NULL, 0);
+    size_t nlen = name ? strlen(name) : 0;
+    size_t total = dlen + nlen + 2;
+    ret = malloc(total);
+    if (!ret){
+        LOGERROR("Failed to alloc full path for wd\n");
+        return NULL;
+    }
+    mon->path_allocs++;
+    get_wdir_path(wdir, ret, total);
+    if (name){
+        ret[dlen] = '/';
+        memcpy(ret + dlen + 1, name, nlen + 1);
+    }
+    return ret;
+}
+
+/* Build the full path of name within the dir watched by wd into the monitor's scratch buffer */
+char *monitor_event_path(struct fs_event_manager *mon, int wd, const char *name, size_t *len){
+    if (!mon){
+        return NULL;
+    }
+    struct w_dir *wdir = get_dir_by_wd(wd, mon);
+    if (!wdir){
+        LOGERROR("Failed to find wd:'%d' for full path. name:'%s'\n", wd, name ?: "");
+        return NULL;
+    }
+    size_t dlen = get_wdir_path(wdir, NULL, 0);
+    size_t nlen = name ? strlen(name) : 0;
+    size_t total = dlen + nlen + 2;
+    if (total > mon->path_buf_size){
+        size_t size = mon->path_buf_size ? mon->path_buf_size : 256;
+        while (size < total){
+            size *= 2;
+        }
+        char *buf = realloc(mon->path_buf, size);
+        if (!buf){
+            LOGERROR("Failed to grow path scratch to '%zu'\n", size);
+            return NULL;
+        }
+        mon->path_buf = buf;
+        mon->path_buf_size = size;
+        mon->path_allocs++;
+    }
+    get_wdir_path(wdir, mon->path_buf, mon->path_buf_size);
+    if (nlen){
+        mon->path_buf[dlen++] = '/';
+        memcpy(mon->path_buf + dlen, name, nlen + 1);
+        dlen += nlen;
+    }
+    if (len){
+        *len = dlen;
+    }
+    return mon->path_buf;
+}
+
+/* Allocations made resolving event paths, per event read so far */
+double monitor_allocs_per_event(struct fs_event_manager *mon){
+    if (!mon || !mon->events_read){
+        return 0;
+    }
+    return (double)mon->path_allocs / mon->events_read;
+}
+
+
+/* Work queue shared by the threads of a parallel scan. lock guards the queue as well 
+ * as every change to the watch tree and its indexes while the scan runs. 
+ */
+struct scan_shared {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; // signalled when dirs are queued, or the scan is done
+    struct w_dir **queue; // watched dirs still to be listed
+    size_t queue_cnt;
+    size_t queue_size;
+    int active; // threads currently listing a dir
+};
+
+/* State of one thread scanning a subtree */
+struct scan_ctx {
+    struct fs_event_manager *mon;
+    struct scan_shared *shared; // set for parallel scans, dirs are queued here instead of on stack
+    struct w_dir *parent; // dir currently being listed
+    char *path; // full path of parent, with room to append a child name
+    size_t path_len; // strlen of the parent's path in path
+    size_t path_size; // allocated size of path
+    struct w_dir **stack; // watched dirs still to be listed
+    size_t stack_cnt;
+    size_t stack_size;
+};
+
+static int _scan_path_reserve(struct scan_ctx *ctx, size_t len){
+    if (len < ctx->path_size){
+        return 0;
+    }
+    size_t newsize = ctx->path_size ?: 256;
+    while (newsize <= len){
+        newsize *= 2;
+    }
+    char *path = realloc(ctx->path, newsize);
+    if (!path){
+        LOGERROR("Failed to grow scan path buffer to '%zu'\n", newsize);
+        return -1;
+    }
+    ctx->path = path;
+    ctx->path_size = newsize;
+    return 0;
+}
+
+static int _scan_stack_push(struct w_dir ***stack, size_t *cnt, size_t *size, struct w_dir *wdir){
+    if (*cnt >= *size){
+        size_t newsize = *size ? *size * 2 : 64;
+        struct w_dir **newstack = realloc(*stack, newsize * sizeof(struct w_dir *));
+        if (!newstack){
+            LOGERROR("Failed to grow scan stack to '%zu'\n", newsize);
+            return -1;
+        }
+        *stack = newstack;
+        *size = newsize;
+    }
+    (*stack)[(*cnt)++] = wdir;
+    return 0;
+}
+
+static int _scan_push(struct scan_ctx *ctx, struct w_dir *wdir){
+    return _scan_stack_push(&ctx->stack, &ctx->stack_cnt, &ctx->stack_size, wdir);
+}
+
+/* mon_scan_subdirs() callback, adds a watch for each sub dir found and queues it to be listed */
+static int _scan_add_subdir(int dirfd, const char *name, size_t name_len, void *data){
+    struct scan_ctx *ctx = data;
+    struct fs_event_manager *mon = ctx->mon;
+    if (!monitor_shard_owns(mon, ctx->parent, name, name_len)){
+        // Another shard watches this top level dir
+        return 0;
+    }
+    size_t sep = _sep_len(ctx->parent);
+    size_t len = ctx->path_len + sep + name_len;
+    if (_scan_path_reserve(ctx, len)){
+        return 1;
+    }
+    if (sep){
+        ctx->path[ctx->path_len] = '/';
+    }
+    memcpy(ctx->path + ctx->path_len + sep, name, name_len + 1);
+    char *watch_path = ctx->path;
+    char fdpath[64];
+    int subfd = -1;
+    if (len >= PATH_MAX){
+        // inotify only takes paths, reach a long one through an fd instead
+        subfd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        if (subfd < 0){
+            LOGERROR("Unable to open long path dir:'%s'\n", name);
+            ctx->path[ctx->path_len] = '\0';
+            return 0;
+        }
+        snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", subfd);
+        watch_path = fdpath;
+    }
+    struct w_dir *wdir = NULL;
+    if (ctx->shared){
+        // The inotify fd is shared by all threads, only the tree update is serialized
+        int wd = _watch_add_path(mon, watch_path);
+        if (wd >= 0){
+            pthread_mutex_lock(&ctx->shared->lock);
+            size_t before = mon->watch_count;
+            wdir = _insert_watch_node(mon, ctx->parent, wd, name, name_len);
+            if (wdir && mon->watch_count != before && 
+                !_scan_stack_push(&ctx->shared->queue, &ctx->shared->queue_cnt, &ctx->shared->queue_size, wdir)){
+                pthread_cond_signal(&ctx->shared->cond);
+            }
+            pthread_mutex_unlock(&ctx->shared->lock);
+        }
+    }else{
+        size_t before = mon->watch_count;
+        wdir = _add_watch_child(mon, ctx->parent, watch_path, name, name_len);
+        if (wdir && mon->watch_count != before){
+            // Only newly added dirs need listing, known ones were scanned when they were added
+            _scan_push(ctx, wdir);
+        }
+    }
+    if (subfd >= 0){
+        close(subfd);
+    }
+    if (!wdir){
+        LOGERROR("Error adding dir to watchlist:'%s'\n", ctx->path);
+    }else{
+        LOGDEBUG("Found sub dir for path:'%s'\n", ctx->path);
+    }
+    ctx->path[ctx->path_len] = '\0';
+    return 0;
+}
+
+/* List the sub dirs of wdir, with ctx->path used as scratch for its full path. 
+ * Reads of the parent chain need no lock, nodes never change once they're queued. 
+ */
+static void _scan_list_dir(struct scan_ctx *ctx, struct w_dir *wdir){
+    if (ctx->mon->trace && ctx->mon->trace->replay){
+        // The sub dirs found when recording come from the trace
+        return;
+    }
+    size_t len = get_wdir_path(wdir, NULL, 0);
+    if (_scan_path_reserve(ctx, len)){
+        return;
+    }
+    get_wdir_path(wdir, ctx->path, ctx->path_size);
+    ctx->parent = wdir;
+    ctx->path_len = len;
+    int fd = mon_open_dir(ctx->path, len);
+    if (fd < 0){
+        LOGERROR("Unable to read directory:'%s'\n", ctx->path);
+        return;
+    }
+    // Record what was listed, a snapshot uses it to tell if the dir changed since
+    struct stat st;
+    if (!fstat(fd, &st)){
+        wdir->ino = st.st_ino;
+        wdir->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+        wdir->stat_drained = 0;
+    }
+    mon_scan_subdirs(fd, _scan_add_subdir, ctx);
+}
+
+/* Thread body of a parallel scan. Lists queued dirs until the queue is empty 
+ * and no other thread can queue more. 
+ */
+static void *_scan_worker(void *arg){
+    struct scan_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.shared = arg;
+    struct scan_shared *shared = ctx.shared;
+    pthread_mutex_lock(&shared->lock);
+    for (;;){
+        while (!shared->queue_cnt && shared->active){
+            pthread_cond_wait(&shared->cond, &shared->lock);
+        }
+        if (!shared->queue_cnt){
+            break;
+        }
+        struct w_dir *wdir = shared->queue[--shared->queue_cnt];
+        ctx.mon = wdir->evt_mon;
+        shared->active++;
+        pthread_mutex_unlock(&shared->lock);
+        _scan_list_dir(&ctx, wdir);
+        pthread_mutex_lock(&shared->lock);
+        shared->active--;
+    }
+    // Wake the others so they see the scan is finished
+    pthread_cond_broadcast(&shared->cond);
+    pthread_mutex_unlock(&shared->lock);
+    free(ctx.path);
+    return NULL;
+}
+
+/* Discover the subtree below top with nthreads threads listing dirs concurrently. 
+ * Falls back to listing on the calling thread if no thread can be started. 
+ */
+static int _scan_subtree_parallel(struct w_dir *top, struct fs_event_manager *mon, int nthreads){
+    struct scan_shared shared;
+    int started = 0;
+    uint64_t start = mon->metrics ? mon_monotonic_ns() : 0;
+    memset(&shared, 0, sizeof(shared));
+    pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+    if (!threads || pthread_mutex_init(&shared.lock, NULL)){
+        free(threads);
+        return -1;
+    }
+    pthread_cond_init(&shared.cond, NULL);
+    if (!_scan_stack_push(&shared.queue, &shared.queue_cnt, &shared.queue_size, top)){
+        for (started = 0; started < nthreads; started++){
+            if (pthread_create(&threads[started], NULL, _scan_worker, &shared)){
+                LOGERROR("Failed to start scan thread %d of %d\n", started + 1, nthreads);
+                break;
+            }
+        }
+        if (!started){
+            _scan_worker(&shared);
+        }
+        for (int i = 0; i < started; i++){
+            pthread_join(threads[i], NULL);
+        }
+    }
+    LOGDEBUG("Parallel scan of:'%s' done with %d threads, watching %zu dirs\n", 
+             top->name, started, mon->watch_count);
+    if (mon->metrics){
+        mon_metric_add(mon->metrics, MON_METRIC_SCANS, 1);
+        mon_metric_hist(mon->metrics, MON_METRIC_SCAN_NS, mon_monotonic_ns() - start, 1);
+    }
+    pthread_cond_destroy(&shared.cond);
+    pthread_mutex_destroy(&shared.lock);
+    free(shared.queue);
+    free(threads);
+    return 0;
+}
+
+/* Iteratively discover and watch every dir below top. 
+ * Dirs are listed one at a time from an explicit stack, so only one dir fd is open 
+ * at once and depth is not limited by the C stack. 
+ */
+static int _scan_subtree(struct w_dir *top, struct fs_event_manager *mon){
+    struct scan_ctx ctx;
+    uint64_t start = mon->metrics ? mon_monotonic_ns() : 0;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.mon = mon;
+    if (_scan_push(&ctx, top)){
+        return -1;
+    }
+    while (ctx.stack_cnt){
+        _scan_list_dir(&ctx, ctx.stack[--ctx.stack_cnt]);
+    }
+    free(ctx.stack);
+    free(ctx.path);
+    if (mon->metrics){
+        mon_metric_add(mon->metrics, MON_METRIC_SCANS, 1);
+        mon_metric_hist(mon->metrics, MON_METRIC_SCAN_NS, mon_monotonic_ns() - start, 1);
+    }
+    return 0;
+}
+
+/* Adds the current dir 
+ *  if mon->recursive flag is set, then subdirectories will automatically be 
+ *  discoverd and added recursively. 
+ */
+struct w_dir *monitor_dir(char *dpath, struct fs_event_manager *mon){
+    struct w_dir *wdir = NULL;
+    if (!dpath || !strlen(dpath)){
+        LOGERROR("Null dir name provided\n");
+        return NULL;
+    }
+    if (!mon){
+        LOGERROR("Null event monitor  provided\n");
+        return NULL;
+    }
+    wdir = add_watch_dir_to_monitor(dpath, mon);
+    if (!wdir) {
+        LOGERROR("Error, adding Dir to watchlist:'%s'\n",dpath);
+        return NULL;
+    }
+    LOGDEBUG("Added Dir to watchlist:'%s', wd:'%d'\n", dpath, wdir->wd);
+    if (!mon->recursive){
+        // No need to recursively discover and add sub dirs, return this w_dir now...
+        return(wdir);
+    }
+    _scan_subtree(wdir, mon);
+    return(wdir);
 }
 
 
@@ -586,42 +1766,64 @@ struct w_dir *monitor_dir(char *dpath, struct fs_event_manager *mon){
  * to avoid blocking on read, etc.. 
  */
 int mon_fd_has_events(int fd, float sec, float usec){
-    struct timeval time;
-    fd_set rfds;
+    struct pollfd pfd;
     int ret;
     
-    /* timeout after five seconds */
     if (sec <= 0 && usec <= 0){
         LOGERROR("Warning invalid interval. Sec:'%f' Usec:'%f'. Setting to 1 sec \n", sec, usec);
         sec = 1;
     }
-    time.tv_sec = sec;
-    time.tv_usec = usec;
-    
-    /* zero-out the fd_set */
-    FD_ZERO (&rfds);
-    
-    /*
-     * add the inotify fd to the fd_set -- of course,
-     * your application will probably want to add
-     * other file descriptors here, too
-     */
-    FD_SET (fd, &rfds);
-    
-    ret = (select (fd + 1, &rfds, NULL, NULL, &time));
+    /* sec may be fractional, usec is added on top of it. 
+     * poll() has no FD_SETSIZE limit on the fd number, unlike select() */
+    int timeout = (int)(sec * 1000 + usec / 1000);
+    if (timeout <= 0){
+        timeout = 1;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ret = poll(&pfd, 1, timeout);
     if (ret < 0){
-        perror ("select");
-        return 0;
-    } else if (!ret) {
-        /* timed out! */
+        if (errno != EINTR){
+            LOGERROR("poll error on fd:'%d', err:'%s'\n", fd, strerror(errno));
+        }
         return 0;
-    } else if (FD_ISSET (fd, &rfds)){
-        return 1;
     }
-    
-    return 0;
+    return (ret && (pfd.revents & POLLIN)) ? 1 : 0;
+}
+
+
+/* Whether wdir's ino/mtime_ns describe its sub dirs in the tree, as of drained reads */
+int monitor_dir_stat_current(struct w_dir *wdir, uint32_t drained){
+    // drained_reads wraps, skipping 0
+    return !wdir->stat_drained || (int32_t)(drained - wdir->stat_drained) > 0;
+}
+
+/* An event's change to wdir's sub dirs was applied to the tree, take wdir's stat again so 
+ * a resync or snapshot restore can skip listing it. Threaded monitors don't track drained 
+ * reads, they keep the stat of the last listing */
+static void _refresh_dir_stat(struct fs_event_manager *mon, struct w_dir *wdir){
+    struct stat st;
+    if (!wdir || !wdir->ino || mon->reader || mon->resync_pending || (mon->trace && mon->trace->replay)){
+        return;
+    }
+    if ((wdir->mask & (IN_CREATE | IN_DELETE | IN_MOVE)) != (IN_CREATE | IN_DELETE | IN_MOVE)){
+        // Sub dir changes that aren't watched for can't be lost, nor would they be in the tree
+        return;
+    }
+    char *path = monitor_event_path(mon, wdir->wd, NULL, NULL);
+    if (!path || stat(path, &st) || (uint64_t)st.st_ino != wdir->ino){
+        // Replaced dirs are left for a resync to find
+        return;
+    }
+    wdir->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+    wdir->stat_drained = mon->drained_reads;
 }
 
+/* The dir an event's name is in. For a base dir event routed to another shard, that's its base dir */
+static struct w_dir *_event_dir(struct fs_event_manager *tmon, struct fs_event_manager *mon, int wd){
+    return tmon == mon ? get_dir_by_wd(wd, mon) : tmon->watch_root;
+}
 
 int example_event_handler(struct inotify_event *event, void *data){
     if (!data){
@@ -631,19 +1833,28 @@ int example_event_handler(struct inotify_event *event, void *data){
     char *fname = NULL;
     struct w_dir *wdir = NULL;
     struct fs_event_manager *mon = data;
-    char fpath[256];
-    fpath[0] = '\0';
+    struct fs_event_manager *tmon = mon; // monitor whose tree holds the dir the event is about
     if (event){
+        if (event->mask & IN_Q_OVERFLOW){
+            // Events were dropped, check the tree against the fs instead of trusting it
+            monitor_start_resync(mon);
+            return 0;
+        }
         if (event->len && event->name){
             // Check our mappings to derive the full path of this file/dir from the event
-            fname = create_wd_full_path(event->wd, event->name, mon);
+            fname = monitor_event_path(mon, event->wd, event->name, NULL);
+            if (mon->shards && event->wd == mon->base_wd){
+                // Top level dirs are spread over the shards, but only the first gets the base dir's events
+                tmon = monitor_shard_route(mon, event->name);
+            }
         }
         if ( event->mask & IN_CREATE ) {
             if ( event->mask & IN_ISDIR ) {
                 LOGDEBUG( "MONITOR: New directory '%s' created.\n", fname ?: "");
                 // If recursive is set, automatically add this new subdir 
                 if (mon->recursive){
-                    monitor_dir(fname, mon);
+                    monitor_dir(fname, tmon);
+                    _refresh_dir_stat(tmon, _event_dir(tmon, mon, event->wd));
                 }
             } else {
                 if ( event->mask & IN_MODIFY){
@@ -659,33 +1870,69 @@ int example_event_handler(struct inotify_event *event, void *data){
         } else if ( event->mask & IN_DELETE) {
             if ( event->mask & IN_ISDIR ) {
                 LOGDEBUG( "MONITOR: Directory '%s' deleted. Removing wd:'%d' from watchlist\n", fname ?: "", event->wd);
-                /* Remove the dir from the watch list...
-                 * The dir path will need to be derived from the mapped w_dir in order
+                /* Remove the dir from the watch tree...
+                 * The removed dir is looked up by name under the mapped parent w_dir in order
                  * to get the wd to remove from inotify mon_fd */
-                if (event->name && strlen(event->name)){
-                    wdir = get_dir_by_wd(event->wd, mon);
-                    if (wdir && wdir->path && strlen(wdir->path)){
-                        snprintf(fpath, sizeof(fpath), "%s/%s", wdir->path, event->name);
-                        remove_watch_dir_by_path(fpath, mon);
+                if (event->len && strlen(event->name)){
+                    wdir = get_child_dir(_event_dir(tmon, mon, event->wd), event->name, tmon);
+                    if (wdir){
+                        remove_watch_dir(wdir, tmon);
+                        _refresh_dir_stat(tmon, _event_dir(tmon, mon, event->wd));
                     }
-
                 }
             } else {
                 LOGDEBUG( "MONITOR: File '%s' deleted.\n", fname ?: "" );
             }
+        }else if ((event->mask & IN_MOVED_FROM) && (event->mask & IN_ISDIR)){
+            /* Hold on to the moved dir until the IN_MOVED_TO with the same cookie
+             * tells where it went. If it doesn't show up, it left the tree */
+            wdir = get_child_dir(_event_dir(tmon, mon, event->wd), event->name, tmon);
+            LOGDEBUG( "MONITOR: Directory '%s' moved from, cookie:'%lu'\n", fname ?: "", (unsigned long) event->cookie);
+            if (wdir){
+                _move_pending_add(tmon, event->cookie, wdir);
+            }
+        }else if ((event->mask & IN_MOVED_TO) && (event->mask & IN_ISDIR)){
+            int moved_wd = _move_pending_take(tmon, event->cookie);
+            wdir = get_dir_by_wd(moved_wd, tmon);
+            struct w_dir *new_parent = _event_dir(tmon, mon, event->wd);
+            if (wdir && new_parent){
+                LOGDEBUG( "MONITOR: Directory '%s' moved to '%s'\n", wdir->name, fname ?: "");
+                struct w_dir *old_parent = wdir->parent;
+                if (!move_watch_dir(wdir, new_parent, event->name, tmon)){
+                    _refresh_dir_stat(tmon, old_parent);
+                    _refresh_dir_stat(tmon, new_parent);
+                }
+            }else if (mon->recursive && fname){
+                // Moved in from outside the tree, or from another shard, discover it like a new dir
+                LOGDEBUG( "MONITOR: Directory '%s' moved into the tree\n", fname);
+                wdir = monitor_dir(fname, tmon);
+                if (mon->shards && wdir && new_parent){
+                    /* Shards are read independently, so the other half of a move within this 
+                     * shard's tree can still be queued on another, or was handled first. The 
+                     * dir is here now, a late IN_MOVED_FROM finds nothing under the old name */
+                    _move_pending_drop(tmon, wdir->wd);
+                    if (wdir->parent != new_parent){
+                        move_watch_dir(wdir, new_parent, event->name, tmon);
+                    }
+                }
+                _refresh_dir_stat(tmon, new_parent);
+            }
+        }else if (event->mask & IN_MOVE_SELF){
+            if (event->wd == mon->base_wd){
+                // base_path no longer points at the watched dir, rebuild from base_path
+                LOGDEBUG("MONITOR: Base dir was moved:'%s'\n", mon->base_path ?: "");
+                reset_monitor(mon);
+            }
         }else if ( event->mask & IN_MODIFY){
             LOGDEBUG( "MONITOR: File '%s' was modified\n", fname ?: "");
         }else if (event->mask & IN_DELETE_SELF){
             wdir = get_dir_by_wd(event->wd, mon);
-            LOGDEBUG("MONITOR: Watcher dir was deleted:'%s'\n", wdir->path ?: "");
+            LOGDEBUG("MONITOR: Watcher dir was deleted:'%s', wd:'%d'\n", wdir ? wdir->name : "", event->wd);
             if (wdir){ 
                 remove_watch_dir(wdir, mon); 
             }
         }
     }
-    if (fname){
-        free(fname);
-    }
     return 0;
 }
 
@@ -711,6 +1958,10 @@ int read_events_fd(int events_fd, char *buffer, size_t buflen, event_handler han
     } 
     length = read(events_fd, buffer, buflen);
     if ( length < 0 ) {
+        if (errno == EAGAIN || errno == EINTR){
+            // inotify fds are non-blocking, nothing to read right now
+            return 0;
+        }
         LOGERROR("Error reading event fd\n");
         return length; 
     }
@@ -736,7 +1987,9 @@ int read_events_fd(int events_fd, char *buffer, size_t buflen, event_handler han
 
         }
         // Show some debug info about the event
-        print_event(event);
+        if (MON_LOG_ENABLED(LOG_DEBUG)){
+            print_event(event);
+        }
         // if a handler was provided, call it here...
         if (handler(event, data)){
             break;
@@ -747,178 +2000,195 @@ int read_events_fd(int events_fd, char *buffer, size_t buflen, event_handler han
     
 }
 
+/* A read of ifd found the kernel queue empty without an overflow, nothing that changed 
+ * before it went unreported. Events packed by a reader thread don't tell */
+static void _note_drained(struct fs_event_manager *mon){
+    if (!mon->reader && !++mon->drained_reads){
+        ++mon->drained_reads;
+    }
+}
+
+/* Read events from mon->ifd and hand the whole read to the batch handler */
+int read_events_batch(struct fs_event_manager *mon){
+    if (!mon || mon->ifd < 0){
+        LOGERROR("read_events_batch passed null monitor or invalid fd\n");
+        return -1;
+    }
+    mon->ifd_reads++;
+    ssize_t length = read(mon->ifd, mon->event_buffer, mon->buf_len);
+    if (length < 0){
+        if (errno == EAGAIN){
+            _note_drained(mon);
+            return 0;
+        }
+        if (errno == EINTR){
+            return 0;
+        }
+        LOGERROR("Error reading event fd\n");
+        return -1;
+    }
+    if (monitor_handle_events(mon, length)){
+        return -1;
+    }
+    return length;
+}
+
+// Resolve the dir and name of event for a batch handler
+static void _decode_event(struct fs_event_manager *mon, struct inotify_event *event, struct mon_event *mev){
+    mev->event = event;
+    mev->wdir = get_dir_by_wd(event->wd, mon);
+    mev->name = event->len ? event->name : "";
+    mev->name_len = strnlen(mev->name, event->len);
+}
+
+/* Decode length bytes of events already read into mon->event_buffer and hand them to the batch handler */
+int monitor_handle_events(struct fs_event_manager *mon, size_t length){
+    size_t cnt = 0;
+    size_t i = 0;
+    if (mon->trace){
+        monitor_trace_read(mon, mon->event_buffer, length);
+    }
+    // Handlers can't turn metrics off, so the shard stays valid for this read
+    struct mon_metrics_shard *mshard = mon->metrics ? mon_metrics_local(mon->metrics) : NULL;
+    uint64_t overflows = 0;
+    if (!mon->batch){
+        // A read can't return more events than fit in the buffer with empty names
+        size_t size = mon->buf_len / INOT_EVENT_SIZE + 1;
+        mon->batch = calloc(size, sizeof(struct mon_event));
+        if (!mon->batch){
+            LOGERROR("Failed to alloc event batch of '%zu'\n", size);
+            return -1;
+        }
+        mon->batch_size = size;
+    }
+    while (i + INOT_EVENT_SIZE <= length && cnt < mon->batch_size){
+        struct inotify_event *event = (struct inotify_event *)&mon->event_buffer[i];
+        if (i + INOT_EVENT_SIZE + event->len > length){
+            LOGERROR("Truncated event! Remaining:'%lu', len:'%lu'\n",
+                    (unsigned long)(length - i), (unsigned long)event->len); 
+            break;
+        }
+        if (MON_LOG_ENABLED(LOG_DEBUG)){
+            print_event(event);
+        }
+        if (mshard){
+            mon_metric_mask(mshard, event->mask);
+        }
+        overflows += !!(event->mask & IN_Q_OVERFLOW);
+        _decode_event(mon, event, &mon->batch[cnt++]);
+        i += INOT_EVENT_SIZE + event->len;
+    }
+    mon->events_read += cnt;
+    if (!overflows && length + INOT_EVENT_SIZE + NAME_MAX + 1 <= mon->buf_len){
+        // Room was left for any event, so the read emptied the kernel queue
+        _note_drained(mon);
+    }
+    if (mshard){
+        mon_metric_add(mon->metrics, MON_METRIC_EVENTS, cnt);
+        mon_metric_add(mon->metrics, MON_METRIC_BYTES_READ, length);
+        mon_metric_add(mon->metrics, MON_METRIC_READS, 1);
+        mon_metric_add(mon->metrics, MON_METRIC_OVERFLOWS, overflows);
+        mon_hist_record(&mshard->hists[MON_METRIC_EVENTS_PER_READ], cnt);
+    }
+    if (cnt){
+        if (mon->batch_handler){
+            uint64_t start = mshard ? mon_monotonic_ns() : 0;
+            if (mon->coalesce){
+                monitor_coalesce_batch(mon, mon->batch, cnt);
+            }else{
+                mon->batch_handler(mon->batch, cnt, mon);
+            }
+            if (mshard){
+                // The handler sees the whole read at once, spread its time over the events
+                mon_hist_record_n(&mshard->hists[MON_METRIC_HANDLER_NS], (mon_monotonic_ns() - start) / cnt, cnt);
+            }
+        }else{
+            monitor_batch_adapter(mon->batch, cnt, mon);
+        }
+    }
+    if (mon->epoch){
+        // Handlers are done changing the tree, free what lock-free readers have moved past
+        mon_epoch_reclaim(mon->epoch);
+    }
+    return 0;
+}
+
+/* batch_event_handler that calls mon->handler for each event in order */
+int monitor_batch_adapter(struct mon_event *events, size_t cnt, void *data){
+    struct fs_event_manager *mon = data;
+    if (!mon || !mon->handler){
+        return 0;
+    }
+    // Chained from a batch handler, the events already went through coalescing
+    event_handler handler = (mon->coalesce && !mon->batch_handler) ? monitor_coalesce_handler : mon->handler;
+    for (size_t i = 0; i < cnt; i++){
+        uint64_t start = mon->metrics ? mon_monotonic_ns() : 0;
+        int ret = handler(events[i].event, mon);
+        if (mon->metrics){
+            mon_metric_hist(mon->metrics, MON_METRIC_HANDLER_NS, mon_monotonic_ns() - start, 1);
+        }
+        if (ret){
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* Hand one event from outside a read to the batch handler, or else mon->handler */
+int monitor_deliver_event(struct fs_event_manager *mon, struct inotify_event *event){
+    if (mon->batch_handler){
+        struct mon_event mev;
+        _decode_event(mon, event, &mev);
+        return mon->batch_handler(&mev, 1, mon);
+    }
+    return mon->handler ? mon->handler(event, mon) : 0;
+}
+
+// Names of the event mask bits, in the order print_event() lists them
+static const struct {
+    uint32_t mask;
+    const char *name;
+    size_t len;
+} _event_names[] = {
+#define EVENT_NAME(m) {m, #m, sizeof(#m) - 1}
+    EVENT_NAME(IN_ACCESS), EVENT_NAME(IN_MODIFY), EVENT_NAME(IN_ATTRIB), EVENT_NAME(IN_CLOSE_WRITE), 
+    EVENT_NAME(IN_CLOSE_NOWRITE), EVENT_NAME(IN_OPEN), EVENT_NAME(IN_MOVED_FROM), EVENT_NAME(IN_MOVED_TO), 
+    EVENT_NAME(IN_CREATE), EVENT_NAME(IN_DELETE), EVENT_NAME(IN_DELETE_SELF), EVENT_NAME(IN_MOVE_SELF), 
+    EVENT_NAME(IN_UNMOUNT), EVENT_NAME(IN_Q_OVERFLOW), EVENT_NAME(IN_IGNORED), EVENT_NAME(IN_ONLYDIR), 
+    EVENT_NAME(IN_DONT_FOLLOW), EVENT_NAME(IN_MASK_ADD), EVENT_NAME(IN_ISDIR), EVENT_NAME(IN_ONESHOT), 
+#undef EVENT_NAME
+};
+
+/* Name of a single inotify mask bit */
+const char *monitor_mask_name(uint32_t mask){
+    for (size_t i = 0; i < sizeof(_event_names) / sizeof(_event_names[0]); i++){
+        if (mask == _event_names[i].mask){
+            return _event_names[i].name;
+        }
+    }
+    return NULL;
+}
 
-/* print mask attributes to provided buffer. Return length written. */
 void print_event(struct inotify_event *event){
-    uint32_t mask = event->mask;
     char buf[256];
-    char *ptr = buf;
-    size_t buflen = sizeof(buf);
-    LOGDEBUG("---------------------------------------------------\n");
+    size_t pos = 0;
+    if (!MON_LOG_ENABLED(LOG_DEBUG)){
+        return;
+    }
     if (!event){
         LOGDEBUG("Passed null event to print!\n");
-        LOGDEBUG("---------------------------------------------------\n");
         return;
     }
-    LOGDEBUG("\tEVENT: name:'%s'\n", event->name ?: "");
-    LOGDEBUG("\tEVENT: mask:'0x%lx', cookie:'%d', wd:'%d', len:%lu\n",
-               (unsigned long)event->mask, event->cookie, event->wd,  (unsigned long)event->len);
-    if (mask == 0){
-        LOGDEBUG("\tMASK: NONE\n");   
-        LOGDEBUG("---------------------------------------------------\n");
-        return; 
-    }
-    if (mask & IN_ACCESS){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_ACCESS");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_MODIFY){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_MODIFY");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_ATTRIB){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_ATTRIB");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_CLOSE_WRITE){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_CLOSE_WRITE");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_CLOSE_NOWRITE){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_CLOSE_NOWRITE");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_CLOSE){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_CLOSE");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_OPEN){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_OPEN");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_MOVED_FROM){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_MOVED_FROM");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_MOVED_TO){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_MOVED_TO");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_MOVE){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_MOVE");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_CREATE){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_CREATE");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_DELETE){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_DELETE");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_DELETE_SELF){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_DELETE_SELF");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_MOVE_SELF){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_MOVE_SELF");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_UNMOUNT){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_UNMOUNT");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_Q_OVERFLOW){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_Q_OVERFLOW");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_IGNORED){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_IGNORED");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_CLOSE){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_CLOSE");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_MOVE){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_MOVE");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_ONLYDIR){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_ONLYDIR");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_DONT_FOLLOW){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_DONT_FOLLOW");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_MASK_ADD){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_MASK_ADD");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_ISDIR){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_ISDIR");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    if (mask & IN_ONESHOT){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_ONESHOT");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }
-    /*if (mask & IN_ALL_EVENTS){
-         ptr += snprintf(ptr, (buflen-strlen(buf)), "%s,", "IN_ALL_EVENTS");
-         if (strlen(buf)+1 >= buflen){
-              return; //strlen(buf);
-         }
-    }*/
-    LOGDEBUG("\tMASK: %s\n", buf);   
-    LOGDEBUG("---------------------------------------------------\n");
-    return;
+    // All the mask names fit in buf, so there's no need to check for room
+    for (size_t i = 0; i < sizeof(_event_names) / sizeof(_event_names[0]); i++){
+        if (event->mask & _event_names[i].mask){
+            memcpy(buf + pos, _event_names[i].name, _event_names[i].len);
+            pos += _event_names[i].len;
+            buf[pos++] = ',';
+        }
+    }
+    buf[pos] = '\0';
+    LOGDEBUG("EVENT: name:'%s', mask:'0x%lx' %s, cookie:'%d', wd:'%d', len:%lu\n", 
+             event->len ? event->name : "", (unsigned long)event->mask, pos ? buf : "NONE", 
+             event->cookie, event->wd, (unsigned long)event->len);
 }
@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "includes/mon_log.h"
+#include "includes/mon_spsc.h"
+#include "includes/mon_utils.h"
+
+/* Logging backend.
+ * Disabled levels cost the caller one branch in MON_LOG_ENABLED(), enabled ones are
+ * formatted on the caller. With the async backend running, the formatted message goes
+ * into the calling thread's own SPSC queue and a background writer makes the syslog()
+ * and printf() calls, so handlers never block on them.
+ * Queues are never freed. A thread's queue goes back on the list for reuse when the
+ * thread exits, so later threads don't grow the list.
+ */
+
+int mon_log_level = MON_LOG_DEFAULT_LEVEL;
+
+static const char *_level_names[] = {
+    "LOG_EMERG", "LOG_ALERT", "LOG_CRIT", "LOG_ERR", "LOG_WARNING", "LOG_NOTICE", "LOG_INFO", "LOG_DEBUG",
+};
+
+// One queued message
+struct log_slot {
+    int level;
+    char msg[MON_LOG_MSG_MAX];
+};
+
+// A logging thread's queue, drained by the writer
+struct log_queue {
+    struct mon_spsc ring;
+    int in_use; // owned by a live thread
+    struct log_queue *next; // next queue on the list, queues are only ever added
+};
+
+static struct {
+    pthread_mutex_t lock; // serializes queue creation/adoption and start/stop
+    pthread_once_t key_once;
+    pthread_key_t key; // a thread's queue, released by the key's destructor on thread exit
+    struct log_queue *queues; // every queue ever made
+    size_t slots; // slots per new queue
+    int running; // async writer is running
+    int stop; // tells the writer to drain and exit
+    pthread_t thread;
+    uint64_t dropped;
+} _log = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT, 0, NULL, 0, 0, 0, 0, 0};
+
+static __thread struct log_queue *_tls_queue;
+static __thread int _tls_busy; // setting up this thread's queue, anything it logs meanwhile is written directly
+
+/* Set the runtime level */
+int mon_log_set_level(int level){
+    int prev = mon_log_level;
+    if (level < LOG_EMERG){
+        level = LOG_EMERG;
+    }else if (level > LOG_DEBUG){
+        level = LOG_DEBUG;
+    }
+    __atomic_store_n(&mon_log_level, level, __ATOMIC_RELAXED);
+    return prev;
+}
+
+// Final output of a message, on the writer thread or the caller when not async
+static void _log_emit(int level, const char *msg){
+    syslog(level, "%s", msg);
+    if (_local_debug_enabled() != 0){
+        printf("%s:%s", _level_names[level & 7], msg);
+    }
+}
+
+// Key destructor, the thread is gone so its queue can be adopted by another
+static void _log_queue_release(void *ptr){
+    struct log_queue *queue = ptr;
+    __atomic_store_n(&queue->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void _log_key_init(void){
+    pthread_key_create(&_log.key, _log_queue_release);
+}
+
+// The calling thread's queue, adopting a released one or making a new one on first use
+static struct log_queue *_log_queue_get(void){
+    struct log_queue *queue = _tls_queue;
+    if (queue){
+        return queue;
+    }
+    _tls_busy = 1;
+    pthread_once(&_log.key_once, _log_key_init);
+    pthread_mutex_lock(&_log.lock);
+    for (queue = _log.queues; queue != NULL; queue = queue->next){
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&queue->in_use, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+            break;
+        }
+    }
+    if (!queue){
+        queue = calloc(1, sizeof(struct log_queue));
+        if (queue && mon_spsc_init(&queue->ring, _log.slots ?: MON_LOG_DEFAULT_SLOTS, sizeof(struct log_slot))){
+            free(queue);
+            queue = NULL;
+        }
+        if (queue){
+            queue->in_use = 1;
+            queue->next = _log.queues;
+            __atomic_store_n(&_log.queues, queue, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&_log.lock);
+    if (queue){
+        pthread_setspecific(_log.key, queue);
+        _tls_queue = queue;
+    }
+    _tls_busy = 0;
+    return queue;
+}
+
+/* Format and log a message */
+void mon_log_write(int level, const char *fmt, ...){
+    va_list args;
+    if (__atomic_load_n(&_log.running, __ATOMIC_ACQUIRE) && !_tls_busy){
+        struct log_queue *queue = _log_queue_get();
+        if (queue){
+            struct log_slot *slot = mon_spsc_reserve(&queue->ring);
+            if (!slot){
+                __atomic_add_fetch(&_log.dropped, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            va_start(args, fmt);
+            vsnprintf(slot->msg, sizeof(slot->msg), fmt, args);
+            va_end(args);
+            slot->level = level;
+            mon_spsc_publish(&queue->ring);
+            return;
+        }
+    }
+    char msg[MON_LOG_MSG_MAX * 4];
+    va_start(args, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, args);
+    va_end(args);
+    _log_emit(level, msg);
+}
+
+// Write out every queued message. Returns the number written
+static size_t _log_drain(void){
+    size_t cnt = 0;
+    struct log_queue *queue = __atomic_load_n(&_log.queues, __ATOMIC_ACQUIRE);
+    for (; queue != NULL; queue = queue->next){
+        struct log_slot *slot = NULL;
+        while ((slot = mon_spsc_peek(&queue->ring))){
+            _log_emit(slot->level, slot->msg);
+            mon_spsc_release(&queue->ring);
+            cnt++;
+        }
+    }
+    return cnt;
+}
+
+static void *_log_writer(void *arg){
+    (void)arg;
+    while (!__atomic_load_n(&_log.stop, __ATOMIC_ACQUIRE)){
+        if (!_log_drain()){
+            usleep(MON_LOG_FLUSH_MS * 1000);
+        }
+    }
+    _log_drain();
+    return NULL;
+}
+
+/* Start the async backend */
+int mon_log_start_async(size_t slots){
+    int ret = 0;
+    pthread_mutex_lock(&_log.lock);
+    if (!_log.running){
+        _log.slots = slots;
+        _log.stop = 0;
+        if (pthread_create(&_log.thread, NULL, _log_writer, NULL)){
+            ret = -1;
+        }else{
+            __atomic_store_n(&_log.running, 1, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&_log.lock);
+    if (ret){
+        LOGERROR("Failed to start async log writer\n");
+    }
+    return ret;
+}
+
+/* Write out everything queued and stop the writer */
+void mon_log_stop_async(void){
+    pthread_mutex_lock(&_log.lock);
+    if (_log.running){
+        /* New messages go straight to syslog from here, the writer drains what's queued. 
+         * One racing with the stop stays in its queue until the next start */
+        __atomic_store_n(&_log.running, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&_log.stop, 1, __ATOMIC_RELEASE);
+        pthread_join(_log.thread, NULL);
+    }
+    pthread_mutex_unlock(&_log.lock);
+}
+
+/* Messages dropped by the async backend */
+uint64_t mon_log_dropped(void){
+    return __atomic_load_n(&_log.dropped, __ATOMIC_RELAXED);
+}
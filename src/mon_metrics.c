@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <jansson.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_metrics.h"
+#include "includes/mon_utils.h"
+
+/* Runtime metrics of a monitor.
+ * Counting must not cost the event path more than a few plain stores, so each thread
+ * gets its own shard of counters, found through a small thread local cache. Shards
+ * are only merged when someone reads the metrics.
+ */
+
+__thread struct mon_metrics_tls mon_metrics_tls[MON_METRICS_TLS_SLOTS];
+static __thread unsigned int _tls_next; // cache slot replaced on the next miss
+static uint64_t _metrics_ids; // ids handed out, 0 is never used
+
+void mon_hist_merge(struct mon_hist *dst, const struct mon_hist *src){
+    for (size_t i = 0; i < MON_HIST_BUCKETS; i++){
+        dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+    }
+    dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+    dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    uint64_t max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+    if (max > dst->max){
+        dst->max = max;
+    }
+}
+
+// Smallest value that lands in bucket idx
+static uint64_t _hist_bucket_value(size_t idx){
+    if (idx < MON_HIST_SUB){
+        return idx;
+    }
+    return ((uint64_t)MON_HIST_SUB + (idx & (MON_HIST_SUB - 1))) << (idx / MON_HIST_SUB - 1);
+}
+
+uint64_t mon_hist_percentile(const struct mon_hist *hist, double pct){
+    uint64_t total = 0;
+    for (size_t i = 0; i < MON_HIST_BUCKETS; i++){
+        total += hist->buckets[i];
+    }
+    if (!total){
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(total * pct);
+    if (rank >= total){
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < MON_HIST_BUCKETS; i++){
+        seen += hist->buckets[i];
+        if (seen > rank){
+            return _hist_bucket_value(i);
+        }
+    }
+    return hist->max;
+}
+
+json_t *mon_hist_json(const struct mon_hist *hist){
+    json_t *obj = json_object();
+    if (!obj){
+        return NULL;
+    }
+    json_object_set_new(obj, "count", json_integer(hist->count));
+    json_object_set_new(obj, "mean", json_real(hist->count ? (double)hist->sum / hist->count : 0));
+    json_object_set_new(obj, "p50", json_integer(mon_hist_percentile(hist, 0.50)));
+    json_object_set_new(obj, "p90", json_integer(mon_hist_percentile(hist, 0.90)));
+    json_object_set_new(obj, "p99", json_integer(mon_hist_percentile(hist, 0.99)));
+    json_object_set_new(obj, "p999", json_integer(mon_hist_percentile(hist, 0.999)));
+    json_object_set_new(obj, "max", json_integer(hist->max));
+    return obj;
+}
+
+/* Find or add the calling thread's shard, and cache it */
+struct mon_metrics_shard *mon_metrics_shard_get(struct mon_metrics *metrics){
+    pthread_t self = pthread_self();
+    struct mon_metrics_shard *shard = NULL;
+    pthread_mutex_lock(&metrics->lock);
+    for (shard = metrics->shards; shard != NULL; shard = shard->next){
+        if (pthread_equal(shard->owner, self)){
+            break;
+        }
+    }
+    if (!shard){
+        shard = aligned_alloc(64, sizeof(struct mon_metrics_shard));
+        if (shard){
+            memset(shard, 0, sizeof(*shard));
+            shard->owner = self;
+            shard->next = metrics->shards;
+            // Readers walk the list without the lock
+            __atomic_store_n(&metrics->shards, shard, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&metrics->lock);
+    if (!shard){
+        LOGERROR("Failed to alloc metrics shard\n");
+        return NULL;
+    }
+    struct mon_metrics_tls *slot = &mon_metrics_tls[_tls_next++ % MON_METRICS_TLS_SLOTS];
+    slot->id = metrics->id;
+    slot->shard = shard;
+    return shard;
+}
+
+int monitor_enable_metrics(struct fs_event_manager *mon){
+    if (!mon){
+        LOGERROR("Null monitor provided\n");
+        return -1;
+    }
+    if (mon->metrics){
+        return 0;
+    }
+    struct mon_metrics *metrics = calloc(1, sizeof(struct mon_metrics));
+    if (!metrics || pthread_mutex_init(&metrics->lock, NULL)){
+        LOGERROR("Failed to alloc metrics for monitor:'%s'\n", mon->base_path ?: "");
+        free(metrics);
+        return -1;
+    }
+    metrics->id = __atomic_add_fetch(&_metrics_ids, 1, __ATOMIC_RELAXED);
+    metrics->start_ns = mon_monotonic_ns();
+    mon->metrics = metrics;
+    return 0;
+}
+
+void monitor_metrics_free(struct fs_event_manager *mon){
+    if (!mon || !mon->metrics){
+        return;
+    }
+    struct mon_metrics *metrics = mon->metrics;
+    mon->metrics = NULL;
+    struct mon_metrics_shard *shard = metrics->shards;
+    while (shard){
+        struct mon_metrics_shard *next = shard->next;
+        free(shard);
+        shard = next;
+    }
+    pthread_mutex_destroy(&metrics->lock);
+    free(metrics);
+}
+
+int monitor_metrics_read(struct fs_event_manager *mon, struct mon_metrics_totals *totals){
+    if (!mon || !mon->metrics || !totals){
+        return -1;
+    }
+    memset(totals, 0, sizeof(*totals));
+    struct mon_metrics_shard *shard = __atomic_load_n(&mon->metrics->shards, __ATOMIC_ACQUIRE);
+    for (; shard != NULL; shard = shard->next){
+        for (int i = 0; i < MON_METRIC_CNT; i++){
+            totals->counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < 32; i++){
+            totals->mask_bits[i] += __atomic_load_n(&shard->mask_bits[i], __ATOMIC_RELAXED);
+        }
+        for (int i = 0; i < MON_METRIC_HIST_CNT; i++){
+            mon_hist_merge(&totals->hists[i], &shard->hists[i]);
+        }
+    }
+    return 0;
+}
+
+json_t *monitor_metrics_json(struct fs_event_manager *mon){
+    if (!mon || !mon->metrics){
+        return NULL;
+    }
+    struct mon_metrics_totals *totals = malloc(sizeof(*totals));
+    json_t *obj = json_object();
+    json_t *watches = json_object();
+    json_t *masks = json_object();
+    json_t *scans = json_object();
+    if (!totals || !obj || !watches || !masks || !scans){
+        LOGERROR("Failed to alloc metrics snapshot of:'%s'\n", mon->base_path ?: "");
+        free(totals);
+        json_decref(obj);
+        json_decref(watches);
+        json_decref(masks);
+        json_decref(scans);
+        return NULL;
+    }
+    monitor_metrics_read(mon, totals);
+    uint64_t *cnt = totals->counters;
+    json_object_set_new(obj, "base_path", json_string(mon->base_path ?: ""));
+    json_object_set_new(obj, "uptime_ms", json_integer((mon_monotonic_ns() - mon->metrics->start_ns) / 1000000));
+    json_object_set_new(obj, "events", json_integer(cnt[MON_METRIC_EVENTS]));
+    json_object_set_new(obj, "bytes_read", json_integer(cnt[MON_METRIC_BYTES_READ]));
+    json_object_set_new(obj, "reads", json_integer(cnt[MON_METRIC_READS]));
+    json_object_set_new(obj, "events_per_read", json_real(cnt[MON_METRIC_READS] ?
+                        (double)cnt[MON_METRIC_EVENTS] / cnt[MON_METRIC_READS] : 0));
+    json_object_set_new(obj, "overflows", json_integer(cnt[MON_METRIC_OVERFLOWS]));
+    for (int bit = 0; bit < 32; bit++){
+        const char *name = monitor_mask_name(1u << bit);
+        if (totals->mask_bits[bit] && name){
+            json_object_set_new(masks, name, json_integer(totals->mask_bits[bit]));
+        }
+    }
+    json_object_set_new(obj, "events_by_mask", masks);
+    // mon->watch_count belongs to the event thread, work the current count out from the counters
+    json_object_set_new(watches, "current", json_integer(cnt[MON_METRIC_WATCHES_ADDED] - cnt[MON_METRIC_WATCHES_REMOVED]));
+    json_object_set_new(watches, "added", json_integer(cnt[MON_METRIC_WATCHES_ADDED]));
+    json_object_set_new(watches, "failed", json_integer(cnt[MON_METRIC_WATCHES_FAILED]));
+    json_object_set_new(watches, "removed", json_integer(cnt[MON_METRIC_WATCHES_REMOVED]));
+    json_object_set_new(obj, "watches", watches);
+    json_object_set_new(scans, "count", json_integer(cnt[MON_METRIC_SCANS]));
+    json_object_set_new(scans, "ns", mon_hist_json(&totals->hists[MON_METRIC_SCAN_NS]));
+    json_object_set_new(obj, "scans", scans);
+    json_object_set_new(obj, "handler_ns", mon_hist_json(&totals->hists[MON_METRIC_HANDLER_NS]));
+    json_object_set_new(obj, "events_per_read_hist", mon_hist_json(&totals->hists[MON_METRIC_EVENTS_PER_READ]));
+    free(totals);
+    return obj;
+}
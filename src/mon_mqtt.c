@@ -0,0 +1,688 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <mosquitto.h>
+#include <jansson.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_reactor.h"
+#include "includes/mon_metrics.h"
+#include "includes/mon_mqtt.h"
+#include "includes/mon_utils.h"
+
+/* MQTT bridge.
+ * mosquitto is run the way its external loop api intends: the socket sits in the reactor,
+ * EPOLLOUT is only asked for while mosquitto has something queued, and loop_misc() runs
+ * off a timer. mosquitto_publish() writes straight to the socket when it can, so an event
+ * normally leaves in the same dispatch that read it.
+ */
+
+static pthread_mutex_t _lib_lock = PTHREAD_MUTEX_INITIALIZER;
+static int _lib_refs; // bridges alive, mosquitto_lib_init() is done for the first
+
+static void _mqtt_connect(struct mon_mqtt *mqtt);
+static void _mqtt_lost(struct mon_mqtt *mqtt);
+static void _mqtt_pump(struct mon_mqtt *mqtt);
+
+/* Grow a scratch buffer to hold at least need bytes */
+static int _mqtt_grow(char **buf, size_t *size, size_t need){
+    if (need <= *size){
+        return 0;
+    }
+    size_t new_size = *size ? *size : 256;
+    while (new_size < need){
+        new_size *= 2;
+    }
+    char *grown = realloc(*buf, new_size);
+    if (!grown){
+        LOGERROR("Failed to grow mqtt buffer to '%zu' bytes\n", new_size);
+        return -1;
+    }
+    *buf = grown;
+    *size = new_size;
+    return 0;
+}
+
+/* Write src as the inside of a json string. dst must hold 6 bytes per byte of src. Returns bytes written */
+static size_t _mqtt_json_escape(char *dst, const char *src, size_t len){
+    static const char hex[] = "0123456789abcdef";
+    char *out = dst;
+    for (size_t i = 0; i < len; i++){
+        unsigned char c = src[i];
+        if (c == '"' || c == '\\'){
+            *out++ = '\\';
+            *out++ = c;
+        }else if (c < 0x20){
+            *out++ = '\\';
+            *out++ = 'u';
+            *out++ = '0';
+            *out++ = '0';
+            *out++ = hex[c >> 4];
+            *out++ = hex[c & 0xf];
+        }else{
+            *out++ = c;
+        }
+    }
+    return out - dst;
+}
+
+/* Connection dropped or never made it, try again after the back off */
+static void _mqtt_schedule_connect(struct mon_mqtt *mqtt){
+    if (mqtt->next_connect_ns){
+        return;
+    }
+    _mqtt_lost(mqtt);
+    mqtt->next_connect_ns = mon_monotonic_ns() + (uint64_t)mqtt->backoff_ms * 1000000;
+    LOGDEBUG("Connecting to mqtt broker:'%s:%d' again in '%u' ms\n", mqtt->cfg.host, mqtt->cfg.port, mqtt->backoff_ms);
+    mqtt->backoff_ms *= 2;
+    if (mqtt->backoff_ms > MQTT_RECONNECT_MAX_MS){
+        mqtt->backoff_ms = MQTT_RECONNECT_MAX_MS;
+    }
+}
+
+static void _mqtt_sock_cb(struct mon_reactor *reactor, struct reactor_source *src, uint32_t events, void *data);
+
+/* Match the reactor to mosquitto's socket: register a new one, drop a closed one, and
+ * only ask for EPOLLOUT while mosquitto has data queued. Called after anything that can
+ * queue data or drop the connection.
+ */
+static void _mqtt_sock_sync(struct mon_mqtt *mqtt){
+    int sock = mosquitto_socket(mqtt->mosq);
+    if (mqtt->sock_src && (sock != mqtt->sock || mqtt->sock_closed)){
+        mon_reactor_remove(mqtt->reactor, mqtt->sock_src);
+        mqtt->sock_src = NULL;
+        mqtt->sock = -1;
+    }
+    mqtt->sock_closed = 0;
+    if (sock < 0){
+        _mqtt_schedule_connect(mqtt);
+        return;
+    }
+    uint32_t events = EPOLLIN | (mosquitto_want_write(mqtt->mosq) ? EPOLLOUT : 0);
+    if (mqtt->sock_src){
+        mon_reactor_mod_fd(mqtt->reactor, mqtt->sock_src, events);
+        return;
+    }
+    mqtt->sock_src = mon_reactor_add_fd(mqtt->reactor, sock, events, _mqtt_sock_cb, mqtt);
+    if (!mqtt->sock_src){
+        LOGERROR("Failed to add mqtt socket:'%d' to the reactor\n", sock);
+        mosquitto_disconnect(mqtt->mosq);
+        return;
+    }
+    mqtt->sock = sock;
+}
+
+/* The socket is ready, let mosquitto read and write what it can without blocking */
+static void _mqtt_sock_cb(struct mon_reactor *reactor, struct reactor_source *src, uint32_t events, void *data){
+    struct mon_mqtt *mqtt = data;
+    int rc = MOSQ_ERR_SUCCESS;
+    (void)reactor;
+    (void)src;
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)){
+        rc = mosquitto_loop_read(mqtt->mosq, 1);
+    }
+    if (rc == MOSQ_ERR_SUCCESS && (events & EPOLLOUT)){
+        rc = mosquitto_loop_write(mqtt->mosq, 1);
+    }
+    if (rc != MOSQ_ERR_SUCCESS){
+        LOGDEBUG("mqtt connection to:'%s:%d' failed:'%s'\n", mqtt->cfg.host, mqtt->cfg.port, mosquitto_strerror(rc));
+    }
+    // Acks and a writable socket both open up room for queued messages
+    _mqtt_pump(mqtt);
+    _mqtt_sock_sync(mqtt);
+}
+
+/* Keep alives, connect retries and periodic stats */
+static void _mqtt_tick(struct mon_reactor *reactor, struct reactor_source *src, uint32_t events, void *data){
+    struct mon_mqtt *mqtt = data;
+    uint64_t now = mon_monotonic_ns();
+    (void)reactor;
+    (void)src;
+    (void)events;
+    if (mqtt->sock_src){
+        mosquitto_loop_misc(mqtt->mosq);
+    }else if (mqtt->next_connect_ns && now >= mqtt->next_connect_ns){
+        _mqtt_connect(mqtt);
+    }
+    if (now - mqtt->rate_start_ns >= MQTT_RATE_WINDOW_MS * 1000000ull){
+        double secs = (now - mqtt->rate_start_ns) / 1e9;
+        mqtt->publish_rate = (mqtt->stats.published - mqtt->rate_published) / secs;
+        mqtt->ack_rate = (mqtt->stats.acked - mqtt->rate_acked) / secs;
+        mqtt->rate_start_ns = now;
+        mqtt->rate_published = mqtt->stats.published;
+        mqtt->rate_acked = mqtt->stats.acked;
+    }
+    if (mqtt->cfg.stats_topic && mqtt->connected && now >= mqtt->next_stats_ns){
+        mqtt->next_stats_ns = now + (uint64_t)mqtt->cfg.stats_interval_ms * 1000000;
+        json_t *stats = mon_mqtt_stats_json(mqtt);
+        char *dump = stats ? json_dumps(stats, JSON_COMPACT) : NULL;
+        if (dump){
+            mon_mqtt_publish(mqtt, mqtt->cfg.stats_topic, dump, strlen(dump), 0, 0);
+        }
+        free(dump);
+        json_decref(stats);
+    }
+    _mqtt_pump(mqtt);
+    _mqtt_sock_sync(mqtt);
+}
+
+/* Start a non-blocking connect, the CONNECT goes out once the socket is writable */
+static void _mqtt_connect(struct mon_mqtt *mqtt){
+    mqtt->next_connect_ns = 0;
+    int rc = mosquitto_connect_async(mqtt->mosq, mqtt->cfg.host, mqtt->cfg.port, mqtt->cfg.keepalive);
+    if (rc != MOSQ_ERR_SUCCESS){
+        LOGDEBUG("Failed to connect to mqtt broker:'%s:%d', err:'%s'\n", mqtt->cfg.host, mqtt->cfg.port,
+                 rc == MOSQ_ERR_ERRNO ? strerror(errno) : mosquitto_strerror(rc));
+    }
+    _mqtt_sock_sync(mqtt);
+}
+
+static void _mqtt_on_connect(struct mosquitto *mosq, void *data, int rc){
+    struct mon_mqtt *mqtt = data;
+    (void)mosq;
+    if (rc){
+        LOGERROR("mqtt broker:'%s:%d' refused connection:'%s'\n", mqtt->cfg.host, mqtt->cfg.port, mosquitto_connack_string(rc));
+        return;
+    }
+    LOGINFO("Connected to mqtt broker:'%s:%d'\n", mqtt->cfg.host, mqtt->cfg.port);
+    mqtt->connected = 1;
+    mqtt->backoff_ms = MQTT_RECONNECT_MIN_MS;
+    mqtt->stats.connects++;
+}
+
+/* The connection is gone. Acks for what was in flight won't come on a new one */
+static void _mqtt_lost(struct mon_mqtt *mqtt){
+    if (mqtt->connected){
+        LOGINFO("Disconnected from mqtt broker:'%s:%d'\n", mqtt->cfg.host, mqtt->cfg.port);
+        mqtt->stats.disconnects++;
+    }
+    mqtt->connected = 0;
+    for (uint32_t i = 0; i < mqtt->inflight_len; i++){
+        mqtt->stats.unacked += mqtt->inflight[(mqtt->inflight_head + i) % mqtt->cfg.max_inflight].mid != 0;
+    }
+    mqtt->inflight_head = 0;
+    mqtt->inflight_len = 0;
+}
+
+static void _mqtt_on_disconnect(struct mosquitto *mosq, void *data, int rc){
+    struct mon_mqtt *mqtt = data;
+    (void)mosq;
+    (void)rc;
+    _mqtt_lost(mqtt);
+    // mosquitto closed the socket, a new one may reuse its number
+    mqtt->sock_closed = 1;
+}
+
+/* PUBACK for mid, or a QoS 0 message written out */
+static void _mqtt_on_publish(struct mosquitto *mosq, void *data, int mid){
+    struct mon_mqtt *mqtt = data;
+    (void)mosq;
+    for (uint32_t i = 0; mid && i < mqtt->inflight_len; i++){
+        struct mqtt_inflight *msg = &mqtt->inflight[(mqtt->inflight_head + i) % mqtt->cfg.max_inflight];
+        if (msg->mid == mid){
+            mon_hist_record(&mqtt->ack_ns, mon_monotonic_ns() - msg->sent_ns);
+            msg->mid = 0;
+            mqtt->stats.acked++;
+            break;
+        }
+    }
+    // Acks come back in send order, so normally only the head is dropped here
+    while (mqtt->inflight_len && !mqtt->inflight[mqtt->inflight_head].mid){
+        mqtt->inflight_head = (mqtt->inflight_head + 1) % mqtt->cfg.max_inflight;
+        mqtt->inflight_len--;
+    }
+}
+
+/* Pause or resume reading the monitor */
+static void _mqtt_pause(struct mon_mqtt *mqtt, int paused){
+    if (mqtt->paused == paused){
+        return;
+    }
+    uint64_t now = mon_monotonic_ns();
+    mqtt->paused = paused;
+    if (paused){
+        LOGDEBUG("mqtt queue for:'%s' is full, pausing the monitor\n", mqtt->mon->base_path);
+        mqtt->paused_at_ns = now;
+        mqtt->stats.pauses++;
+    }else{
+        mqtt->stats.paused_ns += now - mqtt->paused_at_ns;
+    }
+    mon_reactor_pause_monitor(mqtt->reactor, mqtt->mon, paused);
+}
+
+/* Room in the window and the socket for another message */
+static int _mqtt_can_send(struct mon_mqtt *mqtt, int qos){
+    return mqtt->connected && (!qos || mqtt->inflight_len < mqtt->cfg.max_inflight) && !mosquitto_want_write(mqtt->mosq);
+}
+
+/* Hand one message to mosquitto, QoS1 ones go in the window. Returns the mosquitto error */
+static int _mqtt_send(struct mon_mqtt *mqtt, const char *topic, const void *payload, size_t len, int qos, int retain){
+    int mid = 0;
+    int rc = mosquitto_publish(mqtt->mosq, &mid, topic, (int)len, payload, qos, retain);
+    if (rc == MOSQ_ERR_SUCCESS){
+        mqtt->stats.published++;
+        mqtt->stats.bytes += len;
+        if (qos && !mqtt->connected){
+            // Written, then the connection dropped before it could be tracked
+            mqtt->stats.unacked++;
+        }else if (qos){
+            struct mqtt_inflight *msg = &mqtt->inflight[(mqtt->inflight_head + mqtt->inflight_len++) % mqtt->cfg.max_inflight];
+            msg->mid = mid;
+            msg->sent_ns = mon_monotonic_ns();
+        }
+    }else if (rc != MOSQ_ERR_NO_CONN && rc != MOSQ_ERR_CONN_LOST){
+        LOGDEBUG("Failed to publish to:'%s', err:'%s'\n", topic, mosquitto_strerror(rc));
+        mqtt->stats.dropped++;
+    }
+    return rc;
+}
+
+static uint32_t _mqtt_topic_hash(const char *topic, size_t len){
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)topic[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static struct mqtt_msg *_mqtt_find_queued(struct mon_mqtt *mqtt, const char *topic, size_t len, uint32_t hash){
+    struct mqtt_msg *msg = mqtt->buckets[hash & mqtt->bucket_mask];
+    for (; msg != NULL; msg = msg->hnext){
+        if (msg->hash == hash && msg->topic_len == len && !memcmp(msg->buf, topic, len)){
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+/* Copy a message into a queue slot, reusing its buffer */
+static int _mqtt_msg_set(struct mqtt_msg *msg, const char *topic, size_t topic_len, const void *payload, size_t len, int qos, int retain){
+    if (_mqtt_grow(&msg->buf, &msg->buf_size, topic_len + 1 + len)){
+        return -1;
+    }
+    memcpy(msg->buf, topic, topic_len);
+    msg->buf[topic_len] = '\0';
+    memcpy(msg->buf + topic_len + 1, payload, len);
+    msg->topic_len = topic_len;
+    msg->payload_len = len;
+    msg->qos = qos;
+    msg->retain = retain;
+    return 0;
+}
+
+/* Add a message behind the queued ones. Past queue_len this pauses the monitor, or
+ * when conflating, only replaces a message already queued on the same topic */
+static int _mqtt_enqueue(struct mon_mqtt *mqtt, const char *topic, const void *payload, size_t len, int qos, int retain){
+    size_t topic_len = strlen(topic);
+    uint32_t hash = 0;
+    if (mqtt->buckets){
+        hash = _mqtt_topic_hash(topic, topic_len);
+        struct mqtt_msg *msg = _mqtt_find_queued(mqtt, topic, topic_len, hash);
+        if (msg){
+            if (_mqtt_msg_set(msg, topic, topic_len, payload, len, qos, retain)){
+                mqtt->stats.dropped++;
+                return -1;
+            }
+            mqtt->stats.conflated++;
+            return 0;
+        }
+    }
+    if (mqtt->queued >= mqtt->queue_cap || (mqtt->buckets && mqtt->queued >= mqtt->cfg.queue_len)){
+        mqtt->stats.dropped++;
+        return -1;
+    }
+    struct mqtt_msg *msg = &mqtt->queue[(mqtt->queue_head + mqtt->queued) % mqtt->queue_cap];
+    if (_mqtt_msg_set(msg, topic, topic_len, payload, len, qos, retain)){
+        mqtt->stats.dropped++;
+        return -1;
+    }
+    msg->hash = hash;
+    if (mqtt->buckets){
+        msg->hnext = mqtt->buckets[hash & mqtt->bucket_mask];
+        mqtt->buckets[hash & mqtt->bucket_mask] = msg;
+    }
+    mqtt->queued++;
+    if (mqtt->cfg.backpressure == MQTT_BACKPRESSURE_PAUSE && mqtt->queued >= mqtt->cfg.queue_len){
+        // The rest of the current read still fits, queue_cap leaves room for it
+        _mqtt_pause(mqtt, 1);
+    }
+    return 0;
+}
+
+/* Hand queued messages to mosquitto while the window and socket have room */
+static void _mqtt_pump(struct mon_mqtt *mqtt){
+    while (mqtt->queued){
+        struct mqtt_msg *msg = &mqtt->queue[mqtt->queue_head];
+        if (!_mqtt_can_send(mqtt, msg->qos)){
+            break;
+        }
+        int rc = _mqtt_send(mqtt, msg->buf, msg->buf + msg->topic_len + 1, msg->payload_len, msg->qos, msg->retain);
+        if (rc == MOSQ_ERR_NO_CONN || rc == MOSQ_ERR_CONN_LOST){
+            break;
+        }
+        if (mqtt->buckets){
+            struct mqtt_msg **pptr = &mqtt->buckets[msg->hash & mqtt->bucket_mask];
+            while (*pptr != msg){
+                pptr = &(*pptr)->hnext;
+            }
+            *pptr = msg->hnext;
+        }
+        mqtt->queue_head = (mqtt->queue_head + 1) % mqtt->queue_cap;
+        mqtt->queued--;
+    }
+    if (mqtt->paused && mqtt->queued <= mqtt->cfg.queue_len / 2){
+        _mqtt_pause(mqtt, 0);
+    }
+}
+
+int mon_mqtt_publish(struct mon_mqtt *mqtt, const char *topic, const void *payload, size_t len, int qos, int retain){
+    int ret = 0;
+    if (!mqtt || !topic || len > UINT32_MAX){
+        return -1;
+    }
+    if (!mqtt->queued && _mqtt_can_send(mqtt, qos)){
+        // Nothing is waiting ahead of it, skip the copy into the queue
+        int rc = _mqtt_send(mqtt, topic, payload, len, qos, retain);
+        if (rc == MOSQ_ERR_NO_CONN || rc == MOSQ_ERR_CONN_LOST){
+            ret = _mqtt_enqueue(mqtt, topic, payload, len, qos, retain);
+        }else if (rc != MOSQ_ERR_SUCCESS){
+            ret = -1;
+        }
+    }else{
+        ret = _mqtt_enqueue(mqtt, topic, payload, len, qos, retain);
+    }
+    // Whatever didn't fit in the socket goes out once it's writable
+    _mqtt_sock_sync(mqtt);
+    return ret;
+}
+
+/* Publish one event on its topic */
+static int _mqtt_publish_event(struct mon_mqtt *mqtt, struct inotify_event *event){
+    struct fs_event_manager *mon = mqtt->mon;
+    const char *rel = "";
+    size_t rel_len = 0;
+    if (event->mask & IN_IGNORED){
+        return 0;
+    }
+    if (!(event->mask & IN_Q_OVERFLOW)){
+        size_t len = 0;
+        const char *path = monitor_event_path(mon, event->wd, event->len ? event->name : NULL, &len);
+        if (!path){
+            mqtt->stats.dropped++;
+            return -1;
+        }
+        rel = path;
+        rel_len = len;
+        if (len >= mqtt->base_len && !memcmp(path, mon->base_path, mqtt->base_len)){
+            rel += mqtt->base_len;
+            rel_len -= mqtt->base_len;
+        }
+        while (rel_len && *rel == '/'){
+            rel++;
+            rel_len--;
+        }
+    }
+    size_t prefix_len = strlen(mqtt->cfg.topic_prefix);
+    if (_mqtt_grow(&mqtt->topic, &mqtt->topic_size, prefix_len + rel_len + 2) ||
+        _mqtt_grow(&mqtt->payload, &mqtt->payload_size, rel_len * 6 + 96)){
+        mqtt->stats.dropped++;
+        return -1;
+    }
+    char *topic = mqtt->topic;
+    memcpy(topic, mqtt->cfg.topic_prefix, prefix_len);
+    if (rel_len){
+        topic[prefix_len++] = '/';
+        for (size_t i = 0; i < rel_len; i++){
+            // Wildcards aren't allowed in a published topic
+            topic[prefix_len++] = (rel[i] == '+' || rel[i] == '#') ? '_' : rel[i];
+        }
+    }
+    topic[prefix_len] = '\0';
+
+    uint32_t bits = event->mask & ~IN_ISDIR;
+    const char *name = bits ? monitor_mask_name(1u << __builtin_ctz(bits)) : NULL;
+    size_t len = sprintf(mqtt->payload, "{\"event\":\"%s\",\"dir\":%s,\"path\":\"",
+                         name ?: "unknown", (event->mask & IN_ISDIR) ? "true" : "false");
+    len += _mqtt_json_escape(mqtt->payload + len, rel, rel_len);
+    mqtt->payload[len++] = '"';
+    mqtt->payload[len++] = '}';
+    return mon_mqtt_publish(mqtt, topic, mqtt->payload, len, mqtt->cfg.qos, mqtt->cfg.retain);
+}
+
+int mon_mqtt_event_handler(struct inotify_event *event, void *data){
+    struct fs_event_manager *mon = data;
+    struct mon_mqtt *mqtt = mon ? mon->mqtt : NULL;
+    if (!mqtt){
+        return 0;
+    }
+    _mqtt_publish_event(mqtt, event);
+    return mqtt->next_handler ? mqtt->next_handler(event, data) : 0;
+}
+
+json_t *mon_mqtt_stats_json(struct mon_mqtt *mqtt){
+    if (!mqtt){
+        return NULL;
+    }
+    json_t *obj = mqtt->mon->metrics ? monitor_metrics_json(mqtt->mon) : json_object();
+    json_t *stats = json_object();
+    if (!obj || !stats){
+        LOGERROR("Failed to alloc mqtt stats\n");
+        json_decref(obj);
+        json_decref(stats);
+        return NULL;
+    }
+    json_object_set_new(stats, "connected", json_boolean(mqtt->connected));
+    json_object_set_new(stats, "published", json_integer(mqtt->stats.published));
+    json_object_set_new(stats, "acked", json_integer(mqtt->stats.acked));
+    json_object_set_new(stats, "unacked", json_integer(mqtt->stats.unacked));
+    json_object_set_new(stats, "dropped", json_integer(mqtt->stats.dropped));
+    json_object_set_new(stats, "conflated", json_integer(mqtt->stats.conflated));
+    json_object_set_new(stats, "bytes", json_integer(mqtt->stats.bytes));
+    json_object_set_new(stats, "connects", json_integer(mqtt->stats.connects));
+    json_object_set_new(stats, "disconnects", json_integer(mqtt->stats.disconnects));
+    json_object_set_new(stats, "queued", json_integer(mqtt->queued));
+    json_object_set_new(stats, "inflight", json_integer(mqtt->inflight_len));
+    json_object_set_new(stats, "paused", json_boolean(mqtt->paused));
+    json_object_set_new(stats, "pauses", json_integer(mqtt->stats.pauses));
+    json_object_set_new(stats, "paused_ms", json_integer((mqtt->stats.paused_ns +
+                        (mqtt->paused ? mon_monotonic_ns() - mqtt->paused_at_ns : 0)) / 1000000));
+    json_object_set_new(stats, "publish_rate", json_real(mqtt->publish_rate));
+    json_object_set_new(stats, "ack_rate", json_real(mqtt->ack_rate));
+    json_object_set_new(stats, "ack_ns", mon_hist_json(&mqtt->ack_ns));
+    json_object_set_new(obj, "mqtt", stats);
+    return obj;
+}
+
+/* Copy the config, filling in defaults. Strings are strdup'ed so the caller's can go away */
+static int _mqtt_copy_config(struct mon_mqtt_config *dst, const struct mon_mqtt_config *src){
+    char client_id[64];
+    memset(dst, 0, sizeof(*dst));
+    if (src){
+        *dst = *src;
+    }
+    if (!dst->client_id){
+        snprintf(client_id, sizeof(client_id), "event_kitchen_%d", getpid());
+        dst->client_id = client_id;
+    }
+    dst->host = strdup(dst->host ?: "localhost");
+    dst->client_id = strdup(dst->client_id);
+    dst->topic_prefix = strdup(dst->topic_prefix ?: "event_kitchen");
+    dst->username = dst->username ? strdup(dst->username) : NULL;
+    dst->password = dst->password ? strdup(dst->password) : NULL;
+    dst->cafile = dst->cafile ? strdup(dst->cafile) : NULL;
+    dst->stats_topic = dst->stats_topic ? strdup(dst->stats_topic) : NULL;
+    if (!dst->port){
+        dst->port = dst->cafile ? 8883 : 1883;
+    }
+    if (dst->keepalive <= 0){
+        dst->keepalive = 60;
+    }
+    if (!dst->stats_interval_ms){
+        dst->stats_interval_ms = 10000;
+    }
+    if (!dst->max_inflight){
+        dst->max_inflight = MQTT_DEFAULT_INFLIGHT;
+    }
+    if (!dst->queue_len){
+        dst->queue_len = MQTT_DEFAULT_QUEUE_LEN;
+    }
+    if (dst->qos < 0 || dst->qos > 1){
+        dst->qos = 1;
+    }
+    // Trailing '/' would leave an empty level before every path
+    char *prefix = (char *)dst->topic_prefix;
+    size_t prefix_len = prefix ? strlen(prefix) : 0;
+    while (prefix_len > 1 && prefix[prefix_len - 1] == '/'){
+        prefix[--prefix_len] = '\0';
+    }
+    if (!dst->host || !dst->client_id || !dst->topic_prefix || (src && src->username && !dst->username) ||
+        (src && src->password && !dst->password) || (src && src->cafile && !dst->cafile) ||
+        (src && src->stats_topic && !dst->stats_topic)){
+        return -1;
+    }
+    return 0;
+}
+
+static void _mqtt_free_config(struct mon_mqtt_config *cfg){
+    free((char *)cfg->host);
+    free((char *)cfg->client_id);
+    free((char *)cfg->topic_prefix);
+    free((char *)cfg->username);
+    free((char *)cfg->password);
+    free((char *)cfg->cafile);
+    free((char *)cfg->stats_topic);
+}
+
+struct mon_mqtt *mon_mqtt_create(struct mon_reactor *reactor, struct fs_event_manager *mon, const struct mon_mqtt_config *cfg){
+    if (!reactor || !mon || !mon->base_path){
+        LOGERROR("Null reactor or monitor provided\n");
+        return NULL;
+    }
+    if (mon->mqtt || mon->batch_handler || mon->reader){
+        LOGERROR("Monitor:'%s' is already bridged, has a batch handler or a reader thread\n", mon->base_path);
+        return NULL;
+    }
+    struct mon_mqtt *mqtt = calloc(1, sizeof(struct mon_mqtt));
+    if (!mqtt){
+        LOGERROR("Failed to alloc mqtt bridge for:'%s'\n", mon->base_path);
+        return NULL;
+    }
+    mqtt->reactor = reactor;
+    mqtt->mon = mon;
+    mqtt->sock = -1;
+    mqtt->base_len = strlen(mon->base_path);
+    mqtt->backoff_ms = MQTT_RECONNECT_MIN_MS;
+    mqtt->rate_start_ns = mon_monotonic_ns();
+    if (_mqtt_copy_config(&mqtt->cfg, cfg)){
+        LOGERROR("Failed to copy mqtt config for:'%s'\n", mon->base_path);
+        _mqtt_free_config(&mqtt->cfg);
+        free(mqtt);
+        return NULL;
+    }
+    // Backpressure only stops the next read, what's left of the current one must still fit
+    mqtt->queue_cap = mqtt->cfg.queue_len + mon->buf_len / sizeof(struct inotify_event) + 1;
+    mqtt->queue = calloc(mqtt->queue_cap, sizeof(struct mqtt_msg));
+    mqtt->inflight = calloc(mqtt->cfg.max_inflight, sizeof(struct mqtt_inflight));
+    if (mqtt->cfg.backpressure == MQTT_BACKPRESSURE_CONFLATE){
+        size_t buckets = 1;
+        while (buckets < mqtt->queue_cap){
+            buckets *= 2;
+        }
+        mqtt->bucket_mask = buckets - 1;
+        mqtt->buckets = calloc(buckets, sizeof(struct mqtt_msg *));
+    }
+    if (!mqtt->queue || !mqtt->inflight || (mqtt->cfg.backpressure == MQTT_BACKPRESSURE_CONFLATE && !mqtt->buckets)){
+        LOGERROR("Failed to alloc mqtt queue of '%u' for:'%s'\n", mqtt->queue_cap, mon->base_path);
+        free(mqtt->queue);
+        free(mqtt->inflight);
+        free(mqtt->buckets);
+        _mqtt_free_config(&mqtt->cfg);
+        free(mqtt);
+        return NULL;
+    }
+    pthread_mutex_lock(&_lib_lock);
+    if (!_lib_refs++){
+        mosquitto_lib_init();
+    }
+    pthread_mutex_unlock(&_lib_lock);
+
+    mqtt->mosq = mosquitto_new(mqtt->cfg.client_id, true, mqtt);
+    if (!mqtt->mosq){
+        LOGERROR("Failed to create mosquitto client:'%s'\n", mqtt->cfg.client_id);
+        mon_mqtt_destroy(mqtt);
+        return NULL;
+    }
+    mosquitto_connect_callback_set(mqtt->mosq, _mqtt_on_connect);
+    mosquitto_disconnect_callback_set(mqtt->mosq, _mqtt_on_disconnect);
+    mosquitto_publish_callback_set(mqtt->mosq, _mqtt_on_publish);
+    // The bridge keeps the window, mosquitto mustn't hold messages back in its own queue
+    mosquitto_max_inflight_messages_set(mqtt->mosq, mqtt->cfg.max_inflight);
+    if (mqtt->cfg.username){
+        mosquitto_username_pw_set(mqtt->mosq, mqtt->cfg.username, mqtt->cfg.password);
+    }
+    if (mqtt->cfg.cafile){
+        mosquitto_tls_opts_set(mqtt->mosq, 1, NULL, NULL);
+        if (mosquitto_tls_set(mqtt->mosq, mqtt->cfg.cafile, NULL, NULL, NULL, NULL) != MOSQ_ERR_SUCCESS){
+            LOGERROR("Failed to set mqtt cafile:'%s'\n", mqtt->cfg.cafile);
+            mon_mqtt_destroy(mqtt);
+            return NULL;
+        }
+    }
+    mqtt->timer = mon_reactor_add_timer(reactor, MQTT_TICK_MS, _mqtt_tick, mqtt);
+    if (!mqtt->timer){
+        mon_mqtt_destroy(mqtt);
+        return NULL;
+    }
+    mqtt->next_handler = mon->handler;
+    mon->handler = mon_mqtt_event_handler;
+    mon->mqtt = mqtt;
+    _mqtt_connect(mqtt);
+    return mqtt;
+}
+
+void mon_mqtt_destroy(struct mon_mqtt *mqtt){
+    if (!mqtt){
+        return;
+    }
+    if (mqtt->paused){
+        mon_reactor_pause_monitor(mqtt->reactor, mqtt->mon, 0);
+    }
+    if (mqtt->mon->mqtt == mqtt){
+        if (mqtt->mon->handler == mon_mqtt_event_handler){
+            mqtt->mon->handler = mqtt->next_handler;
+        }
+        mqtt->mon->mqtt = NULL;
+    }
+    // Out of the epoll set while the fd is still open
+    if (mqtt->sock_src){
+        mon_reactor_remove(mqtt->reactor, mqtt->sock_src);
+    }
+    if (mqtt->timer){
+        mon_reactor_remove(mqtt->reactor, mqtt->timer);
+    }
+    if (mqtt->mosq){
+        if (mqtt->connected){
+            mosquitto_disconnect(mqtt->mosq);
+        }
+        mosquitto_destroy(mqtt->mosq);
+    }
+    pthread_mutex_lock(&_lib_lock);
+    if (!--_lib_refs){
+        mosquitto_lib_cleanup();
+    }
+    pthread_mutex_unlock(&_lib_lock);
+    _mqtt_free_config(&mqtt->cfg);
+    for (uint32_t i = 0; i < mqtt->queue_cap; i++){
+        free(mqtt->queue[i].buf);
+    }
+    free(mqtt->queue);
+    free(mqtt->inflight);
+    free(mqtt->buckets);
+    free(mqtt->topic);
+    free(mqtt->payload);
+    free(mqtt);
+}
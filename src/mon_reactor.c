@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_resync.h"
+#include "includes/mon_coalesce.h"
+#include "includes/mon_reactor.h"
+#include "includes/mon_utils.h"
+
+/* epoll reactor. 
+ * One thread waits on every registered fd at once, so loop cost follows the number of 
+ * ready fds rather than the number registered. Monitors that still have periodic work 
+ * (moves waiting for their pair, a resync, or a read cut short) sit on a busy list that 
+ * is walked each pass, everything else is only touched when its fd fires. 
+ */
+
+/* Most reads done for one monitor per wakeup, so a busy tree can't starve the others. 
+ * What's left is read on the next pass via the busy list. 
+ */
+#define REACTOR_MAX_READS 16
+
+static struct reactor_source *_reactor_new_source(struct mon_reactor *reactor, enum reactor_source_type type, 
+                                                  int fd, uint32_t events, reactor_cb cb, void *data){
+    struct reactor_source *src = calloc(1, sizeof(struct reactor_source));
+    if (!src){
+        LOGERROR("Failed to alloc reactor source for fd:'%d'\n", fd);
+        return NULL;
+    }
+    src->type = type;
+    src->fd = fd;
+    src->events = events;
+    src->cb = cb;
+    src->data = data;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, fd, &ev)){
+        LOGERROR("Failed to add fd:'%d' to reactor, err:'%s'\n", fd, strerror(errno));
+        free(src);
+        return NULL;
+    }
+    src->next = reactor->sources;
+    if (reactor->sources){
+        reactor->sources->prev = src;
+    }
+    reactor->sources = src;
+    reactor->source_cnt++;
+    return src;
+}
+
+static void _reactor_set_busy(struct mon_reactor *reactor, struct reactor_source *src){
+    if (!src->busy && !src->removed){
+        src->busy = 1;
+        src->busy_next = reactor->busy;
+        reactor->busy = src;
+    }
+}
+
+/* Pick up a replaced inotify fd or coalesce timer, and queue the monitor for periodic work if it has any */
+static void _reactor_monitor_sync(struct mon_reactor *reactor, struct reactor_source *src){
+    struct fs_event_manager *mon = src->data;
+    if (src->removed){
+        return;
+    }
+    if (mon->ifd >= 0 && (mon->ifd != src->fd || mon->ifd_gen != src->ifd_gen)){
+        // The old fd was closed, which already dropped it from the epoll set
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = src->events;
+        ev.data.ptr = src;
+        epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, mon->ifd, NULL);
+        if (epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, mon->ifd, &ev)){
+            LOGERROR("Failed to re-add inotify fd:'%d' for:'%s', err:'%s'\n", 
+                     mon->ifd, mon->base_path ?: "", strerror(errno));
+        }
+        LOGDEBUG("Reactor picked up new inotify fd:'%d' for:'%s'\n", mon->ifd, mon->base_path ?: "");
+        src->fd = mon->ifd;
+        src->ifd_gen = mon->ifd_gen;
+        // Events may have queued before it was added, read it on the next pass
+        _reactor_set_busy(reactor, src);
+    }
+    int timer_fd = monitor_coalesce_fd(mon);
+    if (src->coalesce && src->coalesce->fd != timer_fd){
+        // Coalescing was turned off or restarted. Closing the timerfd already dropped it from 
+        // the epoll set, and its number may be in use again, so it isn't deleted by number
+        src->coalesce->fd = -1;
+        mon_reactor_remove(reactor, src->coalesce);
+        src->coalesce = NULL;
+    }
+    if (!src->coalesce && timer_fd >= 0){
+        src->coalesce = _reactor_new_source(reactor, REACTOR_SRC_COALESCE, timer_fd, src->paused ? 0 : EPOLLIN, NULL, src);
+    }
+    if (mon->pending_move_cnt || mon->resync_pending){
+        _reactor_set_busy(reactor, src);
+    }
+}
+
+/* Read the monitor's inotify fd until it's empty, or REACTOR_MAX_READS is hit */
+static int _reactor_monitor_drain(struct mon_reactor *reactor, struct reactor_source *src){
+    struct fs_event_manager *mon = src->data;
+    int reads = 0;
+    int ret = 0;
+    while (!src->removed && !src->paused && mon->ifd >= 0 && mon->ifd == src->fd && reads < REACTOR_MAX_READS){
+        ret = read_events_batch(mon);
+        if (ret <= 0){
+            break;
+        }
+        reads++;
+    }
+    _reactor_monitor_sync(reactor, src);
+    // Edge triggered, there's no new wakeup for what's still unread
+    return reads == REACTOR_MAX_READS;
+}
+
+/* Periodic work for monitors on the busy list. Returns the longest the next wait may take */
+static int _reactor_tick(struct mon_reactor *reactor, int timeout_ms){
+    struct reactor_source **pptr = &reactor->busy;
+    uint64_t now = mon_monotonic_ns();
+    while (*pptr){
+        struct reactor_source *src = *pptr;
+        struct fs_event_manager *mon = src->data;
+        int more = 0;
+        if (src->removed){
+            *pptr = src->busy_next;
+            continue;
+        }
+        if (src->paused){
+            // Resyncs and moves would reach the handlers too, it's queued again on resume
+            *pptr = src->busy_next;
+            src->busy = 0;
+            src->busy_next = NULL;
+            continue;
+        }
+        monitor_expire_moves(mon);
+        monitor_resync_step(mon, MON_RESYNC_BATCH);
+        more = _reactor_monitor_drain(reactor, src);
+        if (src->removed || (!more && !mon->pending_move_cnt && !mon->resync_pending)){
+            *pptr = src->busy_next;
+            src->busy = 0;
+            src->busy_next = NULL;
+            continue;
+        }
+        if (more || mon->resync_pending){
+            timeout_ms = 0;
+        }else if (mon->pending_move_cnt){
+            // Wake up when the oldest move waiting for its pair is due
+            uint64_t due = mon->pending_moves[0].expires_ns;
+            int wait_ms = due > now ? (int)((due - now) / 1000000) + 1 : 0;
+            if (timeout_ms < 0 || wait_ms < timeout_ms){
+                timeout_ms = wait_ms;
+            }
+        }
+        pptr = &src->busy_next;
+    }
+    return timeout_ms;
+}
+
+/* Free removed sources, once nothing can point at them anymore */
+static void _reactor_reap(struct mon_reactor *reactor){
+    struct reactor_source **pptr = &reactor->busy;
+    while (*pptr){
+        if ((*pptr)->removed){
+            *pptr = (*pptr)->busy_next;
+        }else{
+            pptr = &(*pptr)->busy_next;
+        }
+    }
+    while (reactor->dead){
+        struct reactor_source *src = reactor->dead;
+        reactor->dead = src->next;
+        free(src);
+    }
+}
+
+/* Create a reactor handling up to max_events ready fds per wait */
+struct mon_reactor *mon_reactor_create(int max_events){
+    struct mon_reactor *reactor = calloc(1, sizeof(struct mon_reactor));
+    if (!reactor){
+        LOGERROR("Failed to alloc reactor\n");
+        return NULL;
+    }
+    reactor->max_events = max_events > 0 ? max_events : REACTOR_DEFAULT_MAX_EVENTS;
+    reactor->events = calloc(reactor->max_events, sizeof(struct epoll_event));
+    reactor->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!reactor->events || reactor->epfd < 0){
+        LOGERROR("Failed to create reactor, err:'%s'\n", strerror(errno));
+        if (reactor->epfd >= 0){
+            close(reactor->epfd);
+        }
+        free(reactor->events);
+        free(reactor);
+        return NULL;
+    }
+    return reactor;
+}
+
+/* Remove every source and free the reactor */
+void mon_reactor_destroy(struct mon_reactor *reactor){
+    if (!reactor){
+        return;
+    }
+    while (reactor->sources){
+        mon_reactor_remove(reactor, reactor->sources);
+    }
+    _reactor_reap(reactor);
+    close(reactor->epfd);
+    free(reactor->events);
+    free(reactor);
+}
+
+/* Register fd for events, cb is called when it's ready */
+struct reactor_source *mon_reactor_add_fd(struct mon_reactor *reactor, int fd, uint32_t events, reactor_cb cb, void *data){
+    if (!reactor || fd < 0 || !cb){
+        LOGERROR("Null reactor or call back, or invalid fd:'%d'\n", fd);
+        return NULL;
+    }
+    return _reactor_new_source(reactor, REACTOR_SRC_FD, fd, events, cb, data);
+}
+
+/* Change the events registered for a source */
+int mon_reactor_mod_fd(struct mon_reactor *reactor, struct reactor_source *src, uint32_t events){
+    if (!reactor || !src || src->removed){
+        return -1;
+    }
+    if (events == src->events){
+        return 0;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = src;
+    if (epoll_ctl(reactor->epfd, EPOLL_CTL_MOD, src->fd, &ev)){
+        LOGERROR("Failed to modify fd:'%d' in reactor, err:'%s'\n", src->fd, strerror(errno));
+        return -1;
+    }
+    src->events = events;
+    return 0;
+}
+
+/* Register an initialized monitor */
+struct reactor_source *mon_reactor_add_monitor(struct mon_reactor *reactor, struct fs_event_manager *mon){
+    if (!reactor || !mon || mon->ifd < 0){
+        LOGERROR("Null reactor or monitor, or monitor not initialized\n");
+        return NULL;
+    }
+    if (mon->reader){
+        // Its reader thread owns the fd, reading it here too would split the stream
+        LOGERROR("Monitor of:'%s' has a reader thread, it can't be added to a reactor\n", mon->base_path ?: "");
+        return NULL;
+    }
+    struct reactor_source *src = _reactor_new_source(reactor, REACTOR_SRC_MONITOR, mon->ifd, 
+                                                     EPOLLIN | EPOLLET, NULL, mon);
+    if (!src){
+        return NULL;
+    }
+    src->ifd_gen = mon->ifd_gen;
+    // Registers the coalesce timer if coalescing is on
+    _reactor_monitor_sync(reactor, src);
+    // Anything queued before the fd was added would never trigger the edge
+    _reactor_set_busy(reactor, src);
+    return src;
+}
+
+/* Add a timer firing every interval_ms */
+struct reactor_source *mon_reactor_add_timer(struct mon_reactor *reactor, uint32_t interval_ms, reactor_cb cb, void *data){
+    if (!reactor || !cb || !interval_ms){
+        LOGERROR("Null reactor or call back, or zero interval\n");
+        return NULL;
+    }
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0){
+        LOGERROR("Failed to create timer, err:'%s'\n", strerror(errno));
+        return NULL;
+    }
+    struct itimerspec its;
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000l;
+    its.it_value = its.it_interval;
+    struct reactor_source *src = NULL;
+    if (timerfd_settime(fd, 0, &its, NULL) || 
+        !(src = _reactor_new_source(reactor, REACTOR_SRC_TIMER, fd, EPOLLIN, cb, data))){
+        LOGERROR("Failed to start timer of '%u' ms\n", interval_ms);
+        close(fd);
+        return NULL;
+    }
+    return src;
+}
+
+/* Stop or restart reading a registered monitor */
+int mon_reactor_pause_monitor(struct mon_reactor *reactor, struct fs_event_manager *mon, int paused){
+    if (!reactor || !mon){
+        return -1;
+    }
+    for (struct reactor_source *src = reactor->sources; src != NULL; src = src->next){
+        if (src->type == REACTOR_SRC_MONITOR && src->data == mon){
+            src->paused = paused;
+            if (src->coalesce){
+                // Held back events stay held, the timer is level triggered and fires again on resume
+                mon_reactor_mod_fd(reactor, src->coalesce, paused ? 0 : EPOLLIN);
+            }
+            if (!paused){
+                // Edge triggered, what queued while paused won't wake us up again
+                _reactor_set_busy(reactor, src);
+            }
+            return 0;
+        }
+    }
+    LOGERROR("Monitor:'%s' isn't registered with the reactor\n", mon->base_path ?: "");
+    return -1;
+}
+
+/* Remove a source */
+int mon_reactor_remove(struct mon_reactor *reactor, struct reactor_source *src){
+    if (!reactor || !src || src->removed){
+        return -1;
+    }
+    if (src->coalesce){
+        mon_reactor_remove(reactor, src->coalesce);
+        src->coalesce = NULL;
+    }
+    epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+    if (src->type == REACTOR_SRC_TIMER){
+        close(src->fd);
+    }
+    if (src->prev){
+        src->prev->next = src->next;
+    }else{
+        reactor->sources = src->next;
+    }
+    if (src->next){
+        src->next->prev = src->prev;
+    }
+    reactor->source_cnt--;
+    // Ready events already fetched, or the busy list, may still point at it. Freed by _reactor_reap()
+    src->removed = 1;
+    src->next = reactor->dead;
+    src->prev = NULL;
+    reactor->dead = src;
+    return 0;
+}
+
+/* Wait up to timeout_ms and dispatch whatever is ready */
+int mon_reactor_run_once(struct mon_reactor *reactor, int timeout_ms){
+    if (!reactor){
+        return -1;
+    }
+    timeout_ms = _reactor_tick(reactor, timeout_ms);
+    reactor->waits++;
+    int cnt = epoll_wait(reactor->epfd, reactor->events, reactor->max_events, timeout_ms);
+    if (cnt < 0){
+        if (errno == EINTR){
+            return 0;
+        }
+        LOGERROR("epoll_wait failed, err:'%s'\n", strerror(errno));
+        return -1;
+    }
+    for (int i = 0; i < cnt; i++){
+        struct reactor_source *src = reactor->events[i].data.ptr;
+        uint32_t events = reactor->events[i].events;
+        uint64_t expirations;
+        if (src->removed){
+            continue;
+        }
+        switch (src->type){
+            case REACTOR_SRC_MONITOR:
+                if (_reactor_monitor_drain(reactor, src)){
+                    _reactor_set_busy(reactor, src);
+                }
+                break;
+            case REACTOR_SRC_COALESCE:
+                // data is the monitor's source
+                if (!((struct reactor_source *)src->data)->paused){
+                    monitor_coalesce_flush_expired(((struct reactor_source *)src->data)->data);
+                }
+                _reactor_monitor_sync(reactor, src->data);
+                break;
+            case REACTOR_SRC_TIMER:
+                if (read(src->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN){
+                    LOGERROR("Failed to read timer fd:'%d', err:'%s'\n", src->fd, strerror(errno));
+                }
+                src->cb(reactor, src, events, src->data);
+                break;
+            default:
+                src->cb(reactor, src, events, src->data);
+                break;
+        }
+    }
+    _reactor_reap(reactor);
+    return cnt;
+}
+
+/* Dispatch until mon_reactor_stop() is called */
+int mon_reactor_run(struct mon_reactor *reactor){
+    if (!reactor){
+        LOGERROR("Null reactor provided to run\n");
+        return -1;
+    }
+    reactor->running = 1;
+    while (reactor->running){
+        if (mon_reactor_run_once(reactor, -1) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Make mon_reactor_run() return after the current dispatch */
+void mon_reactor_stop(struct mon_reactor *reactor){
+    if (reactor){
+        reactor->running = 0;
+    }
+}
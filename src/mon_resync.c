@@ -0,0 +1,208 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_scan.h"
+#include "includes/mon_coalesce.h"
+#include "includes/mon_resync.h"
+#include "includes/mon_shard.h"
+#include "includes/mon_utils.h"
+
+/* Incremental resync after IN_Q_OVERFLOW. 
+ * Once the kernel queue overflows, events are lost and the watch tree can't be trusted. 
+ * Instead of rebuilding every watch with reset_monitor(), each watched dir is stat()ed 
+ * and only the dirs whose mtime changed are listed again, comparing their sub dirs 
+ * against the tree. Dirs are checked a batch at a time in wd index order, and the cursor 
+ * is a wd_index slot, so events handled between batches can add and remove dirs safely. 
+ * A rehash of the index moves the cursor back to the start. 
+ */
+
+struct resync_ctx {
+    struct fs_event_manager *mon;
+    struct w_dir *wdir; // dir being listed
+    uint32_t gen; // mark for children found in the listing
+    char *path; // scratch for full paths
+    size_t path_size;
+    char *names; // NUL separated names of sub dirs not in the tree
+    size_t names_len;
+    size_t names_size;
+};
+
+static int _resync_reserve(char **buf, size_t *size, size_t need){
+    if (need <= *size){
+        return 0;
+    }
+    size_t newsize = *size ? *size : 4096;
+    while (newsize < need){
+        newsize *= 2;
+    }
+    char *newbuf = realloc(*buf, newsize);
+    if (!newbuf){
+        LOGERROR("Failed to grow resync buffer to '%zu'\n", newsize);
+        return -1;
+    }
+    *buf = newbuf;
+    *size = newsize;
+    return 0;
+}
+
+/* Feed a synthetic event for wd/name to the monitor's handlers, through coalescing like a read event */
+static void _resync_emit(struct fs_event_manager *mon, int wd, uint32_t mask, const char *name){
+    union {
+        struct inotify_event event;
+        char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+    } ev;
+    size_t len = name ? strlen(name) : 0;
+    if (len > NAME_MAX){
+        return;
+    }
+    memset(&ev.event, 0, sizeof(ev.event));
+    ev.event.wd = wd;
+    ev.event.mask = mask;
+    if (len){
+        ev.event.len = len + 1;
+        memcpy(ev.event.name, name, len + 1);
+    }
+    if (mon->coalesce){
+        monitor_coalesce_handler(&ev.event, mon);
+    }else{
+        monitor_deliver_event(mon, &ev.event);
+    }
+}
+
+// Mark sub dirs already in the tree, remember the ones that aren't 
+static int _resync_subdir(int dirfd, const char *name, size_t name_len, void *data){
+    (void)dirfd;
+    struct resync_ctx *ctx = data;
+    if (!monitor_shard_owns(ctx->mon, ctx->wdir, name, name_len)){
+        /* Watched by another shard. Only the first shard gets the base dir's events, so 
+         * it creates the dirs the owner lost, the handler routes IN_CREATE there */
+        struct fs_event_manager *owner = monitor_shard_route(ctx->mon, name);
+        if (ctx->mon->shard_idx || owner == ctx->mon || get_child_dir(owner->watch_root, (char *)name, owner)){
+            return 0;
+        }
+    }else{
+        struct w_dir *child = get_child_dir(ctx->wdir, (char *)name, ctx->mon);
+        if (child){
+            child->resync_gen = ctx->gen;
+            return 0;
+        }
+    }
+    if (_resync_reserve(&ctx->names, &ctx->names_size, ctx->names_len + name_len + 1)){
+        return -1;
+    }
+    memcpy(ctx->names + ctx->names_len, name, name_len + 1);
+    ctx->names_len += name_len + 1;
+    return 0;
+}
+
+/* Check one watched dir against the fs, emitting events for whatever changed */
+static void _resync_dir(struct resync_ctx *ctx, struct w_dir *wdir){
+    struct fs_event_manager *mon = ctx->mon;
+    struct stat st;
+    size_t len = get_wdir_path(wdir, NULL, 0);
+    if (_resync_reserve(&ctx->path, &ctx->path_size, len + 1)){
+        return;
+    }
+    get_wdir_path(wdir, ctx->path, ctx->path_size);
+    int fd = mon_open_dir(ctx->path, len);
+    if (fd < 0 || fstat(fd, &st) || (wdir->ino && (uint64_t)st.st_ino != wdir->ino)){
+        // Gone, or replaced by another dir under the same name
+        int replaced = fd >= 0;
+        if (fd >= 0){
+            close(fd);
+        }
+        LOGDEBUG("Resync, dir gone:'%s'\n", ctx->path);
+        if (!wdir->parent){
+            _resync_emit(mon, wdir->wd, IN_DELETE_SELF, NULL);
+            return;
+        }
+        struct w_dir *parent = wdir->parent;
+        char name[NAME_MAX + 1];
+        snprintf(name, sizeof(name), "%s", wdir->name);
+        _resync_emit(mon, parent->wd, IN_DELETE | IN_ISDIR, name);
+        if (replaced){
+            _resync_emit(mon, parent->wd, IN_CREATE | IN_ISDIR, name);
+        }
+        return;
+    }
+    int64_t mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec;
+    if ((mtime_ns == wdir->mtime_ns && monitor_dir_stat_current(wdir, mon->resync_drained)) || !mon->recursive){
+        // Without recursive, sub dirs aren't watched so there's nothing to compare
+        close(fd);
+        return;
+    }
+    // Entries changed since the last listing, compare its sub dirs with the tree
+    if (!++mon->resync_gen){
+        ++mon->resync_gen;
+    }
+    ctx->wdir = wdir;
+    ctx->gen = mon->resync_gen;
+    ctx->names_len = 0;
+    if (mon_scan_subdirs(fd, _resync_subdir, ctx) < 0){
+        return;
+    }
+    wdir->ino = st.st_ino;
+    wdir->mtime_ns = mtime_ns;
+    wdir->stat_drained = 0;
+    LOGDEBUG("Resync, dir changed:'%s'\n", ctx->path);
+    int wd = wdir->wd;
+    _resync_emit(mon, wd, IN_MODIFY | IN_ISDIR, NULL);
+    // Deletes first, the handler may free the child but leaves its siblings alone
+    struct w_dir *child = NULL;
+    struct w_dir *next = NULL;
+    for (child = wdir->children; child != NULL; child = next){
+        next = child->next;
+        if (child->resync_gen != ctx->gen){
+            char name[NAME_MAX + 1];
+            snprintf(name, sizeof(name), "%s", child->name);
+            _resync_emit(mon, wd, IN_DELETE | IN_ISDIR, name);
+        }
+    }
+    for (size_t off = 0; off < ctx->names_len; off += strlen(ctx->names + off) + 1){
+        _resync_emit(mon, wd, IN_CREATE | IN_ISDIR, ctx->names + off);
+    }
+}
+
+/* Start checking the watch tree against the fs, after an IN_Q_OVERFLOW lost events */
+void monitor_start_resync(struct fs_event_manager *mon){
+    if (!mon){
+        LOGERROR("Null monitor provided to resync\n");
+        return;
+    }
+    LOGERROR("Event queue overflow, resyncing '%zu' dirs under:'%s'\n", mon->watch_count, mon->base_path ?: "");
+    mon->resync_pending = 1;
+    mon->resync_cursor = 0;
+    mon->resync_drained = mon->drained_reads;
+    mon->resync_start_ns = mon_monotonic_ns();
+}
+
+/* Check up to budget watched dirs against the fs */
+int monitor_resync_step(struct fs_event_manager *mon, size_t budget){
+    if (!mon || !mon->resync_pending){
+        return 0;
+    }
+    struct resync_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.mon = mon;
+    // Listing a dir can add watches and replace the index, so it's looked up each time
+    while (budget && mon->resync_pending && mon->wd_index && mon->resync_cursor < mon->wd_index->len){
+        struct w_dir *wdir = mon->wd_index->slots[mon->resync_cursor++];
+        if (wdir && wdir != WD_INDEX_TOMBSTONE){
+            _resync_dir(&ctx, wdir);
+            budget--;
+        }
+    }
+    free(ctx.path);
+    free(ctx.names);
+    if (mon->resync_pending && (!mon->wd_index || mon->resync_cursor >= mon->wd_index->len)){
+        mon->resync_pending = 0;
+        LOGDEBUG("Resync of:'%s' done in %llu ms, watching '%zu' dirs\n", mon->base_path ?: "",
+                 (unsigned long long)((mon_monotonic_ns() - mon->resync_start_ns) / 1000000), mon->watch_count);
+    }
+    return mon->resync_pending;
+}
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include "includes/mon_scan.h"
+#include "includes/mon_utils.h"
+
+/* Dir listing helpers used to discover the tree to watch. 
+ * Only dirs matter to the monitor, so entries are classified by d_type where possible 
+ * to avoid a stat() per file. On trees with millions of files that keeps discovery 
+ * bounded by the number of dirs. 
+ */
+
+/* Flags for paths handed in by the caller. Symlinks are followed like opendir() does, 
+ * a symlinked base dir has to work. Sub dirs found by a listing never get here as 
+ * symlinks, _is_subdir() skips them */
+#define DIR_OPEN_FLAGS (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+
+// Record layout returned by getdents64(2), glibc doesn't export it
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+static enum mon_scan_backend scan_backend = SCAN_BACKEND_GETDENTS;
+
+// Each thread listing dirs keeps one getdents64 buffer for its lifetime
+static pthread_key_t scan_buf_key;
+static pthread_once_t scan_buf_once = PTHREAD_ONCE_INIT;
+static __thread char *scan_buf = NULL;
+
+static void _scan_buf_key_init(void){
+    pthread_key_create(&scan_buf_key, free);
+}
+
+static char *_scan_buf_get(void){
+    if (!scan_buf){
+        pthread_once(&scan_buf_once, _scan_buf_key_init);
+        scan_buf = malloc(MON_SCAN_BUF_SIZE);
+        if (scan_buf){
+            // The key's destructor frees the buffer when the thread exits
+            pthread_setspecific(scan_buf_key, scan_buf);
+        }
+    }
+    return scan_buf;
+}
+
+/* True if the entry is a dir, other than '.' and '..' */
+static inline int _is_subdir(int fd, const char *name, unsigned char d_type){
+    struct stat st;
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))){
+        return 0;
+    }
+    if (d_type == DT_DIR){
+        return 1;
+    }
+    return d_type == DT_UNKNOWN && !fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) && S_ISDIR(st.st_mode);
+}
+
+/* Open the dir at path for listing, following symlinks. Paths longer than PATH_MAX are 
+ * opened piecewise with openat(), so any length works. Returns the fd or -1. 
+ */
+int mon_open_dir(const char *path, size_t len){
+    if (!path || !len){
+        errno = EINVAL;
+        return -1;
+    }
+    if (len < PATH_MAX){
+        char *cpath = (char *)path;
+        if (path[len] != '\0'){
+            cpath = strndup(path, len);
+            if (!cpath){
+                return -1;
+            }
+        }
+        int fd = open(cpath, DIR_OPEN_FLAGS);
+        if (cpath != path){
+            free(cpath);
+        }
+        return fd;
+    }
+    // Walk the path in pieces shorter than PATH_MAX, split on '/' boundaries
+    char *piece = malloc(PATH_MAX);
+    if (!piece){
+        return -1;
+    }
+    int fd = -1;
+    size_t pos = 0;
+    while (pos < len){
+        size_t end = len;
+        if (len - pos >= PATH_MAX){
+            end = pos + PATH_MAX - 1;
+            while (end > pos && path[end] != '/'){
+                end--;
+            }
+            if (end == pos){
+                // A single component can't be longer than NAME_MAX, so this is a bogus path
+                errno = ENAMETOOLONG;
+                break;
+            }
+        }
+        memcpy(piece, path + pos, end - pos);
+        piece[end - pos] = '\0';
+        int nfd = openat(fd < 0 ? AT_FDCWD : fd, piece, DIR_OPEN_FLAGS);
+        if (fd >= 0){
+            close(fd);
+        }
+        fd = nfd;
+        if (fd < 0){
+            break;
+        }
+        pos = end;
+        while (pos < len && path[pos] == '/'){
+            pos++;
+        }
+    }
+    free(piece);
+    if (pos < len && fd >= 0){
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/* Select the backend used by mon_scan_subdirs(). Returns the previous one */
+enum mon_scan_backend mon_scan_set_backend(enum mon_scan_backend backend){
+    enum mon_scan_backend prev = scan_backend;
+    scan_backend = backend;
+    return prev;
+}
+
+/* Lists the sub dirs of the dir open at fd, calling cb for each one */
+int mon_scan_subdirs(int fd, scan_subdir_cb cb, void *data){
+    if (scan_backend == SCAN_BACKEND_READDIR){
+        return mon_scan_subdirs_readdir(fd, cb, data);
+    }
+    return mon_scan_subdirs_getdents(fd, cb, data);
+}
+
+/* getdents64 backend. Pulls MON_SCAN_BUF_SIZE worth of entries per syscall into 
+ * the thread's buffer, and filters them in place. 
+ */
+int mon_scan_subdirs_getdents(int fd, scan_subdir_cb cb, void *data){
+    int cnt = 0;
+    char *buf = _scan_buf_get();
+    if (!buf){
+        LOGERROR("No getdents buffer, using readdir for fd:'%d'\n", fd);
+        return mon_scan_subdirs_readdir(fd, cb, data);
+    }
+    for (;;){
+        long nread = syscall(SYS_getdents64, fd, buf, MON_SCAN_BUF_SIZE);
+        if (nread < 0){
+            if (errno == ENOSYS && !cnt){
+                // No raw syscall here, nothing has been read from fd yet
+                scan_backend = SCAN_BACKEND_READDIR;
+                return mon_scan_subdirs_readdir(fd, cb, data);
+            }
+            LOGERROR("getdents64 failed for fd:'%d', err:'%s'\n", fd, strerror(errno));
+            close(fd);
+            return cnt ? cnt : -1;
+        }
+        if (nread == 0){
+            break;
+        }
+        for (long pos = 0; pos < nread; ){
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buf + pos);
+            pos += entry->d_reclen;
+            if (!_is_subdir(fd, entry->d_name, entry->d_type)){
+                continue;
+            }
+            cnt++;
+            if (cb && cb(fd, entry->d_name, strlen(entry->d_name), data)){
+                close(fd);
+                return cnt;
+            }
+        }
+    }
+    close(fd);
+    return cnt;
+}
+
+/* readdir backend */
+int mon_scan_subdirs_readdir(int fd, scan_subdir_cb cb, void *data){
+    int cnt = 0;
+    DIR *folder = fdopendir(fd);
+    if (!folder){
+        LOGERROR("fdopendir failed for fd:'%d', err:'%s'\n", fd, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    struct dirent *entry = readdir(folder);
+    while (entry){
+        if (_is_subdir(fd, entry->d_name, entry->d_type)){
+            cnt++;
+            if (cb && cb(fd, entry->d_name, strlen(entry->d_name), data)){
+                break;
+            }
+        }
+        entry = readdir(folder);
+    }
+    closedir(folder);
+    return cnt;
+}
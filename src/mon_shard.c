@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_resync.h"
+#include "includes/mon_coalesce.h"
+#include "includes/mon_thread.h"
+#include "includes/mon_shard.h"
+#include "includes/mon_utils.h"
+
+/* Sharded monitors.
+ * One inotify instance has one kernel queue (max_queued_events) and one reader, which caps
+ * a busy tree. Here the top level dirs are hashed over several instances, each drained by
+ * its own reader thread, and one consumer merges their streams.
+ * Only the first shard watches the base dir for entry events, the others watch it just to
+ * see it go. An entry event of the base dir is routed to the shard owning that name by
+ * example_event_handler(), since the consumer is the only thread touching any shard's tree.
+ */
+
+/* Create nshards monitors of base_path */
+struct mon_shard_set *monitor_shard_create(char *base_path, uint32_t mask, int nshards,
+                                           event_handler handler, size_t event_buf_len){
+    if (!base_path || !strlen(base_path)){
+        LOGERROR("Empty basepath provided to create shard set\n");
+        return NULL;
+    }
+    if (nshards < 1 || nshards > MON_SHARD_MAX){
+        LOGERROR("Bad shard count:'%d', max:'%d'\n", nshards, MON_SHARD_MAX);
+        return NULL;
+    }
+    struct mon_shard_set *set = calloc(1, sizeof(struct mon_shard_set));
+    if (!set){
+        LOGERROR("Failed to alloc shard set for:'%s'\n", base_path);
+        return NULL;
+    }
+    set->mons = calloc(nshards, sizeof(struct fs_event_manager *));
+    set->fds = calloc(nshards * 2, sizeof(struct pollfd));
+    if (!set->mons || !set->fds){
+        LOGERROR("Failed to alloc shards for:'%s'\n", base_path);
+        return monitor_shard_destroy(set);
+    }
+    for (int i = 0; i < nshards; i++){
+        struct fs_event_manager *mon = create_event_monitor(base_path, mask, 1, handler, event_buf_len);
+        if (!mon){
+            LOGERROR("Failed to create shard '%d' of:'%s'\n", i, base_path);
+            return monitor_shard_destroy(set);
+        }
+        mon->shards = set;
+        mon->shard_cnt = nshards;
+        mon->shard_idx = i;
+        if (i){
+            mon->root_mask = MON_SHARD_ROOT_MASK;
+        }
+        set->mons[i] = mon;
+        set->nshards++;
+    }
+    return set;
+}
+
+/* monitor_init() each shard and start its reader thread */
+int monitor_shard_start(struct mon_shard_set *set, size_t slots){
+    if (!set || !set->nshards){
+        LOGERROR("Null or empty shard set\n");
+        return -1;
+    }
+    for (int i = 0; i < set->nshards; i++){
+        struct fs_event_manager *mon = set->mons[i];
+        if (monitor_init(mon) || monitor_start_thread(mon, slots)){
+            LOGERROR("Failed to start shard '%d' of:'%s'\n", i, mon->base_path ?: "");
+            for (int j = 0; j <= i; j++){
+                monitor_stop_thread(set->mons[j]);
+            }
+            return -1;
+        }
+        LOGDEBUG("Shard '%d' of:'%s' watching '%zu' dirs\n", i, mon->base_path ?: "", mon->watch_count);
+    }
+    return 0;
+}
+
+/* Stop the reader threads, destroy the shard monitors and free set */
+struct mon_shard_set *monitor_shard_destroy(struct mon_shard_set *set){
+    if (!set){
+        return NULL;
+    }
+    // Stop every reader first, so none is left reading while the others are torn down
+    for (int i = 0; i < set->nshards; i++){
+        monitor_stop_thread(set->mons[i]);
+    }
+    for (int i = 0; i < set->nshards; i++){
+        set->mons[i]->shards = NULL;
+        destroy_event_monitor(set->mons[i]);
+    }
+    free(set->mons);
+    free(set->fds);
+    free(set);
+    return NULL;
+}
+
+/* Wait up to timeout_ms for any shard to have events */
+int monitor_shard_wait(struct mon_shard_set *set, int timeout_ms){
+    int nfds = 0;
+    int ready = 0;
+    if (!set){
+        return -1;
+    }
+    // Reader wakeups first, then the coalesce timers of shards that have one
+    for (int i = 0; i < set->nshards; i++){
+        struct fs_event_manager *mon = set->mons[i];
+        set->fds[nfds].fd = mon->reader ? mon->reader->wake_fd : mon->ifd;
+        set->fds[nfds].events = POLLIN;
+        set->fds[nfds].revents = 0;
+        nfds++;
+    }
+    for (int i = 0; i < set->nshards; i++){
+        int fd = monitor_coalesce_fd(set->mons[i]);
+        if (fd >= 0){
+            set->fds[nfds].fd = fd;
+            set->fds[nfds].events = POLLIN;
+            set->fds[nfds].revents = 0;
+            nfds++;
+        }
+    }
+    if (poll(set->fds, nfds, timeout_ms) <= 0){
+        return 0;
+    }
+    for (int i = 0; i < set->nshards; i++){
+        if (set->fds[i].revents & POLLIN){
+            ready++;
+        }
+    }
+    for (int i = set->nshards; i < nfds; i++){
+        if (set->fds[i].revents & POLLIN){
+            // The timer belongs to whichever shard has this fd
+            for (int j = 0; j < set->nshards; j++){
+                if (monitor_coalesce_fd(set->mons[j]) == set->fds[i].fd){
+                    monitor_coalesce_flush_expired(set->mons[j]);
+                    break;
+                }
+            }
+        }
+    }
+    return ready;
+}
+
+/* Merge the shards' streams on the calling thread */
+int monitor_shard_consume(struct mon_shard_set *set){
+    int cnt = 0;
+    if (!set){
+        return 0;
+    }
+    /* Dir events keep their order, each dir is in one shard. Nothing orders events across
+     * shards, so a dir move between them is seen as a delete and a create */
+    for (int i = 0; i < set->nshards; i++){
+        struct fs_event_manager *mon = set->mons[i];
+        if (mon->reader){
+            cnt += monitor_consume(mon);
+        }
+    }
+    set->consumed += cnt;
+    return cnt;
+}
+
+/* Loop waiting on and consuming the shards until monitor_shard_stop() */
+int monitor_shard_run(struct mon_shard_set *set){
+    if (!set || !set->nshards){
+        LOGERROR("Null or empty shard set\n");
+        return -1;
+    }
+    __atomic_store_n(&set->stop, 0, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&set->stop, __ATOMIC_ACQUIRE)){
+        int resyncing = 0;
+        for (int i = 0; i < set->nshards; i++){
+            resyncing |= set->mons[i]->resync_pending;
+        }
+        struct fs_event_manager *first = set->mons[0];
+        int timeout = first->interval > 0 ? (int)(first->interval * 1000) : 1000;
+        if (monitor_shard_wait(set, resyncing ? 1 : timeout) > 0){
+            monitor_shard_consume(set);
+        }
+        for (int i = 0; i < set->nshards; i++){
+            monitor_expire_moves(set->mons[i]);
+            monitor_resync_step(set->mons[i], MON_RESYNC_BATCH);
+        }
+    }
+    return 0;
+}
+
+/* Make monitor_shard_run() return */
+void monitor_shard_stop(struct mon_shard_set *set){
+    if (set){
+        __atomic_store_n(&set->stop, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* Monitor of mon's shard set that watches the top level dir called name */
+struct fs_event_manager *monitor_shard_route(struct fs_event_manager *mon, const char *name){
+    if (!mon || !mon->shards || !name){
+        return mon;
+    }
+    int idx = monitor_shard_index(mon, name, strlen(name));
+    return idx < mon->shards->nshards ? mon->shards->mons[idx] : mon;
+}
+
+/* Number of dirs watched by all the shards */
+size_t monitor_shard_watch_count(struct mon_shard_set *set){
+    size_t cnt = 0;
+    for (int i = 0; set && i < set->nshards; i++){
+        cnt += set->mons[i]->watch_count;
+    }
+    return cnt;
+}
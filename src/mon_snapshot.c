@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_snapshot.h"
+#include "includes/mon_utils.h"
+
+/* Persistent snapshot of the watch tree, for a fast warm restart. 
+ * Listing every dir of a large tree on startup takes minutes, while most of the tree 
+ * hasn't changed since the last shutdown. A dir's mtime changes whenever an entry 
+ * is added, removed or renamed in it, so dirs with the same inode and mtime as in the 
+ * snapshot still have the same sub dirs, and only need their watch re-added. 
+ */
+
+static uint32_t _snap_checksum(const char *data, size_t len, uint32_t hash){
+    for (size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static int _write_all(int fd, const void *data, size_t len){
+    const char *ptr = data;
+    while (len){
+        ssize_t ret = write(fd, ptr, len);
+        if (ret < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        ptr += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+/* Write the monitor's watch tree, with each dir's inode and mtime, to path */
+// Ancestor of the dir being saved, with the index of its record
+struct snap_ancestor {
+    struct w_dir *wdir;
+    uint32_t idx;
+};
+
+int monitor_save_snapshot(struct fs_event_manager *mon, const char *path){
+    int ret = -1;
+    int fd = -1;
+    char *tmp_path = NULL;
+    struct snap_record *records = NULL;
+    char *names = NULL;
+    struct snap_ancestor *stack = NULL;
+    if (!mon || !path || !strlen(path)){
+        LOGERROR("Null monitor or snapshot path provided\n");
+        return -1;
+    }
+    if (!mon->watch_root){
+        LOGERROR("Empty watch tree, not saving snapshot:'%s'\n", path);
+        return -1;
+    }
+    size_t cnt = mon->watch_count;
+    size_t names_len = 0;
+    struct w_dir *wdir = NULL;
+    for (wdir = mon->watch_root; wdir != NULL; wdir = watch_tree_next(wdir, mon->watch_root)){
+        names_len += wdir->name_len;
+    }
+    records = calloc(cnt ?: 1, sizeof(struct snap_record));
+    names = malloc(names_len ?: 1);
+    // Records refer to their parent by index. Nodes come in pre-order, so the parent is 
+    // on a stack of the current node's ancestors
+    stack = malloc((cnt ?: 1) * sizeof(struct snap_ancestor));
+    if (!records || !names || !stack){
+        LOGERROR("Failed to alloc snapshot of '%zu' dirs\n", cnt);
+        goto done;
+    }
+    size_t idx = 0;
+    size_t name_off = 0;
+    size_t depth = 0;
+    for (wdir = mon->watch_root; wdir != NULL && idx < cnt; wdir = watch_tree_next(wdir, mon->watch_root)){
+        struct snap_record *rec = &records[idx];
+        rec->ino = wdir->ino;
+        // A stat taken since events that are still unread can't vouch for the tree, 0 forces a listing
+        rec->mtime_ns = monitor_dir_stat_current(wdir, mon->drained_reads) ? wdir->mtime_ns : 0;
+        while (depth && stack[depth - 1].wdir != wdir->parent){
+            depth--;
+        }
+        rec->parent = depth ? stack[depth - 1].idx : SNAP_NO_PARENT;
+        rec->name_off = name_off;
+        rec->name_len = wdir->name_len;
+        memcpy(names + name_off, wdir->name, wdir->name_len);
+        name_off += wdir->name_len;
+        stack[depth].wdir = wdir;
+        stack[depth++].idx = idx++;
+    }
+    struct snap_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.version = SNAP_VERSION;
+    hdr.header_size = sizeof(struct snap_header);
+    hdr.record_size = sizeof(struct snap_record);
+    hdr.record_cnt = idx;
+    hdr.records_off = sizeof(struct snap_header);
+    hdr.names_off = hdr.records_off + idx * sizeof(struct snap_record);
+    hdr.names_len = name_off;
+    hdr.file_size = hdr.names_off + name_off;
+    hdr.checksum = _snap_checksum((char *)records, idx * sizeof(struct snap_record), 2166136261u);
+    hdr.checksum = _snap_checksum(names, name_off, hdr.checksum);
+
+    size_t tmp_len = strlen(path) + 8;
+    tmp_path = malloc(tmp_len);
+    if (!tmp_path){
+        goto done;
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", path);
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0){
+        LOGERROR("Failed to open snapshot:'%s', err:'%s'\n", tmp_path, strerror(errno));
+        goto done;
+    }
+    if (_write_all(fd, &hdr, sizeof(hdr)) || 
+        _write_all(fd, records, idx * sizeof(struct snap_record)) ||
+        _write_all(fd, names, name_off) || fsync(fd)){
+        LOGERROR("Failed to write snapshot:'%s', err:'%s'\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+        goto done;
+    }
+    if (rename(tmp_path, path)){
+        LOGERROR("Failed to rename snapshot to:'%s', err:'%s'\n", path, strerror(errno));
+        unlink(tmp_path);
+        goto done;
+    }
+    LOGDEBUG("Saved snapshot of '%zu' dirs to:'%s'\n", idx, path);
+    ret = 0;
+done:
+    if (fd >= 0){
+        close(fd);
+    }
+    free(tmp_path);
+    free(records);
+    free(names);
+    free(stack);
+    return ret;
+}
+
+/* Check the mapped snapshot is complete, consistent and for this monitor's base dir. 
+ * Returns NULL if it's usable, else the reason it isn't. 
+ */
+static const char *_snap_validate(const char *map, size_t size, struct fs_event_manager *mon){
+    const struct snap_header *hdr = (const struct snap_header *)map;
+    if (size < sizeof(struct snap_header) || memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic))){
+        return "bad magic";
+    }
+    if (hdr->version != SNAP_VERSION || hdr->header_size != sizeof(struct snap_header) || 
+        hdr->record_size != sizeof(struct snap_record)){
+        return "unsupported version";
+    }
+    if (hdr->file_size != size || hdr->records_off != sizeof(struct snap_header) || !hdr->record_cnt ||
+        hdr->record_cnt > (size - hdr->records_off) / sizeof(struct snap_record) ||
+        hdr->names_off != hdr->records_off + hdr->record_cnt * sizeof(struct snap_record) ||
+        hdr->names_len != size - hdr->names_off){
+        return "truncated or bad offsets";
+    }
+    const struct snap_record *records = (const struct snap_record *)(map + hdr->records_off);
+    uint32_t sum = _snap_checksum(map + hdr->records_off, size - hdr->records_off, 2166136261u);
+    if (sum != hdr->checksum){
+        return "checksum mismatch";
+    }
+    for (uint64_t i = 0; i < hdr->record_cnt; i++){
+        const struct snap_record *rec = &records[i];
+        if ((uint64_t)rec->name_off + rec->name_len > hdr->names_len || !rec->name_len ||
+            (i == 0) != (rec->parent == SNAP_NO_PARENT) || (i && rec->parent >= i)){
+            return "bad record";
+        }
+    }
+    const char *base = map + hdr->names_off + records[0].name_off;
+    size_t base_len = strlen(mon->base_path);
+    while (base_len > 1 && mon->base_path[base_len - 1] == '/'){
+        base_len--;
+    }
+    if (records[0].name_len != base_len || memcmp(base, mon->base_path, base_len)){
+        return "different base dir";
+    }
+    return NULL;
+}
+
+/* Rebuild the watch tree from the snapshot at path, instead of listing every dir */
+int monitor_load_snapshot(struct fs_event_manager *mon, const char *path){
+    struct stat st;
+    if (!mon || !path || !strlen(path) || !mon->base_path){
+        LOGERROR("Null monitor or snapshot path provided\n");
+        return -1;
+    }
+    if (mon->watch_root){
+        LOGERROR("Watch tree not empty, not loading snapshot:'%s'\n", path);
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        LOGERROR("No snapshot at:'%s', doing a full scan\n", path);
+        return -1;
+    }
+    if (fstat(fd, &st) || st.st_size <= 0){
+        LOGERROR("Empty snapshot:'%s', doing a full scan\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        LOGERROR("Failed to mmap snapshot:'%s', err:'%s', doing a full scan\n", path, strerror(errno));
+        return -1;
+    }
+    const char *reason = _snap_validate(map, size, mon);
+    if (reason){
+        LOGERROR("Snapshot:'%s' is stale or corrupt (%s), doing a full scan\n", path, reason);
+        munmap(map, size);
+        return -1;
+    }
+    const struct snap_header *hdr = (const struct snap_header *)map;
+    const struct snap_record *records = (const struct snap_record *)(map + hdr->records_off);
+    const char *names = map + hdr->names_off;
+    struct w_dir **nodes = calloc(hdr->record_cnt, sizeof(struct w_dir *));
+    struct w_dir **changed = calloc(hdr->record_cnt, sizeof(struct w_dir *));
+    size_t changed_cnt = 0;
+    size_t path_size = 4096;
+    char *dpath = malloc(path_size);
+    if (!nodes || !changed || !dpath){
+        LOGERROR("Failed to alloc snapshot restore of '%llu' dirs\n", (unsigned long long)hdr->record_cnt);
+        free(nodes);
+        free(changed);
+        free(dpath);
+        munmap(map, size);
+        return -1;
+    }
+    uint64_t start = mon_monotonic_ns();
+    for (uint64_t i = 0; i < hdr->record_cnt; i++){
+        const struct snap_record *rec = &records[i];
+        struct w_dir *parent = i ? nodes[rec->parent] : NULL;
+        if (i && !parent){
+            // Parent is gone, so is everything recorded below it
+            continue;
+        }
+        size_t plen = parent ? get_wdir_path(parent, NULL, 0) : 0;
+        size_t len = plen + 1 + rec->name_len;
+        if (len >= path_size){
+            while (len >= path_size){
+                path_size *= 2;
+            }
+            char *newpath = realloc(dpath, path_size);
+            if (!newpath){
+                break;
+            }
+            dpath = newpath;
+        }
+        if (parent){
+            get_wdir_path(parent, dpath, path_size);
+            if (dpath[plen - 1] != '/'){
+                dpath[plen++] = '/';
+            }
+        }
+        memcpy(dpath + plen, names + rec->name_off, rec->name_len);
+        dpath[plen + rec->name_len] = '\0';
+        // Watch before stat, so a change in between shows up either as an event or in the mtime
+        struct w_dir *wdir = add_watch_dir_to_monitor(dpath, mon);
+        if (!wdir){
+            continue;
+        }
+        if (stat(dpath, &st) || !S_ISDIR(st.st_mode)){
+            // No longer a dir, its watch goes. nodes[i] stays NULL so what was recorded below it is skipped
+            LOGDEBUG("Snapshot dir:'%s' is gone or not a dir anymore\n", dpath);
+            if (i){
+                remove_watch_dir(wdir, mon);
+                continue;
+            }
+            // Removing the base would reset the monitor, leave the tree empty for a full scan instead
+            destroy_wdir_list(mon);
+            break;
+        }
+        nodes[i] = wdir;
+        if ((uint64_t)st.st_ino != rec->ino || 
+            (int64_t)st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec != rec->mtime_ns){
+            changed[changed_cnt++] = wdir;
+        }else{
+            wdir->ino = rec->ino;
+            wdir->mtime_ns = rec->mtime_ns;
+        }
+    }
+    size_t restored = mon->watch_count;
+    if (mon->watch_root && mon->recursive){
+        // Re-list changed dirs only. Sub dirs restored above are skipped, new ones scanned in full
+        for (size_t i = 0; i < changed_cnt; i++){
+            size_t len = get_wdir_path(changed[i], NULL, 0);
+            if (len >= path_size){
+                char *newpath = realloc(dpath, len + 1);
+                if (!newpath){
+                    continue;
+                }
+                dpath = newpath;
+                path_size = len + 1;
+            }
+            get_wdir_path(changed[i], dpath, path_size);
+            monitor_dir(dpath, mon);
+        }
+    }
+    LOGDEBUG("Restored '%zu' of '%llu' dirs from snapshot:'%s', '%zu' changed, '%zu' new. Took %llu ms\n", 
+             restored, (unsigned long long)hdr->record_cnt, path, changed_cnt, mon->watch_count - restored,
+             (unsigned long long)((mon_monotonic_ns() - start) / 1000000));
+    free(nodes);
+    free(changed);
+    free(dpath);
+    munmap(map, size);
+    if (!mon->watch_root){
+        LOGERROR("Base dir from snapshot:'%s' could not be watched, doing a full scan\n", path);
+        return -1;
+    }
+    return 0;
+}
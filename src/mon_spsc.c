@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "includes/mon_spsc.h"
+#include "includes/mon_utils.h"
+
+/* Set up a ring of at least nslots slots of slot_size bytes */
+int mon_spsc_init(struct mon_spsc *ring, size_t nslots, size_t slot_size){
+    size_t size = 2;
+    if (!ring || !nslots || !slot_size){
+        LOGERROR("Null ring or zero sized ring\n");
+        return -1;
+    }
+    memset(ring, 0, sizeof(*ring));
+    while (size < nslots){
+        size <<= 1;
+    }
+    // Keep each slot aligned for the struct stored in it
+    slot_size = (slot_size + 7) & ~(size_t)7;
+    if (posix_memalign((void **)&ring->slots, MON_CACHE_LINE, size * slot_size)){
+        LOGERROR("Failed to alloc ring of '%zu' slots\n", size);
+        ring->slots = NULL;
+        return -1;
+    }
+    ring->mask = size - 1;
+    ring->slot_size = slot_size;
+    return 0;
+}
+
+/* Free the ring's slots */
+void mon_spsc_free(struct mon_spsc *ring){
+    if (ring && ring->slots){
+        free(ring->slots);
+        ring->slots = NULL;
+    }
+}
+
+/* Producer: next free slot to fill, or NULL if the ring is full */
+void *mon_spsc_reserve(struct mon_spsc *ring){
+    size_t tail = ring->tail;
+    if (tail - ring->cached_head > ring->mask){
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (tail - ring->cached_head > ring->mask){
+            __atomic_store_n(&ring->full_waits, ring->full_waits + 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+    }
+    return ring->slots + (tail & ring->mask) * ring->slot_size;
+}
+
+/* Producer: make the slot from mon_spsc_reserve() visible to the consumer */
+void mon_spsc_publish(struct mon_spsc *ring){
+    size_t tail = ring->tail + 1;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->pushed, ring->pushed + 1, __ATOMIC_RELAXED);
+    size_t used = tail - ring->cached_head;
+    if (used > ring->high_water){
+        // cached_head may be stale, so this is an upper bound. Refresh before recording it
+        ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        used = tail - ring->cached_head;
+        if (used > ring->high_water){
+            __atomic_store_n(&ring->high_water, used, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Consumer: oldest published slot, or NULL if the ring is empty */
+void *mon_spsc_peek(struct mon_spsc *ring){
+    size_t head = ring->head;
+    if (head == ring->cached_tail){
+        ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        if (head == ring->cached_tail){
+            return NULL;
+        }
+    }
+    return ring->slots + (head & ring->mask) * ring->slot_size;
+}
+
+/* Consumer: hand the slot from mon_spsc_peek() back to the producer */
+void mon_spsc_release(struct mon_spsc *ring){
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* Slots in use right now */
+size_t mon_spsc_occupancy(struct mon_spsc *ring){
+    // head first, it can only catch up with a tail read after it
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
+
+/* Number of slots */
+size_t mon_spsc_capacity(struct mon_spsc *ring){
+    return ring->mask + 1;
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_thread.h"
+#include "includes/mon_utils.h"
+
+/* Threaded mode. 
+ * Slow handlers stall reads of mon->ifd, and the kernel queue overflows behind them. 
+ * Here a reader thread does nothing but read mon->ifd and copy the events into a 
+ * lock-free SPSC ring, so the kernel queue stays drained while handlers catch up. 
+ * The consumer is woken through an eventfd, written once per read() rather than per event. 
+ */
+
+static void _reader_wake(struct mon_reader *reader){
+    uint64_t one = 1;
+    if (write(reader->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN){
+        LOGERROR("Failed to wake consumer, err:'%s'\n", strerror(errno));
+    }
+}
+
+// Copy the events of one read() from the fd of ifd_gen into the ring, waiting for room when it's full
+static void _reader_push(struct mon_reader *reader, size_t length, unsigned int ifd_gen){
+    size_t i = 0;
+    while (i + INOT_EVENT_SIZE <= length){
+        struct inotify_event *event = (struct inotify_event *)&reader->buf[i];
+        size_t size = INOT_EVENT_SIZE + event->len;
+        if (i + size > length || event->len > NAME_MAX + 1){
+            LOGERROR("Truncated event! Remaining:'%lu', len:'%lu'\n", (unsigned long)(length - i), (unsigned long)event->len);
+            break;
+        }
+        struct mon_event_slot *slot = NULL;
+        while (!(slot = mon_spsc_reserve(&reader->ring))){
+            if (__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)){
+                return;
+            }
+            // Full, make sure the consumer is awake and give it time to catch up
+            _reader_wake(reader);
+            usleep(100);
+        }
+        memcpy(slot, event, size);
+        slot->ifd_gen = ifd_gen;
+        mon_spsc_publish(&reader->ring);
+        i += size;
+    }
+    _reader_wake(reader);
+}
+
+static void *_reader_thread(void *arg){
+    struct mon_reader *reader = arg;
+    struct fs_event_manager *mon = reader->mon;
+    while (!__atomic_load_n(&reader->stop, __ATOMIC_ACQUIRE)){
+        ssize_t length = 0;
+        pthread_mutex_lock(&reader->ifd_lock);
+        int fd = mon->ifd;
+        unsigned int ifd_gen = mon->ifd_gen;
+        if (fd >= 0){
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, MON_READER_POLL_MS) > 0 && (pfd.revents & POLLIN)){
+                length = read(fd, reader->buf, reader->buf_len);
+            }
+        }
+        pthread_mutex_unlock(&reader->ifd_lock);
+        if (fd < 0){
+            // Between a close and the new fd, e.g. in reset_monitor()
+            usleep(MON_READER_POLL_MS * 1000);
+            continue;
+        }
+        if (length > 0){
+            _reader_push(reader, length, ifd_gen);
+        }else if (length < 0 && errno != EAGAIN && errno != EINTR){
+            LOGERROR("Reader failed to read inotify fd for:'%s', err:'%s'\n", mon->base_path ?: "", strerror(errno));
+        }
+    }
+    return NULL;
+}
+
+/* Start threaded mode on an initialized monitor */
+int monitor_start_thread(struct fs_event_manager *mon, size_t slots){
+    if (!mon || mon->ifd < 0){
+        LOGERROR("Null monitor, or monitor not initialized\n");
+        return -1;
+    }
+    if (mon->reader){
+        LOGERROR("Reader thread already running for:'%s'\n", mon->base_path ?: "");
+        return -1;
+    }
+    struct mon_reader *reader = calloc(1, sizeof(struct mon_reader));
+    if (!reader){
+        LOGERROR("Failed to alloc reader\n");
+        return -1;
+    }
+    reader->mon = mon;
+    reader->buf_len = mon->buf_len;
+    reader->buf = malloc(reader->buf_len);
+    reader->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!reader->buf || reader->wake_fd < 0 || 
+        mon_spsc_init(&reader->ring, slots ? slots : MON_READER_DEFAULT_SLOTS, sizeof(struct mon_event_slot))){
+        LOGERROR("Failed to set up reader for:'%s'\n", mon->base_path ?: "");
+        goto fail;
+    }
+    pthread_mutex_init(&reader->ifd_lock, NULL);
+    if (pthread_create(&reader->thread, NULL, _reader_thread, reader)){
+        LOGERROR("Failed to start reader thread for:'%s'\n", mon->base_path ?: "");
+        pthread_mutex_destroy(&reader->ifd_lock);
+        goto fail;
+    }
+    mon->reader = reader;
+    mon->thread_id = &reader->thread;
+    LOGDEBUG("Started reader thread for:'%s', ring of '%zu' events\n", 
+             mon->base_path ?: "", mon_spsc_capacity(&reader->ring));
+    return 0;
+fail:
+    if (reader->wake_fd >= 0){
+        close(reader->wake_fd);
+    }
+    mon_spsc_free(&reader->ring);
+    free(reader->buf);
+    free(reader);
+    return -1;
+}
+
+/* Stop and join the reader thread */
+void monitor_stop_thread(struct fs_event_manager *mon){
+    if (!mon || !mon->reader){
+        return;
+    }
+    struct mon_reader *reader = mon->reader;
+    __atomic_store_n(&reader->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(reader->thread, NULL);
+    LOGDEBUG("Stopped reader thread for:'%s', '%llu' events handed off, high water '%zu' of '%zu'\n", 
+             mon->base_path ?: "", (unsigned long long)reader->ring.pushed, reader->ring.high_water, 
+             mon_spsc_capacity(&reader->ring));
+    mon->reader = NULL;
+    mon->thread_id = NULL;
+    pthread_mutex_destroy(&reader->ifd_lock);
+    close(reader->wake_fd);
+    mon_spsc_free(&reader->ring);
+    free(reader->buf);
+    free(reader);
+}
+
+/* Consumer: hand every event the reader has published to the monitor's handlers */
+int monitor_consume(struct fs_event_manager *mon){
+    uint64_t wakes;
+    int cnt = 0;
+    if (!mon || !mon->reader){
+        return 0;
+    }
+    struct mon_reader *reader = mon->reader;
+    // Clear the wakeup first, anything published after this wakes the next wait
+    if (read(reader->wake_fd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN){
+        LOGERROR("Failed to read reader wakeup, err:'%s'\n", strerror(errno));
+    }
+    for (;;){
+        size_t length = 0;
+        struct mon_event_slot *slot = NULL;
+        // Pack events back to back into the consumer's buffer, as a read() would have
+        while (mon->reader == reader && (slot = mon_spsc_peek(&reader->ring))){
+            size_t size = INOT_EVENT_SIZE + slot->event.len;
+            if (slot->ifd_gen != mon->ifd_gen){
+                // Read from an fd reset_monitor() has since replaced, its wds mean nothing in the new tree
+                mon_spsc_release(&reader->ring);
+                continue;
+            }
+            if (length + size > mon->buf_len){
+                break;
+            }
+            memcpy(mon->event_buffer + length, slot, size);
+            length += size;
+            mon_spsc_release(&reader->ring);
+            cnt++;
+        }
+        if (!length){
+            break;
+        }
+        monitor_handle_events(mon, length);
+        if (mon->reader != reader){
+            // A handler stopped threaded mode
+            break;
+        }
+    }
+    return cnt;
+}
+
+/* Fill stats with the handoff ring's usage */
+int monitor_thread_stats(struct fs_event_manager *mon, struct mon_reader_stats *stats){
+    if (!mon || !mon->reader || !stats){
+        return -1;
+    }
+    struct mon_spsc *ring = &mon->reader->ring;
+    stats->capacity = mon_spsc_capacity(ring);
+    stats->occupancy = mon_spsc_occupancy(ring);
+    stats->high_water = __atomic_load_n(&ring->high_water, __ATOMIC_RELAXED);
+    stats->pushed = __atomic_load_n(&ring->pushed, __ATOMIC_RELAXED);
+    stats->full_waits = __atomic_load_n(&ring->full_waits, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/* Hold off the reader while mon->ifd is closed or replaced */
+void monitor_lock_ifd(struct fs_event_manager *mon){
+    if (mon && mon->reader){
+        pthread_mutex_lock(&mon->reader->ifd_lock);
+    }
+}
+
+void monitor_unlock_ifd(struct fs_event_manager *mon){
+    if (mon && mon->reader){
+        pthread_mutex_unlock(&mon->reader->ifd_lock);
+    }
+}
@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_trace.h"
+#include "includes/mon_utils.h"
+
+/* Record and replay of what a monitor saw.
+ * Recording writes every buffer handed to monitor_handle_events() and every change to
+ * the watch tree, so a slow or buggy handler can be reproduced and measured later
+ * without the fs activity that caused it. Replay needs no inotify instance: reads are
+ * copied back into mon->event_buffer, and the tree is kept in step with the recording
+ * by handing the handlers' own watches the recorded wds and applying the rest of the
+ * recorded changes after each read.
+ */
+
+/*************************************************************/
+/* Recording */
+/*************************************************************/
+
+static void _trace_write(struct mon_trace *trace, uint32_t type, const void *data, size_t len,
+                         const void *extra, size_t extra_len){
+    if (trace->failed){
+        return;
+    }
+    struct trace_record rec;
+    rec.type = type;
+    rec.len = (uint32_t)(len + extra_len);
+    rec.ts_ns = mon_monotonic_ns();
+    if (fwrite(&rec, sizeof(rec), 1, trace->file) != 1 ||
+        (len && fwrite(data, len, 1, trace->file) != 1) ||
+        (extra_len && fwrite(extra, extra_len, 1, trace->file) != 1)){
+        LOGERROR("Failed to write trace record, err:'%s'. Recording stopped\n", strerror(errno));
+        trace->failed = 1;
+        return;
+    }
+    trace->records++;
+}
+
+/* Write one tree change of mon's recording */
+void monitor_trace_watch(struct fs_event_manager *mon, enum trace_record_type type, struct w_dir *wdir){
+    struct mon_trace *trace = mon->trace;
+    if (!trace || trace->replay){
+        return;
+    }
+    if (!wdir){
+        _trace_write(trace, type, NULL, 0, NULL, 0);
+        return;
+    }
+    struct trace_watch tw;
+    tw.wd = wdir->wd;
+    tw.parent_wd = wdir->parent ? wdir->parent->wd : -1;
+    if (type == TRACE_WATCH_RM){
+        _trace_write(trace, type, &tw, sizeof(tw), NULL, 0);
+    }else{
+        _trace_write(trace, type, &tw, sizeof(tw), wdir->name, wdir->name_len);
+    }
+}
+
+/* Write one read of mon's recording */
+void monitor_trace_read(struct fs_event_manager *mon, const char *buf, size_t len){
+    struct mon_trace *trace = mon->trace;
+    if (!trace || trace->replay || !len){
+        return;
+    }
+    _trace_write(trace, TRACE_READ, buf, len, NULL, 0);
+}
+
+/* Start recording mon to path */
+int monitor_trace_start(struct fs_event_manager *mon, const char *path){
+    if (!mon || !path || !strlen(path)){
+        LOGERROR("Null monitor or trace path provided\n");
+        return -1;
+    }
+    if (mon->trace){
+        LOGERROR("Monitor:'%s' is already tracing\n", mon->base_path ?: "");
+        return -1;
+    }
+    struct mon_trace *trace = calloc(1, sizeof(struct mon_trace));
+    if (!trace){
+        LOGERROR("Failed to alloc trace for:'%s'\n", path);
+        return -1;
+    }
+    trace->next_wd = -1;
+    trace->file = fopen(path, "wbe");
+    if (!trace->file){
+        LOGERROR("Failed to open trace:'%s', err:'%s'\n", path, strerror(errno));
+        free(trace);
+        return -1;
+    }
+    setvbuf(trace->file, NULL, _IOFBF, TRACE_WRITE_BUF);
+    struct trace_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.header_size = sizeof(hdr);
+    hdr.mask = mon->mask;
+    hdr.base_len = strlen(mon->base_path);
+    hdr.start_ns = mon_monotonic_ns();
+    if (fwrite(&hdr, sizeof(hdr), 1, trace->file) != 1 ||
+        fwrite(mon->base_path, hdr.base_len, 1, trace->file) != 1){
+        LOGERROR("Failed to write trace header:'%s'\n", path);
+        fclose(trace->file);
+        free(trace);
+        return -1;
+    }
+    mon->trace = trace;
+    // The tree as it is now, parents always come before their sub dirs
+    for (struct w_dir *wdir = mon->watch_root; wdir != NULL; wdir = watch_tree_next(wdir, mon->watch_root)){
+        monitor_trace_watch(mon, TRACE_WATCH_ADD, wdir);
+    }
+    LOGDEBUG("Tracing monitor:'%s' to:'%s', '%zu' dirs watched\n", mon->base_path, path, mon->watch_count);
+    return trace->failed ? -1 : 0;
+}
+
+/* Stop recording and close the trace */
+void monitor_trace_stop(struct fs_event_manager *mon){
+    if (!mon || !mon->trace || mon->trace->replay){
+        return;
+    }
+    struct mon_trace *trace = mon->trace;
+    mon->trace = NULL;
+    if (fclose(trace->file) && !trace->failed){
+        LOGERROR("Failed to flush trace of monitor:'%s', err:'%s'\n", mon->base_path ?: "", strerror(errno));
+    }
+    LOGDEBUG("Trace of monitor:'%s' done, '%llu' records\n", mon->base_path ?: "",
+             (unsigned long long)trace->records);
+    free(trace);
+}
+
+/*************************************************************/
+/* Replay */
+/*************************************************************/
+
+/* Read the record at off of the mapped trace into rec. Returns a pointer to its payload,
+ * or NULL at the end of the trace or if the record is cut short. */
+static const char *_trace_record_at(struct mon_trace *trace, size_t off, struct trace_record *rec){
+    if (off + sizeof(*rec) > trace->map_len){
+        return NULL;
+    }
+    // Records follow payloads of any length, so they aren't aligned
+    memcpy(rec, trace->map + off, sizeof(*rec));
+    if (rec->len > trace->map_len - off - sizeof(*rec)){
+        return NULL;
+    }
+    return trace->map + off + sizeof(*rec);
+}
+
+static size_t _trace_next_off(size_t off, struct trace_record *rec){
+    return off + sizeof(*rec) + rec->len;
+}
+
+// Make room in trace->path for len chars and a NUL
+static int _trace_path_reserve(struct mon_trace *trace, size_t len){
+    if (len < trace->path_size){
+        return 0;
+    }
+    size_t size = trace->path_size ?: 256;
+    while (size <= len){
+        size *= 2;
+    }
+    char *path = realloc(trace->path, size);
+    if (!path){
+        LOGERROR("Failed to alloc trace path scratch of '%zu'\n", size);
+        return -1;
+    }
+    trace->path = path;
+    trace->path_size = size;
+    return 0;
+}
+
+/* Build the path a recorded TRACE_WATCH_ADD was for into trace->path. Returns its length,
+ * or 0 if its parent isn't watched. */
+static size_t _trace_add_path(struct fs_event_manager *mon, struct mon_trace *trace,
+                              const struct trace_watch *tw, const char *name, size_t name_len){
+    size_t plen = 0;
+    size_t sep = 0;
+    struct w_dir *parent = NULL;
+    if (tw->parent_wd >= 0){
+        parent = get_dir_by_wd(tw->parent_wd, mon);
+        if (!parent){
+            return 0;
+        }
+        plen = get_wdir_path(parent, NULL, 0);
+        sep = (plen && parent->name[parent->name_len - 1] == '/') ? 0 : 1;
+    }
+    if (_trace_path_reserve(trace, plen + sep + name_len)){
+        return 0;
+    }
+    if (parent){
+        get_wdir_path(parent, trace->path, trace->path_size);
+        if (sep){
+            trace->path[plen] = '/';
+        }
+    }
+    memcpy(trace->path + plen + sep, name, name_len);
+    trace->path[plen + sep + name_len] = '\0';
+    return plen + sep + name_len;
+}
+
+/* The wd a handler's watch of path got when recorded. Matched against the changes
+ * recorded for the read being handled. */
+int monitor_trace_fake_wd(struct fs_event_manager *mon, const char *path){
+    struct mon_trace *trace = mon->trace;
+    struct trace_record rec;
+    if (trace->next_wd >= 0){
+        // Applying a recorded change
+        int wd = trace->next_wd;
+        trace->next_wd = -1;
+        return wd;
+    }
+    size_t len = strlen(path);
+    while (len > 1 && path[len - 1] == '/'){
+        len--;
+    }
+    for (size_t off = trace->pending_off; off < trace->pending_end; off = _trace_next_off(off, &rec)){
+        const char *data = _trace_record_at(trace, off, &rec);
+        if (!data){
+            break;
+        }
+        if (rec.type != TRACE_WATCH_ADD || rec.len < sizeof(struct trace_watch)){
+            continue;
+        }
+        struct trace_watch tw;
+        memcpy(&tw, data, sizeof(tw));
+        if (get_dir_by_wd(tw.wd, mon)){
+            continue;
+        }
+        size_t plen = _trace_add_path(mon, trace, &tw, data + sizeof(tw), rec.len - sizeof(tw));
+        if (plen == len && !memcmp(trace->path, path, len)){
+            trace->stats.fake_wds++;
+            return tw.wd;
+        }
+    }
+    LOGERROR("Watch of:'%s' is not in the trace\n", path);
+    return -1;
+}
+
+/* Apply one recorded tree change, unless the handlers already made it */
+static void _trace_apply(struct fs_event_manager *mon, struct mon_trace *trace,
+                         struct trace_record *rec, const char *data){
+    struct trace_watch tw;
+    if (rec->type == TRACE_RESET){
+        destroy_wdir_list(mon);
+        mon->base_wd = -1;
+        trace->stats.changes++;
+        return;
+    }
+    if (rec->len < sizeof(tw)){
+        return;
+    }
+    memcpy(&tw, data, sizeof(tw));
+    const char *name = data + sizeof(tw);
+    size_t name_len = rec->len - sizeof(tw);
+    struct w_dir *wdir = get_dir_by_wd(tw.wd, mon);
+    if (rec->type == TRACE_WATCH_ADD){
+        if (wdir || (tw.parent_wd < 0 && mon->watch_root)){
+            return;
+        }
+        if (!_trace_add_path(mon, trace, &tw, name, name_len)){
+            return;
+        }
+        trace->next_wd = tw.wd;
+        wdir = add_watch_dir_to_monitor(trace->path, mon);
+        trace->next_wd = -1;
+        if (wdir && !wdir->parent){
+            mon->base_wd = wdir->wd;
+        }
+    }else if (rec->type == TRACE_WATCH_RM){
+        if (!wdir){
+            return;
+        }
+        remove_watch_dir(wdir, mon);
+    }else if (rec->type == TRACE_WATCH_MOVE){
+        struct w_dir *parent = get_dir_by_wd(tw.parent_wd, mon);
+        if (!wdir || !parent || _trace_path_reserve(trace, name_len)){
+            return;
+        }
+        if (wdir->parent == parent && wdir->name_len == name_len && !memcmp(wdir->name, name, name_len)){
+            return;
+        }
+        memcpy(trace->path, name, name_len);
+        trace->path[name_len] = '\0';
+        move_watch_dir(wdir, parent, trace->path, mon);
+    }else{
+        return;
+    }
+    trace->stats.changes++;
+}
+
+/* Apply the recorded changes in [from, to) */
+static void _trace_apply_range(struct fs_event_manager *mon, struct mon_trace *trace, size_t from, size_t to){
+    struct trace_record rec;
+    for (size_t off = from; off < to; off = _trace_next_off(off, &rec)){
+        const char *data = _trace_record_at(trace, off, &rec);
+        if (!data){
+            break;
+        }
+        _trace_apply(mon, trace, &rec, data);
+    }
+}
+
+static void _latency_add(struct mon_trace *trace, uint64_t ns, uint64_t cnt){
+    mon_hist_record_n(&trace->latency, ns, cnt);
+    if (ns > trace->stats.latency_max_ns){
+        trace->stats.latency_max_ns = ns;
+    }
+}
+
+/* Wraps mon->handler while replaying, to time each event */
+static int _trace_timed_handler(struct inotify_event *event, void *data){
+    struct fs_event_manager *mon = data;
+    struct mon_trace *trace = mon->trace;
+    uint64_t start = mon_monotonic_ns();
+    int ret = trace->orig_handler(event, data);
+    _latency_add(trace, mon_monotonic_ns() - start, 1);
+    return ret;
+}
+
+/* Hand one recorded read to the handlers, in chunks no bigger than mon->event_buffer */
+static void _trace_replay_read(struct fs_event_manager *mon, struct mon_trace *trace, const char *data, size_t len){
+    size_t start = 0;
+    while (start < len){
+        size_t end = start;
+        while (end + INOT_EVENT_SIZE <= len){
+            struct inotify_event event;
+            memcpy(&event, data + end, INOT_EVENT_SIZE);
+            size_t size = INOT_EVENT_SIZE + event.len;
+            if (end + size > len || end + size - start > mon->buf_len){
+                break;
+            }
+            end += size;
+        }
+        if (end == start){
+            LOGERROR("Recorded event at '%zu' of a '%zu' byte read does not fit the event buffer, skipped\n", start, len);
+            return;
+        }
+        memcpy(mon->event_buffer, data + start, end - start);
+        uint64_t events = mon->events_read;
+        uint64_t begin = mon_monotonic_ns();
+        monitor_handle_events(mon, end - start);
+        uint64_t took = mon_monotonic_ns() - begin;
+        events = mon->events_read - events;
+        trace->stats.handler_ns += took;
+        trace->stats.events += events;
+        if (!trace->orig_handler && events){
+            // Batch handlers see the whole read at once, spread its time over its events
+            _latency_add(trace, took / events, events);
+        }
+        start = end;
+    }
+}
+
+// Sleep until the monotonic clock reaches ns
+static void _trace_sleep_until(uint64_t ns){
+    uint64_t now = mon_monotonic_ns();
+    if (ns <= now){
+        return;
+    }
+    struct timespec ts;
+    ts.tv_sec = (ns - now) / 1000000000ull;
+    ts.tv_nsec = (ns - now) % 1000000000ull;
+    while (nanosleep(&ts, &ts) && errno == EINTR){
+    }
+}
+
+// Check the trace header, returns why it's unusable or NULL
+static const char *_trace_validate(const char *map, size_t len){
+    struct trace_header hdr;
+    if (len < sizeof(hdr)){
+        return "too short";
+    }
+    memcpy(&hdr, map, sizeof(hdr));
+    if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic))){
+        return "bad magic";
+    }
+    if (hdr.version != TRACE_VERSION || hdr.header_size != sizeof(hdr)){
+        return "unsupported version";
+    }
+    if (hdr.base_len == 0 || hdr.base_len > len - sizeof(hdr)){
+        return "bad base path";
+    }
+    return NULL;
+}
+
+// mmap the trace at path, returns the mapping or NULL
+static char *_trace_map(const char *path, size_t *len){
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        LOGERROR("Failed to open trace:'%s', err:'%s'\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) || st.st_size <= 0){
+        LOGERROR("Empty trace:'%s'\n", path);
+        close(fd);
+        return NULL;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED){
+        LOGERROR("Failed to mmap trace:'%s', err:'%s'\n", path, strerror(errno));
+        return NULL;
+    }
+    const char *reason = _trace_validate(map, st.st_size);
+    if (reason){
+        LOGERROR("Can not replay trace:'%s' (%s)\n", path, reason);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    *len = st.st_size;
+    return map;
+}
+
+/* Copy the base path and mask of the trace at path */
+int monitor_trace_info(const char *path, char *base, size_t base_size, uint32_t *mask){
+    size_t len = 0;
+    if (!path || !base || !base_size){
+        LOGERROR("Null trace path or base buffer provided\n");
+        return -1;
+    }
+    char *map = _trace_map(path, &len);
+    if (!map){
+        return -1;
+    }
+    struct trace_header hdr;
+    memcpy(&hdr, map, sizeof(hdr));
+    int ret = -1;
+    if (hdr.base_len < base_size){
+        memcpy(base, map + sizeof(hdr), hdr.base_len);
+        base[hdr.base_len] = '\0';
+        if (mask){
+            *mask = hdr.mask;
+        }
+        ret = 0;
+    }else{
+        LOGERROR("Base path of trace:'%s' is longer than '%zu'\n", path, base_size);
+    }
+    munmap(map, len);
+    return ret;
+}
+
+/* Drive mon's handlers from the trace at path */
+int monitor_replay(struct fs_event_manager *mon, const char *path, double speed, struct mon_replay_stats *stats){
+    struct trace_record rec;
+    if (!mon || !path || speed < 0){
+        LOGERROR("Null monitor or trace path provided\n");
+        return -1;
+    }
+    if (mon->trace || mon->watch_root || mon->ifd >= 0 || mon->reader){
+        LOGERROR("Monitor:'%s' must be new and not initialized to replay a trace\n", mon->base_path ?: "");
+        return -1;
+    }
+    struct mon_trace *trace = calloc(1, sizeof(struct mon_trace));
+    if (!trace){
+        LOGERROR("Failed to alloc replay of:'%s'\n", path);
+        return -1;
+    }
+    trace->map = _trace_map(path, &trace->map_len);
+    if (!trace->map){
+        free(trace);
+        return -1;
+    }
+    struct trace_header hdr;
+    memcpy(&hdr, trace->map, sizeof(hdr));
+    trace->replay = 1;
+    trace->next_wd = -1;
+    if (mon->handler && !mon->batch_handler){
+        trace->orig_handler = mon->handler;
+        mon->handler = _trace_timed_handler;
+    }
+    mon->trace = trace;
+    uint64_t start = mon_monotonic_ns();
+    uint64_t first_ts = 0;
+    size_t off = sizeof(hdr) + hdr.base_len;
+    while (_trace_record_at(trace, off, &rec) && rec.type != TRACE_READ){
+        off = _trace_next_off(off, &rec);
+    }
+    // The tree as it was when recording started, and any changes made before the first read
+    _trace_apply_range(mon, trace, sizeof(hdr) + hdr.base_len, off);
+    while (!mon->needs_destroy){
+        const char *data = _trace_record_at(trace, off, &rec);
+        if (!data){
+            break;
+        }
+        // Changes recorded up to the next read were made while this one was handled
+        size_t next = _trace_next_off(off, &rec);
+        struct trace_record pending;
+        trace->pending_off = next;
+        while (_trace_record_at(trace, next, &pending) && pending.type != TRACE_READ){
+            next = _trace_next_off(next, &pending);
+        }
+        trace->pending_end = next;
+        if (!first_ts){
+            first_ts = rec.ts_ns;
+        }else if (speed > 0){
+            _trace_sleep_until(start + (uint64_t)((rec.ts_ns - first_ts) / speed));
+        }
+        _trace_replay_read(mon, trace, data, rec.len);
+        trace->stats.reads++;
+        _trace_apply_range(mon, trace, trace->pending_off, trace->pending_end);
+        off = next;
+    }
+    if (off < trace->map_len && !mon->needs_destroy){
+        LOGERROR("Trace:'%s' is cut short at '%zu' of '%zu' bytes\n", path, off, trace->map_len);
+    }
+    trace->stats.elapsed_ns = mon_monotonic_ns() - start;
+    if (trace->stats.elapsed_ns){
+        trace->stats.events_per_sec = trace->stats.events * 1e9 / trace->stats.elapsed_ns;
+    }
+    trace->stats.latency_p50_ns = mon_hist_percentile(&trace->latency, 0.50);
+    trace->stats.latency_p99_ns = mon_hist_percentile(&trace->latency, 0.99);
+    if (stats){
+        *stats = trace->stats;
+    }
+    LOGDEBUG("Replayed trace:'%s', '%llu' reads, '%llu' events in %llu ms\n", path,
+             (unsigned long long)trace->stats.reads, (unsigned long long)trace->stats.events,
+             (unsigned long long)(trace->stats.elapsed_ns / 1000000));
+    if (trace->orig_handler){
+        mon->handler = trace->orig_handler;
+    }
+    mon->trace = NULL;
+    munmap((void *)trace->map, trace->map_len);
+    free(trace->path);
+    free(trace);
+    return 0;
+}
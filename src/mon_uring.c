@@ -0,0 +1,567 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_resync.h"
+#include "includes/mon_coalesce.h"
+#include "includes/mon_uring.h"
+#include "includes/mon_utils.h"
+
+/* io_uring ingestion backend. 
+ * liburing isn't a dependency, the ring is set up and driven with the raw syscalls. 
+ * Every submission carries a tagged pointer in user_data: the object it's for, with the 
+ * op type in the low bits, which are always clear in malloc'd pointers. 
+ */
+
+enum uring_op {
+    URING_OP_IGNORE = 0, // completions nobody waits for, e.g. cancels
+    URING_OP_MON_POLL, // poll of mon->ifd, linked to the read
+    URING_OP_MON_READ, // read of mon->ifd into mon->event_buffer
+    URING_OP_COALESCE, // poll of the monitor's coalesce timerfd
+    URING_OP_TIMEOUT, // bounds the wait while monitors have periodic work
+    URING_OP_FILE_OPEN,
+    URING_OP_FILE_READ,
+    URING_OP_FILE_CLOSE,
+};
+#define URING_OP_MASK 7ull
+
+static int _io_uring_setup(unsigned int entries, struct io_uring_params *params){
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int _io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags){
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int _io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args){
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Opcodes the backend submits, all in the kernel since 5.6
+static const uint8_t _uring_ops[] = {
+    IORING_OP_NOP, IORING_OP_POLL_ADD, IORING_OP_READ, IORING_OP_TIMEOUT, 
+    IORING_OP_ASYNC_CANCEL, IORING_OP_OPENAT, IORING_OP_CLOSE, 
+};
+
+/* Check the kernel supports every opcode in _uring_ops. io_uring_setup() alone 
+ * succeeds on 5.1+, where they'd only fail once submitted. Returns 0 if it does */
+static int _uring_probe(int fd){
+    size_t ops = 256;
+    struct io_uring_probe *probe = calloc(1, sizeof(struct io_uring_probe) + ops * sizeof(struct io_uring_probe_op));
+    if (!probe){
+        LOGERROR("Failed to alloc io_uring probe\n");
+        return -1;
+    }
+    // IORING_REGISTER_PROBE itself came in 5.6, along with IORING_OP_READ and the rest
+    if (_io_uring_register(fd, IORING_REGISTER_PROBE, probe, ops)){
+        LOGERROR("io_uring probe failed, err:'%s'\n", strerror(errno));
+        free(probe);
+        return -1;
+    }
+    int ret = 0;
+    for (size_t i = 0; i < sizeof(_uring_ops); i++){
+        uint8_t op = _uring_ops[i];
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)){
+            LOGERROR("io_uring op:'%u' not supported by the kernel\n", op);
+            ret = -1;
+        }
+    }
+    free(probe);
+    return ret;
+}
+
+static uint64_t _uring_tag(void *ptr, enum uring_op op){
+    return (uint64_t)(uintptr_t)ptr | op;
+}
+
+// Submit what's queued without waiting
+static int _uring_submit(struct mon_uring *ring){
+    while (ring->to_submit){
+        ring->enters++;
+        int ret = _io_uring_enter(ring->ring_fd, ring->to_submit, 0, 0);
+        if (ret < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            LOGERROR("io_uring_enter submit failed, err:'%s'\n", strerror(errno));
+            return -1;
+        }
+        ring->to_submit -= ret;
+    }
+    return 0;
+}
+
+/* Next free submission entry, zeroed. Submits what's queued to make room if the ring is full */
+static struct io_uring_sqe *_uring_get_sqe(struct mon_uring *ring){
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned int tail = *ring->sq_tail;
+    if (tail - head >= ring->sq_entries){
+        if (_uring_submit(ring)){
+            return NULL;
+        }
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head >= ring->sq_entries){
+            LOGERROR("io_uring submission queue full\n");
+            return NULL;
+        }
+    }
+    unsigned int idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[idx] = idx;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->to_submit++;
+    return sqe;
+}
+
+/* Queue a poll of mon->ifd linked to a read of it, the read only runs once there are events */
+static int _uring_arm_monitor(struct mon_uring *ring, struct uring_monitor *umon){
+    struct fs_event_manager *mon = umon->mon;
+    if (umon->armed || mon->ifd < 0 || mon->needs_destroy){
+        return 0;
+    }
+    if (umon->failed){
+        if (umon->armed_gen == mon->ifd_gen){
+            // Re-arming would only fail the same way, wait for a new fd
+            return 0;
+        }
+        umon->failed = 0;
+    }
+    // Get both entries first, so a link is never left dangling
+    struct io_uring_sqe *poll = _uring_get_sqe(ring);
+    struct io_uring_sqe *read = poll ? _uring_get_sqe(ring) : NULL;
+    if (!read){
+        if (poll){
+            // Already in the ring, turn it into a no-op
+            poll->opcode = IORING_OP_NOP;
+            poll->user_data = _uring_tag(NULL, URING_OP_IGNORE);
+        }
+        return -1;
+    }
+    poll->opcode = IORING_OP_POLL_ADD;
+    poll->fd = mon->ifd;
+    poll->poll32_events = POLLIN;
+    poll->flags = IOSQE_IO_LINK;
+    poll->user_data = _uring_tag(umon, URING_OP_MON_POLL);
+    read->opcode = IORING_OP_READ;
+    read->fd = mon->ifd;
+    read->addr = (uint64_t)(uintptr_t)mon->event_buffer;
+    read->len = mon->buf_len;
+    read->user_data = _uring_tag(umon, URING_OP_MON_READ);
+    umon->armed = 1;
+    umon->cancelled = 0;
+    umon->armed_gen = mon->ifd_gen;
+    return 0;
+}
+
+static int _uring_arm_coalesce(struct mon_uring *ring, struct uring_monitor *umon){
+    int fd = monitor_coalesce_fd(umon->mon);
+    if (umon->timer_armed || fd < 0){
+        return 0;
+    }
+    struct io_uring_sqe *sqe = _uring_get_sqe(ring);
+    if (!sqe){
+        return -1;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = _uring_tag(umon, URING_OP_COALESCE);
+    umon->timer_armed = 1;
+    return 0;
+}
+
+/* Periodic work for the monitors. Returns the longest the next wait may take */
+static int _uring_tick(struct mon_uring *ring, int timeout_ms){
+    uint64_t now = mon_monotonic_ns();
+    for (size_t i = 0; i < ring->mon_cnt; i++){
+        struct uring_monitor *umon = ring->mons[i];
+        struct fs_event_manager *mon = umon->mon;
+        monitor_expire_moves(mon);
+        monitor_resync_step(mon, MON_RESYNC_BATCH);
+        if (umon->armed && umon->armed_gen != mon->ifd_gen && !umon->cancelled){
+            // The fd the poll waits on was replaced, e.g. by reset_monitor(). Cancel it, 
+            // the read completes with -ECANCELED and is re-armed on the new fd
+            struct io_uring_sqe *sqe = _uring_get_sqe(ring);
+            if (sqe){
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = _uring_tag(umon, URING_OP_MON_POLL);
+                sqe->user_data = _uring_tag(NULL, URING_OP_IGNORE);
+                umon->cancelled = 1;
+            }
+        }
+        _uring_arm_monitor(ring, umon);
+        _uring_arm_coalesce(ring, umon);
+        if (mon->resync_pending){
+            timeout_ms = 0;
+        }else if (mon->pending_move_cnt){
+            uint64_t due = mon->pending_moves[0].expires_ns;
+            int wait_ms = due > now ? (int)((due - now) / 1000000) + 1 : 0;
+            if (timeout_ms < 0 || wait_ms < timeout_ms){
+                timeout_ms = wait_ms;
+            }
+        }
+    }
+    return timeout_ms;
+}
+
+static void _uring_file_done(struct uring_file_req *req){
+    struct uring_file_batch *batch = req->batch;
+    if (--batch->pending){
+        return;
+    }
+    if (batch->cb){
+        batch->cb(batch->reqs, batch->cnt, batch->data);
+    }
+    free(batch);
+}
+
+// The open finished, read the file then close it whatever the read returns
+static void _uring_file_opened(struct mon_uring *ring, struct uring_file_req *req, int res){
+    if (res < 0){
+        req->result = res;
+        _uring_file_done(req);
+        return;
+    }
+    req->fd = res;
+    struct io_uring_sqe *read = _uring_get_sqe(ring);
+    struct io_uring_sqe *close_sqe = read ? _uring_get_sqe(ring) : NULL;
+    if (!close_sqe){
+        if (read){
+            read->opcode = IORING_OP_NOP;
+            read->user_data = _uring_tag(NULL, URING_OP_IGNORE);
+        }
+        req->result = -ENOMEM;
+        close(req->fd);
+        _uring_file_done(req);
+        return;
+    }
+    read->opcode = IORING_OP_READ;
+    read->fd = req->fd;
+    read->addr = (uint64_t)(uintptr_t)req->buf;
+    read->len = req->buflen;
+    read->off = 0;
+    // A short read breaks a plain link, a hard link still closes the file
+    read->flags = IOSQE_IO_HARDLINK;
+    read->user_data = _uring_tag(req, URING_OP_FILE_READ);
+    close_sqe->opcode = IORING_OP_CLOSE;
+    close_sqe->fd = req->fd;
+    close_sqe->user_data = _uring_tag(req, URING_OP_FILE_CLOSE);
+}
+
+/* Whether a failed poll or read of an inotify fd would fail again if re-armed on the same 
+ * fd, e.g. EBADF or EINVAL. Cancels and interrupted waits are retried */
+static int _uring_persistent_error(int res){
+    return res < 0 && res != -ECANCELED && res != -EAGAIN && res != -EINTR && res != -ENOMEM && res != -ENOBUFS;
+}
+
+static void _uring_complete(struct mon_uring *ring, struct io_uring_cqe *cqe){
+    enum uring_op op = cqe->user_data & URING_OP_MASK;
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+    struct uring_monitor *umon = ptr;
+    struct uring_file_req *req = ptr;
+    int res = cqe->res;
+    switch (op){
+        case URING_OP_MON_POLL:
+            // Only failures complete the poll alone, its read is then cancelled and tells the rest
+            if (_uring_persistent_error(res) && !umon->failed){
+                LOGERROR("io_uring poll of inotify fd failed for:'%s', err:'%s'\n", 
+                         umon->mon->base_path ?: "", strerror(-res));
+                umon->failed = 1;
+            }
+            break;
+        case URING_OP_MON_READ:
+            umon->armed = 0;
+            if (res > 0 && umon->armed_gen == umon->mon->ifd_gen){
+                umon->mon->ifd_reads++;
+                monitor_handle_events(umon->mon, res);
+            }else if (_uring_persistent_error(res) && !umon->failed){
+                LOGERROR("io_uring read of inotify fd failed for:'%s', err:'%s'\n", 
+                         umon->mon->base_path ?: "", strerror(-res));
+                umon->failed = 1;
+            }
+            _uring_arm_monitor(ring, umon);
+            break;
+        case URING_OP_COALESCE:
+            umon->timer_armed = 0;
+            monitor_coalesce_flush_expired(umon->mon);
+            _uring_arm_coalesce(ring, umon);
+            break;
+        case URING_OP_TIMEOUT:
+            ring->timeout_armed = 0;
+            break;
+        case URING_OP_FILE_OPEN:
+            _uring_file_opened(ring, req, res);
+            break;
+        case URING_OP_FILE_READ:
+            req->result = res;
+            break;
+        case URING_OP_FILE_CLOSE:
+            req->fd = -1;
+            _uring_file_done(req);
+            break;
+        default:
+            break;
+    }
+}
+
+// Handle every completion in the ring
+static int _uring_reap(struct mon_uring *ring){
+    int cnt = 0;
+    unsigned int head = *ring->cq_head;
+    for (;;){
+        unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail){
+            break;
+        }
+        struct io_uring_cqe cqe = ring->cqes[head & *ring->cq_mask];
+        // Hand the slot back before handling, handlers may queue and submit more
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+        _uring_complete(ring, &cqe);
+        cnt++;
+    }
+    ring->completions += cnt;
+    return cnt;
+}
+
+/* Set up an io_uring with entries submission slots */
+struct mon_uring *mon_uring_create(unsigned int entries){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = _io_uring_setup(entries ? entries : MON_URING_DEFAULT_ENTRIES, &params);
+    if (fd < 0){
+        LOGERROR("io_uring not available, err:'%s'. Use the epoll reactor instead\n", strerror(errno));
+        return NULL;
+    }
+    if (_uring_probe(fd)){
+        LOGERROR("io_uring lacks ops the backend needs. Use the epoll reactor instead\n");
+        close(fd);
+        return NULL;
+    }
+    struct mon_uring *ring = calloc(1, sizeof(struct mon_uring));
+    if (!ring){
+        close(fd);
+        return NULL;
+    }
+    ring->ring_fd = fd;
+    ring->sq_entries = params.sq_entries;
+    ring->cq_entries = params.cq_entries;
+    ring->sq_ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP){
+        if (ring->cq_ring_len > ring->sq_ring_len){
+            ring->sq_ring_len = ring->cq_ring_len;
+        }
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                         fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = ring->sq_ring;
+    if (ring->sq_ring != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)){
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                             fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, 
+                      fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED){
+        LOGERROR("Failed to map io_uring, err:'%s'\n", strerror(errno));
+        if (ring->sqes != MAP_FAILED){
+            munmap(ring->sqes, ring->sqes_len);
+        }
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring){
+            munmap(ring->cq_ring, ring->cq_ring_len);
+        }
+        if (ring->sq_ring != MAP_FAILED){
+            munmap(ring->sq_ring, ring->sq_ring_len);
+        }
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    LOGDEBUG("io_uring ready, '%u' sq entries, '%u' cq entries\n", ring->sq_entries, ring->cq_entries);
+    return ring;
+}
+
+/* Tear down the ring */
+void mon_uring_destroy(struct mon_uring *ring){
+    if (!ring){
+        return;
+    }
+    // Closing the ring cancels whatever is in flight
+    close(ring->ring_fd);
+    munmap(ring->sqes, ring->sqes_len);
+    if (ring->cq_ring != ring->sq_ring){
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_len);
+    for (size_t i = 0; i < ring->mon_cnt; i++){
+        free(ring->mons[i]);
+    }
+    free(ring->mons);
+    free(ring);
+}
+
+/* Read events of an initialized monitor through the ring */
+int mon_uring_add_monitor(struct mon_uring *ring, struct fs_event_manager *mon){
+    if (!ring || !mon || mon->ifd < 0){
+        LOGERROR("Null ring or monitor, or monitor not initialized\n");
+        return -1;
+    }
+    if (mon->reader){
+        // Its reader thread owns the fd, reading it here too would split the stream
+        LOGERROR("Monitor of:'%s' has a reader thread, it can't be added to a ring\n", mon->base_path ?: "");
+        return -1;
+    }
+    if (ring->mon_cnt == ring->mon_size){
+        size_t size = ring->mon_size ? ring->mon_size * 2 : 8;
+        struct uring_monitor **mons = realloc(ring->mons, size * sizeof(struct uring_monitor *));
+        if (!mons){
+            LOGERROR("Failed to grow ring monitors to '%zu'\n", size);
+            return -1;
+        }
+        ring->mons = mons;
+        ring->mon_size = size;
+    }
+    struct uring_monitor *umon = calloc(1, sizeof(struct uring_monitor));
+    if (!umon){
+        return -1;
+    }
+    umon->mon = mon;
+    ring->mons[ring->mon_cnt++] = umon;
+    _uring_arm_monitor(ring, umon);
+    _uring_arm_coalesce(ring, umon);
+    return 0;
+}
+
+// open/read/close each file on the calling thread
+static void _read_files_sync(struct uring_file_req *reqs, size_t cnt){
+    for (size_t i = 0; i < cnt; i++){
+        struct uring_file_req *req = &reqs[i];
+        int fd = open(req->path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0){
+            req->result = -errno;
+            continue;
+        }
+        req->result = read(fd, req->buf, req->buflen);
+        if (req->result < 0){
+            req->result = -errno;
+        }
+        close(fd);
+    }
+}
+
+/* Read the first buflen bytes of each file in reqs */
+int mon_uring_read_files(struct mon_uring *ring, struct uring_file_req *reqs, size_t cnt, 
+                         uring_files_cb cb, void *data){
+    if (!reqs || !cnt){
+        return -1;
+    }
+    if (!ring){
+        _read_files_sync(reqs, cnt);
+        if (cb){
+            cb(reqs, cnt, data);
+        }
+        return 0;
+    }
+    struct uring_file_batch *batch = calloc(1, sizeof(struct uring_file_batch));
+    if (!batch){
+        LOGERROR("Failed to alloc file batch of '%zu'\n", cnt);
+        return -1;
+    }
+    batch->reqs = reqs;
+    batch->cnt = cnt;
+    batch->pending = cnt;
+    batch->cb = cb;
+    batch->data = data;
+    for (size_t i = 0; i < cnt; i++){
+        struct uring_file_req *req = &reqs[i];
+        req->fd = -1;
+        req->result = 0;
+        req->batch = batch;
+        struct io_uring_sqe *sqe = _uring_get_sqe(ring);
+        if (!sqe){
+            req->result = -ENOMEM;
+            _uring_file_done(req);
+            continue;
+        }
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t)(uintptr_t)req->path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = _uring_tag(req, URING_OP_FILE_OPEN);
+    }
+    return 0;
+}
+
+/* Submit what's queued, wait up to timeout_ms for completions and handle them */
+int mon_uring_run_once(struct mon_uring *ring, int timeout_ms){
+    if (!ring){
+        return -1;
+    }
+    timeout_ms = _uring_tick(ring, timeout_ms);
+    if (timeout_ms > 0 && !ring->timeout_armed){
+        struct io_uring_sqe *sqe = _uring_get_sqe(ring);
+        if (sqe){
+            ring->timeout_ts.tv_sec = timeout_ms / 1000;
+            ring->timeout_ts.tv_nsec = (timeout_ms % 1000) * 1000000ll;
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->addr = (uint64_t)(uintptr_t)&ring->timeout_ts;
+            sqe->len = 1;
+            sqe->user_data = _uring_tag(NULL, URING_OP_TIMEOUT);
+            ring->timeout_armed = 1;
+        }
+    }
+    // Nothing ready yet and a wait is allowed, block for the first completion
+    unsigned int wait = (timeout_ms != 0 && *ring->cq_head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) ? 1 : 0;
+    ring->enters++;
+    int ret = _io_uring_enter(ring->ring_fd, ring->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    if (ret < 0){
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY){
+            LOGERROR("io_uring_enter failed, err:'%s'\n", strerror(errno));
+            return -1;
+        }
+    }else{
+        ring->to_submit -= ret;
+    }
+    return _uring_reap(ring);
+}
+
+/* Run until mon_uring_stop() is called */
+int mon_uring_run(struct mon_uring *ring){
+    if (!ring){
+        LOGERROR("Null ring provided to run\n");
+        return -1;
+    }
+    ring->running = 1;
+    while (ring->running){
+        if (mon_uring_run_once(ring, -1) < 0){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Make mon_uring_run() return after the current pass */
+void mon_uring_stop(struct mon_uring *ring){
+    if (ring){
+        ring->running = 0;
+    }
+}
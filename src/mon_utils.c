@@ -5,6 +5,7 @@
 //#include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <time.h>
 //#include <pthread.h>
 //#include <sys/types.h>
 //#include <sys/inotify.h>
@@ -72,8 +73,10 @@ json_t *json_from_file(char *path){
 int set_local_debug_enabled(int enabled){
     if (enabled <= 0){
         _LOCAL_DEBUG=0;
+        mon_log_set_level(MON_LOG_DEFAULT_LEVEL);
     }else{
         _LOCAL_DEBUG = enabled;
+        mon_log_set_level(LOG_DEBUG);
     }
     return _LOCAL_DEBUG;;
 }
@@ -82,3 +85,11 @@ int set_local_debug_enabled(int enabled){
 int _local_debug_enabled(void){
     return _LOCAL_DEBUG; 
 }
+
+
+/* Current CLOCK_MONOTONIC time in nanoseconds */
+uint64_t mon_monotonic_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
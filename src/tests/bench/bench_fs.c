@@ -0,0 +1,375 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <jansson.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_resync.h"
+#include "includes/mon_utils.h"
+
+/* Event storm benchmark. Builds a tree of fanout^1 + ... + fanout^depth dirs on tmpfs
+ * and drives a monitor with example_event_handler() while a generator thread creates,
+ * modifies, renames and deletes files across it, then creates a second tree while
+ * it's watched. Every event the generator should cause is counted, so events lost to
+ * IN_Q_OVERFLOW or otherwise show up as missed. Results are written as JSON.
+ * usage: bench_fs [dir] [fanout] [depth] [files] [rounds] [json_out]
+ *   dir      base dir, a run dir is made and removed under it. Default /dev/shm/bench_fs (tmpfs)
+ *   fanout   sub dirs per dir, default 4
+ *   depth    levels of sub dirs, default 3
+ *   files    files per dir per round, default 20
+ *   rounds   storm rounds, default 5
+ *   json_out file to write the results to, default stdout
+ */
+
+#define BENCH_MAX_DIRS 200000
+#define BENCH_IDLE_MS 200
+#define BENCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+enum bench_kind {
+    KIND_CREATE,
+    KIND_MODIFY,
+    KIND_CLOSE_WRITE,
+    KIND_MOVED_FROM,
+    KIND_MOVED_TO,
+    KIND_DELETE,
+    KIND_CNT,
+};
+
+static const char *kind_names[KIND_CNT] = {
+    "create", "modify", "close_write", "moved_from", "moved_to", "delete",
+};
+
+struct bench_tree {
+    char (*paths)[PATH_MAX]; // parents before children
+    size_t cnt;
+};
+
+struct bench_run {
+    struct fs_event_manager *mon;
+    struct bench_tree *tree; // tree the generator works on
+    int files;
+    int rounds;
+    int phase; // 0 storm, 1 build the tree
+    int done; // generator finished
+    uint64_t expected[KIND_CNT]; // file events the generator caused
+    uint64_t seen[KIND_CNT]; // file events the monitor read
+    uint64_t overflows; // IN_Q_OVERFLOW events read
+    uint64_t gen_ns; // generator run time
+};
+
+// Build the dir list of a tree rooted at root, parents first
+static int tree_init(struct bench_tree *tree, const char *root, int fanout, int depth){
+    size_t cnt = 0;
+    size_t level = 1;
+    for (int i = 0; i < depth; i++){
+        level *= fanout;
+        cnt += level;
+        if (cnt > BENCH_MAX_DIRS){
+            printf("fanout:%d depth:%d is more than %d dirs\n", fanout, depth, BENCH_MAX_DIRS);
+            return -1;
+        }
+    }
+    tree->paths = calloc(cnt + 1, sizeof(*tree->paths));
+    if (!tree->paths){
+        return -1;
+    }
+    snprintf(tree->paths[0], PATH_MAX, "%s", root);
+    tree->cnt = 1;
+    for (size_t i = 0; tree->cnt <= cnt; i++){
+        size_t len = strnlen(tree->paths[i], PATH_MAX - 16);
+        for (int j = 0; j < fanout; j++){
+            char *path = tree->paths[tree->cnt++];
+            memcpy(path, tree->paths[i], len);
+            snprintf(path + len, PATH_MAX - len, "/d%d", j);
+        }
+    }
+    return 0;
+}
+
+static void tree_make(struct bench_tree *tree){
+    for (size_t i = 0; i < tree->cnt; i++){
+        mkdir(tree->paths[i], 0755);
+    }
+}
+
+static void tree_remove(struct bench_tree *tree){
+    for (size_t i = tree->cnt; i > 0; i--){
+        rmdir(tree->paths[i - 1]);
+    }
+}
+
+/* One op on every file of every dir, each op is a burst across the whole tree */
+static void storm_op(struct bench_run *run, int op){
+    char path[PATH_MAX + 32];
+    char dst[PATH_MAX + 32];
+    for (size_t d = 0; d < run->tree->cnt; d++){
+        for (int f = 0; f < run->files; f++){
+            snprintf(path, sizeof(path), "%s/f%d", run->tree->paths[d], f);
+            if (op == 0 || op == 1){
+                int fd = open(path, O_WRONLY | O_CLOEXEC | (op ? O_APPEND : O_CREAT | O_EXCL), 0644);
+                if (fd < 0){
+                    continue;
+                }
+                if (!op){
+                    run->expected[KIND_CREATE]++;
+                }
+                if (write(fd, "bench\n", 6) == 6){
+                    run->expected[KIND_MODIFY]++;
+                }
+                close(fd);
+                run->expected[KIND_CLOSE_WRITE]++;
+            }else if (op == 2){
+                snprintf(dst, sizeof(dst), "%s/m%d", run->tree->paths[d], f);
+                if (!rename(path, dst)){
+                    run->expected[KIND_MOVED_FROM]++;
+                    run->expected[KIND_MOVED_TO]++;
+                }
+            }else{
+                snprintf(dst, sizeof(dst), "%s/m%d", run->tree->paths[d], f);
+                if (!unlink(dst)){
+                    run->expected[KIND_DELETE]++;
+                }
+            }
+        }
+    }
+}
+
+static void *gen_thread(void *arg){
+    struct bench_run *run = arg;
+    uint64_t start = mon_monotonic_ns();
+    if (run->phase){
+        tree_make(run->tree);
+    }else{
+        for (int r = 0; r < run->rounds; r++){
+            // create, modify, rename, delete
+            for (int op = 0; op < 4; op++){
+                storm_op(run, op);
+            }
+        }
+    }
+    run->gen_ns = mon_monotonic_ns() - start;
+    __atomic_store_n(&run->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Handlers get the monitor as data, the bench only runs one at a time
+static struct bench_run *bench_run_cur;
+
+// Count the file events, then let example_event_handler() keep the tree up to date
+static int bench_batch_handler(struct mon_event *events, size_t cnt, void *data){
+    struct bench_run *run = bench_run_cur;
+    for (size_t i = 0; i < cnt; i++){
+        uint32_t mask = events[i].event->mask;
+        if (mask & IN_Q_OVERFLOW){
+            run->overflows++;
+        }
+        if (mask & IN_ISDIR){
+            continue;
+        }
+        run->seen[KIND_CREATE] += !!(mask & IN_CREATE);
+        run->seen[KIND_MODIFY] += !!(mask & IN_MODIFY);
+        run->seen[KIND_CLOSE_WRITE] += !!(mask & IN_CLOSE_WRITE);
+        run->seen[KIND_MOVED_FROM] += !!(mask & IN_MOVED_FROM);
+        run->seen[KIND_MOVED_TO] += !!(mask & IN_MOVED_TO);
+        run->seen[KIND_DELETE] += !!(mask & IN_DELETE);
+    }
+    return monitor_batch_adapter(events, cnt, data);
+}
+
+static uint64_t thread_cpu_ns(void){
+    struct rusage ru;
+    getrusage(RUSAGE_THREAD, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ull +
+           (uint64_t)(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ull;
+}
+
+/* Run the generator and consume the monitor's events until it's done and the
+ * monitor has been idle for BENCH_IDLE_MS. Returns the consumer's wall time */
+static uint64_t drive(struct bench_run *run, uint64_t *cpu_ns){
+    pthread_t thread;
+    struct fs_event_manager *mon = run->mon;
+    uint64_t start = mon_monotonic_ns();
+    uint64_t last = start;
+    uint64_t cpu = thread_cpu_ns();
+    pthread_create(&thread, NULL, gen_thread, run);
+    for (;;){
+        uint64_t now = mon_monotonic_ns();
+        if (mon_fd_has_events(mon->ifd, 0, mon->resync_pending ? 0 : 10000)){
+            read_events_batch(mon);
+            last = mon_monotonic_ns();
+        }else if (__atomic_load_n(&run->done, __ATOMIC_ACQUIRE) && !mon->resync_pending &&
+                  now - last > BENCH_IDLE_MS * 1000000ull){
+            break;
+        }
+        monitor_expire_moves(mon);
+        monitor_resync_step(mon, MON_RESYNC_BATCH);
+    }
+    pthread_join(thread, NULL);
+    *cpu_ns = thread_cpu_ns() - cpu;
+    // The idle wait at the end isn't work
+    return last - start;
+}
+
+static json_t *run_init(struct bench_run *run, struct bench_tree *tree){
+    json_t *obj = json_object();
+    uint64_t start = mon_monotonic_ns();
+    int ret = monitor_init(run->mon);
+    uint64_t elapsed = mon_monotonic_ns() - start;
+    json_object_set_new(obj, "ok", ret ? json_false() : json_true());
+    json_object_set_new(obj, "dirs", json_integer(tree->cnt));
+    json_object_set_new(obj, "watches", json_integer(run->mon->watch_count));
+    json_object_set_new(obj, "ms", json_real(elapsed / 1e6));
+    json_object_set_new(obj, "watches_per_sec", json_real(elapsed ? run->mon->watch_count * 1e9 / elapsed : 0));
+    return obj;
+}
+
+static json_t *run_storm(struct bench_run *run){
+    json_t *obj = json_object();
+    json_t *kinds = json_object();
+    uint64_t cpu = 0;
+    uint64_t events = run->mon->events_read;
+    uint64_t reads = run->mon->ifd_reads;
+    run->phase = 0;
+    run->done = 0;
+    uint64_t elapsed = drive(run, &cpu);
+    events = run->mon->events_read - events;
+    reads = run->mon->ifd_reads - reads;
+    uint64_t expected = 0;
+    uint64_t missed = 0;
+    for (int k = 0; k < KIND_CNT; k++){
+        json_t *kind = json_object();
+        uint64_t miss = run->expected[k] > run->seen[k] ? run->expected[k] - run->seen[k] : 0;
+        json_object_set_new(kind, "expected", json_integer(run->expected[k]));
+        json_object_set_new(kind, "seen", json_integer(run->seen[k]));
+        json_object_set_new(kinds, kind_names[k], kind);
+        expected += run->expected[k];
+        missed += miss;
+    }
+    json_object_set_new(obj, "rounds", json_integer(run->rounds));
+    json_object_set_new(obj, "files_per_dir", json_integer(run->files));
+    json_object_set_new(obj, "events_expected", json_integer(expected));
+    json_object_set_new(obj, "events_read", json_integer(events));
+    json_object_set_new(obj, "events_missed", json_integer(missed));
+    json_object_set_new(obj, "overflows", json_integer(run->overflows));
+    json_object_set_new(obj, "reads", json_integer(reads));
+    json_object_set_new(obj, "events_per_read", json_real(reads ? (double)events / reads : 0));
+    json_object_set_new(obj, "ms", json_real(elapsed / 1e6));
+    json_object_set_new(obj, "generator_ms", json_real(run->gen_ns / 1e6));
+    json_object_set_new(obj, "events_per_sec", json_real(elapsed ? events * 1e9 / elapsed : 0));
+    json_object_set_new(obj, "cpu_ns_per_event", json_real(events ? (double)cpu / events : 0));
+    json_object_set_new(obj, "kinds", kinds);
+    return obj;
+}
+
+static json_t *run_dynamic(struct bench_run *run, struct bench_tree *tree){
+    json_t *obj = json_object();
+    uint64_t cpu = 0;
+    size_t before = run->mon->watch_count;
+    uint64_t overflows = run->overflows;
+    run->tree = tree;
+    run->phase = 1;
+    run->done = 0;
+    uint64_t elapsed = drive(run, &cpu);
+    size_t added = run->mon->watch_count - before;
+    json_object_set_new(obj, "dirs", json_integer(tree->cnt));
+    json_object_set_new(obj, "watches_added", json_integer(added));
+    json_object_set_new(obj, "dirs_missed", json_integer(added < tree->cnt ? tree->cnt - added : 0));
+    json_object_set_new(obj, "overflows", json_integer(run->overflows - overflows));
+    json_object_set_new(obj, "ms", json_real(elapsed / 1e6));
+    json_object_set_new(obj, "watches_per_sec", json_real(elapsed ? added * 1e9 / elapsed : 0));
+    json_object_set_new(obj, "cpu_ns_per_watch", json_real(added ? (double)cpu / added : 0));
+    return obj;
+}
+
+static long read_proc_long(const char *path){
+    long val = -1;
+    FILE *fp = fopen(path, "r");
+    if (fp){
+        if (fscanf(fp, "%ld", &val) != 1){
+            val = -1;
+        }
+        fclose(fp);
+    }
+    return val;
+}
+
+int main(int argc, char **argv){
+    const char *dir = argc > 1 ? argv[1] : "/dev/shm/bench_fs";
+    int fanout = argc > 2 ? atoi(argv[2]) : 4;
+    int depth = argc > 3 ? atoi(argv[3]) : 3;
+    int files = argc > 4 ? atoi(argv[4]) : 20;
+    int rounds = argc > 5 ? atoi(argv[5]) : 5;
+    const char *out = argc > 6 ? argv[6] : NULL;
+    char base[PATH_MAX];
+    char root[PATH_MAX + 16];
+    struct bench_tree storm_tree;
+    struct bench_tree dyn_tree;
+    struct bench_run run;
+    if (fanout < 1 || depth < 0 || files < 1 || rounds < 1){
+        printf("usage: %s [dir] [fanout] [depth] [files] [rounds] [json_out]\n", argv[0]);
+        return 1;
+    }
+    if (mkdir(dir, 0755) && !mon_dir_exists((char *)dir)){
+        LOGERROR("Failed to create bench dir:'%s'\n", dir);
+        return 1;
+    }
+    snprintf(base, sizeof(base), "%s/run%d", dir, (int)getpid());
+    snprintf(root, sizeof(root), "%s/storm", base);
+    if (mkdir(base, 0755) || tree_init(&storm_tree, root, fanout, depth)){
+        return 1;
+    }
+    snprintf(root, sizeof(root), "%s/dynamic", base);
+    if (tree_init(&dyn_tree, root, fanout, depth)){
+        return 1;
+    }
+    tree_make(&storm_tree);
+    memset(&run, 0, sizeof(run));
+    run.tree = &storm_tree;
+    run.files = files;
+    run.rounds = rounds;
+    bench_run_cur = &run;
+    run.mon = create_event_monitor(base, BENCH_MASK, 1, example_event_handler, 0);
+    if (!run.mon){
+        return 1;
+    }
+    run.mon->batch_handler = bench_batch_handler;
+    json_t *result = json_object();
+    json_t *config = json_object();
+    json_object_set_new(config, "dir", json_string(base));
+    json_object_set_new(config, "fanout", json_integer(fanout));
+    json_object_set_new(config, "depth", json_integer(depth));
+    json_object_set_new(config, "files", json_integer(files));
+    json_object_set_new(config, "rounds", json_integer(rounds));
+    json_object_set_new(config, "event_buf_len", json_integer(run.mon->buf_len));
+    json_object_set_new(config, "max_queued_events", json_integer(read_proc_long("/proc/sys/fs/inotify/max_queued_events")));
+    json_object_set_new(config, "cpus", json_integer(sysconf(_SC_NPROCESSORS_ONLN)));
+    json_object_set_new(result, "config", config);
+    json_object_set_new(result, "init", run_init(&run, &storm_tree));
+    json_object_set_new(result, "storm", run_storm(&run));
+    json_object_set_new(result, "dynamic", run_dynamic(&run, &dyn_tree));
+    destroy_event_monitor(run.mon);
+    tree_remove(&dyn_tree);
+    tree_remove(&storm_tree);
+    rmdir(base);
+    FILE *fp = out ? fopen(out, "w") : stdout;
+    if (!fp){
+        LOGERROR("Failed to open:'%s'\n", out);
+        json_decref(result);
+        return 1;
+    }
+    json_dumpf(result, fp, JSON_INDENT(2));
+    fprintf(fp, "\n");
+    if (out){
+        fclose(fp);
+    }
+    json_decref(result);
+    free(storm_tree.paths);
+    free(dyn_tree.paths);
+    return 0;
+}
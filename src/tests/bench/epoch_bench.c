@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_epoch.h"
+#include "includes/mon_utils.h"
+
+/* Compares lock-free wd -> path lookups through mon->epoch with lookups under a
+ * pthread rwlock (the uv_locks.c pattern), while one writer keeps moving, removing
+ * and re-adding dirs in the watch tree.
+ * usage: epoch_bench [dir] [readers] [seconds] [write_pause_us]
+ *   dir            base dir to fill and watch, default /dev/shm/epoch_bench (tmpfs)
+ *   readers        number of lookup threads, default 4
+ *   seconds        length of each run, default 2
+ *   write_pause_us writer sleep between tree changes, 0 writes flat out. Default 100
+ */
+
+#define BENCH_TOP_DIRS 100
+#define BENCH_SUB_DIRS 10
+#define BENCH_DIRS (BENCH_TOP_DIRS * (BENCH_SUB_DIRS + 1))
+
+enum bench_mode {
+    BENCH_EPOCH,
+    BENCH_RWLOCK,
+};
+
+struct bench_run {
+    struct fs_event_manager *mon;
+    enum bench_mode mode;
+    pthread_rwlock_t lock;
+    int stop;
+    int wds[BENCH_DIRS]; // current wd of each bench dir, what the readers look up
+    uint64_t lookups;
+    uint64_t misses;
+    uint64_t writes;
+};
+
+static int fill_dir(const char *dir){
+    char path[PATH_MAX];
+    if (mkdir(dir, 0755) && !mon_dir_exists((char *)dir)){
+        LOGERROR("Failed to create bench dir:'%s'\n", dir);
+        return -1;
+    }
+    for (int i = 0; i < BENCH_TOP_DIRS; i++){
+        snprintf(path, sizeof(path), "%s/d%d", dir, i);
+        mkdir(path, 0755);
+        for (int j = 0; j < BENCH_SUB_DIRS; j++){
+            snprintf(path, sizeof(path), "%s/d%d/s%d", dir, i, j);
+            mkdir(path, 0755);
+        }
+    }
+    return 0;
+}
+
+static void *reader_thread(void *arg){
+    struct bench_run *run = arg;
+    char path[PATH_MAX];
+    uint64_t lookups = 0;
+    uint64_t misses = 0;
+    unsigned int seed = (unsigned int)(uintptr_t)&path;
+    struct mon_epoch_slot *slot = NULL;
+    if (run->mode == BENCH_EPOCH && !(slot = monitor_reader_register(run->mon))){
+        return NULL;
+    }
+    while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED)){
+        int wd = __atomic_load_n(&run->wds[rand_r(&seed) % BENCH_DIRS], __ATOMIC_RELAXED);
+        size_t len = 0;
+        if (run->mode == BENCH_EPOCH){
+            mon_epoch_enter(run->mon->epoch, slot);
+            len = monitor_wd_path(run->mon, wd, NULL, path, sizeof(path));
+            mon_epoch_exit(slot);
+        }else{
+            pthread_rwlock_rdlock(&run->lock);
+            struct w_dir *wdir = get_dir_by_wd(wd, run->mon);
+            len = wdir ? get_wdir_path(wdir, path, sizeof(path)) : 0;
+            pthread_rwlock_unlock(&run->lock);
+        }
+        lookups++;
+        misses += !len;
+    }
+    monitor_reader_unregister(run->mon, slot);
+    __atomic_add_fetch(&run->lookups, lookups, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&run->misses, misses, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Record the wds of top dir top and its sub dirs
+static void note_wds(struct bench_run *run, const char *dir, int top){
+    char path[PATH_MAX];
+    for (int j = 0; j <= BENCH_SUB_DIRS; j++){
+        if (j){
+            snprintf(path, sizeof(path), "%s/d%d/s%d", dir, top, j - 1);
+        }else{
+            snprintf(path, sizeof(path), "%s/d%d", dir, top);
+        }
+        struct w_dir *wdir = get_dir_by_path(path, run->mon);
+        __atomic_store_n(&run->wds[top * (BENCH_SUB_DIRS + 1) + j], wdir ? wdir->wd : -1, __ATOMIC_RELAXED);
+    }
+}
+
+/* One tree change. Alternates between moving a sub dir to another parent and back, 
+ * and removing a top dir's subtree and re-adding it */
+static void write_once(struct bench_run *run, const char *dir, uint64_t n){
+    char path[PATH_MAX];
+    int top = (int)(n / 2 % BENCH_TOP_DIRS);
+    if (n % 2){
+        snprintf(path, sizeof(path), "%s/d%d/s0", dir, top);
+        struct w_dir *wdir = get_dir_by_path(path, run->mon);
+        snprintf(path, sizeof(path), "%s/d%d", dir, (top + 1) % BENCH_TOP_DIRS);
+        struct w_dir *other = get_dir_by_path(path, run->mon);
+        snprintf(path, sizeof(path), "%s/d%d", dir, top);
+        struct w_dir *parent = get_dir_by_path(path, run->mon);
+        if (wdir && other && parent){
+            move_watch_dir(wdir, other, "moved", run->mon);
+            move_watch_dir(wdir, parent, "s0", run->mon);
+        }
+    }else{
+        snprintf(path, sizeof(path), "%s/d%d", dir, top);
+        struct w_dir *wdir = get_dir_by_path(path, run->mon);
+        if (wdir){
+            remove_watch_dir(wdir, run->mon);
+        }
+        monitor_dir(path, run->mon);
+        // Readers may still look up the old wds, those are the misses
+        note_wds(run, dir, top);
+    }
+}
+
+static void run_mode(const char *dir, enum bench_mode mode, int readers, int seconds, int pause_us){
+    struct bench_run run;
+    pthread_t threads[readers];
+    memset(&run, 0, sizeof(run));
+    run.mode = mode;
+    pthread_rwlock_init(&run.lock, NULL);
+    run.mon = create_event_monitor((char *)dir, IN_CREATE | IN_DELETE | IN_MOVE, 1, NULL, 0);
+    if (!run.mon || monitor_init(run.mon) || (mode == BENCH_EPOCH && monitor_enable_readers(run.mon, readers))){
+        LOGERROR("Failed to set up monitor for:'%s'\n", dir);
+        return;
+    }
+    for (int i = 0; i < BENCH_TOP_DIRS; i++){
+        note_wds(&run, dir, i);
+    }
+    for (int i = 0; i < readers; i++){
+        pthread_create(&threads[i], NULL, reader_thread, &run);
+    }
+    uint64_t start = mon_monotonic_ns();
+    uint64_t end = start + (uint64_t)seconds * 1000000000ull;
+    while (mon_monotonic_ns() < end){
+        if (mode == BENCH_RWLOCK){
+            pthread_rwlock_wrlock(&run.lock);
+        }
+        write_once(&run, dir, run.writes++);
+        if (mode == BENCH_RWLOCK){
+            pthread_rwlock_unlock(&run.lock);
+        }else{
+            mon_epoch_reclaim(run.mon->epoch);
+        }
+        if (pause_us){
+            usleep(pause_us);
+        }
+    }
+    __atomic_store_n(&run.stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < readers; i++){
+        pthread_join(threads[i], NULL);
+    }
+    uint64_t elapsed = mon_monotonic_ns() - start;
+    // Readers and the writer share the cpus, so compare lookup and write rates together
+    printf("%-7s readers:%d lookups:%llu (%.1f%% miss)  %.2f M lookups/s  writes:%llu  %.0f writes/s\n",
+           mode == BENCH_EPOCH ? "epoch" : "rwlock", readers, (unsigned long long)run.lookups,
+           run.lookups ? 100.0 * run.misses / run.lookups : 0.0, run.lookups * 1e3 / elapsed, 
+           (unsigned long long)run.writes, run.writes * 1e9 / elapsed);
+    destroy_event_monitor(run.mon);
+    pthread_rwlock_destroy(&run.lock);
+}
+
+int main(int argc, char **argv){
+    const char *dir = argc > 1 ? argv[1] : "/dev/shm/epoch_bench";
+    int readers = argc > 2 ? atoi(argv[2]) : 4;
+    int seconds = argc > 3 ? atoi(argv[3]) : 2;
+    int pause_us = argc > 4 ? atoi(argv[4]) : 100;
+    if (readers < 1 || readers > MON_EPOCH_MAX_READERS){
+        printf("readers must be 1 to %d\n", MON_EPOCH_MAX_READERS);
+        return 1;
+    }
+    if (fill_dir(dir)){
+        return 1;
+    }
+    run_mode(dir, BENCH_RWLOCK, readers, seconds, pause_us);
+    run_mode(dir, BENCH_EPOCH, readers, seconds, pause_us);
+    return 0;
+}
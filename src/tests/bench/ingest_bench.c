@@ -0,0 +1,192 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_reactor.h"
+#include "includes/mon_uring.h"
+#include "includes/mon_utils.h"
+
+/* Compares the epoll and io_uring ingestion paths. Files in a watched dir are rewritten, 
+ * then the queued events are read and every file seen in an IN_CLOSE_WRITE is read back, 
+ * as a publish would. Syscalls are the ones the ingestion path makes: epoll_wait() and 
+ * read() on the inotify fd plus open/read/close per file for epoll, io_uring_enter() for io_uring. 
+ * usage: ingest_bench [dir] [files] [rounds]
+ *   dir     dir to fill and watch, default /dev/shm/ingest_bench (tmpfs)
+ *   files   number of files rewritten per round, default 2000
+ *   rounds  number of rounds per backend, default 5
+ */
+
+#define PAYLOAD_LEN 256
+
+struct bench_state {
+    struct fs_event_manager *mon;
+    struct mon_uring *ring; // NULL for the epoll path
+    struct uring_file_req *reqs;
+    char (*paths)[PATH_MAX];
+    char *bufs;
+    size_t req_cnt; // requests filled in this round
+    size_t req_next; // first request not handed to a batch yet, those before may still be in flight
+    size_t req_size;
+    size_t files_read;
+    size_t batches_pending;
+};
+
+// Handlers get the monitor as data, the bench only runs one at a time
+static struct bench_state *bench_state;
+
+static void files_done(struct uring_file_req *reqs, size_t cnt, void *data){
+    struct bench_state *state = data;
+    for (size_t i = 0; i < cnt; i++){
+        if (reqs[i].result > 0){
+            state->files_read++;
+        }
+    }
+    state->batches_pending--;
+}
+
+// Collect the files closed after writing, they're read once the batch is handled
+static int bench_batch_handler(struct mon_event *events, size_t cnt, void *data){
+    (void)data;
+    struct bench_state *state = bench_state;
+    for (size_t i = 0; i < cnt; i++){
+        if (!(events[i].event->mask & IN_CLOSE_WRITE) || state->req_cnt >= state->req_size){
+            continue;
+        }
+        size_t len = 0;
+        char *path = monitor_event_path(state->mon, events[i].event->wd, events[i].name, &len);
+        if (path && len < PATH_MAX){
+            memcpy(state->paths[state->req_cnt], path, len + 1);
+            state->req_cnt++;
+        }
+    }
+    return 0;
+}
+
+/* Read the files collected since the last batch. Each batch gets its own range of reqs, 
+ * paths and bufs, earlier ones may still be in flight */
+static void read_payloads(struct bench_state *state){
+    size_t first = state->req_next;
+    if (state->req_cnt == first){
+        return;
+    }
+    for (size_t i = first; i < state->req_cnt; i++){
+        state->reqs[i].path = state->paths[i];
+        state->reqs[i].buf = state->bufs + i * PAYLOAD_LEN;
+        state->reqs[i].buflen = PAYLOAD_LEN;
+    }
+    state->req_next = state->req_cnt;
+    state->batches_pending++;
+    mon_uring_read_files(state->ring, state->reqs + first, state->req_cnt - first, files_done, state);
+}
+
+static void write_files(const char *dir, long files){
+    char path[PATH_MAX];
+    char payload[PAYLOAD_LEN];
+    memset(payload, 'x', sizeof(payload));
+    for (long i = 0; i < files; i++){
+        snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+        int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd >= 0){
+            if (write(fd, payload, sizeof(payload)) < 0){
+                LOGERROR("Failed to write:'%s'\n", path);
+            }
+            close(fd);
+        }
+    }
+}
+
+static uint64_t cpu_us(void){
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ull + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void run_backend(const char *dir, const char *label, int use_uring, long files, int rounds){
+    struct bench_state state;
+    memset(&state, 0, sizeof(state));
+    state.req_size = files;
+    state.reqs = calloc(files, sizeof(struct uring_file_req));
+    state.paths = calloc(files, PATH_MAX);
+    state.bufs = calloc(files, PAYLOAD_LEN);
+    // Big enough for a whole round, so the kernel queue never overflows
+    struct fs_event_manager *mon = create_event_monitor((char *)dir, IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE, 1, 
+                                                       NULL, 64 * 1024);
+    struct mon_reactor *reactor = NULL;
+    if (!state.reqs || !state.paths || !state.bufs || !mon || monitor_init(mon)){
+        LOGERROR("Failed to set up bench for:'%s'\n", dir);
+        return;
+    }
+    mon->batch_handler = bench_batch_handler;
+    bench_state = &state;
+    state.mon = mon;
+    if (use_uring){
+        state.ring = mon_uring_create(0);
+        if (!state.ring){
+            printf("%-8s not available, skipped\n", label);
+            destroy_event_monitor(mon);
+            return;
+        }
+        mon_uring_add_monitor(state.ring, mon);
+    }else{
+        reactor = mon_reactor_create(0);
+        mon_reactor_add_monitor(reactor, mon);
+    }
+    uint64_t events = 0, syscalls = 0, cpu = 0, wall = 0;
+    for (int r = 0; r < rounds; r++){
+        // The last round ended with no batch pending, every slot is free again
+        state.req_cnt = 0;
+        state.req_next = 0;
+        write_files(dir, files);
+        uint64_t events_start = mon->events_read;
+        uint64_t calls_start = state.ring ? state.ring->enters : reactor->waits + mon->ifd_reads;
+        size_t read_start = state.files_read;
+        uint64_t cpu_start = cpu_us();
+        uint64_t start = mon_monotonic_ns();
+        while (state.files_read - read_start < (size_t)files || state.batches_pending){
+            int ret = state.ring ? mon_uring_run_once(state.ring, 100) : mon_reactor_run_once(reactor, 100);
+            if (ret <= 0 && !state.batches_pending && mon_monotonic_ns() - start > 2000000000ull){
+                LOGERROR("Timed out waiting for events, read '%zu' of '%ld' files\n", 
+                         state.files_read - read_start, files);
+                break;
+            }
+            read_payloads(&state);
+        }
+        wall += mon_monotonic_ns() - start;
+        cpu += cpu_us() - cpu_start;
+        events += mon->events_read - events_start;
+        syscalls += state.ring ? state.ring->enters - calls_start : reactor->waits + mon->ifd_reads - calls_start;
+        if (!state.ring){
+            // open, read and close per file
+            syscalls += 3 * (state.files_read - read_start);
+        }
+    }
+    printf("%-8s events:%llu files:%ld  %.3f syscalls/event  %.3f cpu us/event  %.3f ms/round\n", label, 
+           (unsigned long long)events, files * rounds, (double)syscalls / (events ?: 1), 
+           (double)cpu / (events ?: 1), wall / 1e6 / (rounds ?: 1));
+    if (state.ring){
+        mon_uring_destroy(state.ring);
+    }
+    mon_reactor_destroy(reactor);
+    destroy_event_monitor(mon);
+    free(state.reqs);
+    free(state.paths);
+    free(state.bufs);
+}
+
+int main(int argc, char **argv){
+    const char *dir = argc > 1 ? argv[1] : "/dev/shm/ingest_bench";
+    long files = argc > 2 ? atol(argv[2]) : 2000;
+    int rounds = argc > 3 ? atoi(argv[3]) : 5;
+    if (mkdir(dir, 0755) && !mon_dir_exists((char *)dir)){
+        LOGERROR("Failed to create bench dir:'%s'\n", dir);
+        return 1;
+    }
+    run_backend(dir, "epoll", 0, files, rounds);
+    run_backend(dir, "io_uring", 1, files, rounds);
+    return 0;
+}
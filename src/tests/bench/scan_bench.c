@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "includes/mon_scan.h"
+#include "includes/mon_utils.h"
+
+/* Compares the getdents64 and readdir dir listing backends used by the monitor's 
+ * tree walks, on one wide dir. 
+ * usage: scan_bench [dir] [entries] [dir_every] [iterations]
+ *   dir        dir to fill and list, default /dev/shm/scan_bench (tmpfs)
+ *   entries    number of entries created in dir, default 100000
+ *   dir_every  every Nth entry is a sub dir, the rest are files. Default 10
+ *   iterations number of listings per backend, the best one is reported. Default 20
+ */
+
+static int count_cb(int dirfd, const char *name, size_t name_len, void *data){
+    (void)dirfd;
+    (void)name;
+    *(size_t *)data += name_len;
+    return 0;
+}
+
+static int fill_dir(const char *dir, long entries, long dir_every){
+    char path[4096];
+    if (mkdir(dir, 0755) && !mon_dir_exists((char *)dir)){
+        LOGERROR("Failed to create bench dir:'%s'\n", dir);
+        return -1;
+    }
+    for (long i = 0; i < entries; i++){
+        if (dir_every > 0 && i % dir_every == 0){
+            snprintf(path, sizeof(path), "%s/d%ld", dir, i);
+            mkdir(path, 0755);
+        }else{
+            snprintf(path, sizeof(path), "%s/f%ld", dir, i);
+            int fd = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+            if (fd >= 0){
+                close(fd);
+            }
+        }
+    }
+    return 0;
+}
+
+static void run_backend(const char *dir, const char *label, enum mon_scan_backend backend, 
+                        long entries, int iterations){
+    uint64_t best = UINT64_MAX;
+    int subdirs = 0;
+    mon_scan_set_backend(backend);
+    for (int i = 0; i < iterations; i++){
+        size_t name_bytes = 0;
+        int fd = mon_open_dir(dir, strlen(dir));
+        if (fd < 0){
+            LOGERROR("Failed to open:'%s'\n", dir);
+            return;
+        }
+        uint64_t start = mon_monotonic_ns();
+        subdirs = mon_scan_subdirs(fd, count_cb, &name_bytes);
+        uint64_t elapsed = mon_monotonic_ns() - start;
+        if (elapsed < best){
+            best = elapsed;
+        }
+    }
+    printf("%-10s entries:%ld subdirs:%d best:%.3f ms  %.1f ns/entry\n", label, entries, subdirs, 
+           best / 1e6, (double)best / (entries ?: 1));
+}
+
+int main(int argc, char **argv){
+    const char *dir = argc > 1 ? argv[1] : "/dev/shm/scan_bench";
+    long entries = argc > 2 ? atol(argv[2]) : 100000;
+    long dir_every = argc > 3 ? atol(argv[3]) : 10;
+    int iterations = argc > 4 ? atoi(argv[4]) : 20;
+    if (fill_dir(dir, entries, dir_every)){
+        return 1;
+    }
+    run_backend(dir, "getdents64", SCAN_BACKEND_GETDENTS, entries, iterations);
+    run_backend(dir, "readdir", SCAN_BACKEND_READDIR, entries, iterations);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_trace.h"
+#include "includes/mon_utils.h"
+
+/* Records a monitor to a trace file, and replays one through example_event_handler()
+ * without an inotify instance, reporting events/sec and per-event handler latency.
+ * usage: trace_replay record [dir] [trace] [seconds] [gen]
+ *          dir     dir to watch, default /dev/shm/trace_replay (tmpfs)
+ *          trace   trace file to write, default /dev/shm/trace_replay.trace
+ *          seconds how long to record, default 2
+ *          gen     1 to generate fs activity in dir while recording, 0 to only watch. Default 1
+ *        trace_replay replay [trace] [speed]
+ *          speed   1.0 replays at the recorded pace, 0 as fast as possible. Default 0
+ */
+
+#define GEN_DIRS 20
+#define GEN_FILES 20
+
+struct gen_state {
+    const char *dir;
+    int stop;
+    uint64_t ops;
+};
+
+/* Keeps creating dirs with files in them, renaming them and deleting them */
+static void *gen_thread(void *arg){
+    struct gen_state *gen = arg;
+    char path[PATH_MAX];
+    char dst[PATH_MAX];
+    for (uint64_t round = 0; !__atomic_load_n(&gen->stop, __ATOMIC_RELAXED); round++){
+        int d = (int)(round % GEN_DIRS);
+        snprintf(path, sizeof(path), "%s/g%d", gen->dir, d);
+        mkdir(path, 0755);
+        for (int f = 0; f < GEN_FILES; f++){
+            char file[PATH_MAX + 16];
+            snprintf(file, sizeof(file), "%s/f%d", path, f);
+            FILE *fp = fopen(file, "w");
+            if (fp){
+                fprintf(fp, "%llu\n", (unsigned long long)round);
+                fclose(fp);
+            }
+            unlink(file);
+        }
+        snprintf(dst, sizeof(dst), "%s/g%d.old", gen->dir, d);
+        rename(path, dst);
+        rmdir(dst);
+        gen->ops++;
+        usleep(1000);
+    }
+    return NULL;
+}
+
+static int record(const char *dir, const char *trace, int seconds, int generate){
+    struct gen_state gen;
+    pthread_t thread;
+    memset(&gen, 0, sizeof(gen));
+    gen.dir = dir;
+    if (mkdir(dir, 0755) && !mon_dir_exists((char *)dir)){
+        LOGERROR("Failed to create dir:'%s'\n", dir);
+        return 1;
+    }
+    struct fs_event_manager *mon = create_event_monitor((char *)dir, 0, 1, example_event_handler, 0);
+    if (!mon || monitor_init(mon) || monitor_trace_start(mon, trace)){
+        LOGERROR("Failed to set up recording of:'%s'\n", dir);
+        return 1;
+    }
+    if (generate){
+        pthread_create(&thread, NULL, gen_thread, &gen);
+    }
+    uint64_t end = mon_monotonic_ns() + (uint64_t)seconds * 1000000000ull;
+    while (mon_monotonic_ns() < end){
+        if (mon_fd_has_events(mon->ifd, 0, 100000)){
+            read_events_batch(mon);
+        }
+        monitor_expire_moves(mon);
+    }
+    if (generate){
+        __atomic_store_n(&gen.stop, 1, __ATOMIC_RELAXED);
+        pthread_join(thread, NULL);
+    }
+    // Pick up the generator's last events
+    while (mon_fd_has_events(mon->ifd, 0, 100000)){
+        read_events_batch(mon);
+    }
+    printf("recorded %llu events in %llu reads of:'%s' to:'%s'\n", (unsigned long long)mon->events_read,
+           (unsigned long long)mon->ifd_reads, dir, trace);
+    destroy_event_monitor(mon);
+    return 0;
+}
+
+static int replay(const char *trace, double speed){
+    char base[PATH_MAX];
+    uint32_t mask = 0;
+    struct mon_replay_stats stats;
+    if (monitor_trace_info(trace, base, sizeof(base), &mask)){
+        return 1;
+    }
+    struct fs_event_manager *mon = create_event_monitor(base, mask, 1, example_event_handler, 0);
+    if (!mon || monitor_replay(mon, trace, speed, &stats)){
+        LOGERROR("Failed to replay:'%s'\n", trace);
+        return 1;
+    }
+    printf("replayed %llu reads, %llu events, %llu recorded tree changes, %llu watches added by the handler, in %.3f s\n",
+           (unsigned long long)stats.reads, (unsigned long long)stats.events, (unsigned long long)stats.changes,
+           (unsigned long long)stats.fake_wds, stats.elapsed_ns / 1e9);
+    printf("%.0f events/s, handlers %.1f%% of the time. Per event p50:%llu ns p99:%llu ns max:%llu ns\n",
+           stats.events_per_sec, stats.elapsed_ns ? 100.0 * stats.handler_ns / stats.elapsed_ns : 0.0,
+           (unsigned long long)stats.latency_p50_ns, (unsigned long long)stats.latency_p99_ns,
+           (unsigned long long)stats.latency_max_ns);
+    printf("%zu dirs watched at the end\n", mon->watch_count);
+    destroy_event_monitor(mon);
+    return 0;
+}
+
+int main(int argc, char **argv){
+    if (argc > 1 && !strcmp(argv[1], "record")){
+        return record(argc > 2 ? argv[2] : "/dev/shm/trace_replay",
+                      argc > 3 ? argv[3] : "/dev/shm/trace_replay.trace",
+                      argc > 4 ? atoi(argv[4]) : 2, argc > 5 ? atoi(argv[5]) : 1);
+    }
+    if (argc > 1 && !strcmp(argv[1], "replay")){
+        return replay(argc > 2 ? argv[2] : "/dev/shm/trace_replay.trace", argc > 3 ? atof(argv[3]) : 0);
+    }
+    printf("usage: %s record [dir] [trace] [seconds] [gen] | replay [trace] [speed]\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_utils.h"
+
+/* Watch tree primitives on synthetic trees, without the kernel. Wds come from a
+ * counter through mon->watch_add, so only the tree, its indexes and allocator are timed.
+ * Dir i is named d<i> and sits under dir (i - 1) / fanout, dir 0 is the base dir.
+ * usage: watch_bench [max_dirs] [fanout] [lookups]
+ *   max_dirs largest tree, sizes go up by 10x from 1000. Default 1000000
+ *   fanout   sub dirs per dir, default 10
+ *   lookups  random lookups timed per op, default 1000000
+ */
+
+#define BENCH_BASE "/watch_bench"
+
+static int next_wd;
+
+static int fake_watch_add(struct fs_event_manager *mon, const char *path, uint32_t mask){
+    (void)mon;
+    (void)path;
+    (void)mask;
+    return next_wd++;
+}
+
+// Resident set size now, in bytes
+static size_t rss_bytes(void){
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp){
+        if (fscanf(fp, "%*s %ld", &pages) != 1){
+            pages = 0;
+        }
+        fclose(fp);
+    }
+    return (size_t)pages * sysconf(_SC_PAGESIZE);
+}
+
+/* Full paths of every dir, in one block. Returns offsets into it by dir index */
+static char *make_paths(size_t cnt, int fanout, size_t **offsets){
+    size_t size = 1 << 20;
+    size_t used = 0;
+    char *paths = malloc(size);
+    size_t *offs = malloc(cnt * sizeof(size_t));
+    if (!paths || !offs){
+        free(paths);
+        free(offs);
+        return NULL;
+    }
+    for (size_t i = 0; i < cnt; i++){
+        const char *parent = i ? paths + offs[(i - 1) / fanout] : NULL;
+        size_t need = (parent ? strlen(parent) : 0) + 32;
+        if (used + need > size){
+            size *= 2;
+            char *grown = realloc(paths, size);
+            if (!grown){
+                free(paths);
+                free(offs);
+                return NULL;
+            }
+            paths = grown;
+            parent = i ? paths + offs[(i - 1) / fanout] : NULL;
+        }
+        offs[i] = used;
+        if (parent){
+            used += sprintf(paths + used, "%s/d%zu", parent, i) + 1;
+        }else{
+            used += sprintf(paths + used, BENCH_BASE) + 1;
+        }
+    }
+    *offsets = offs;
+    return paths;
+}
+
+static void report(const char *op, size_t dirs, uint64_t ns, size_t ops){
+    printf("  %-20s dirs:%-8zu %10.1f ns/op\n", op, dirs, ops ? (double)ns / ops : 0.0);
+}
+
+static void run_size(size_t cnt, int fanout, size_t lookups){
+    size_t *offs = NULL;
+    char *paths = make_paths(cnt, fanout, &offs);
+    int *wds = malloc(cnt * sizeof(int));
+    if (!paths || !wds){
+        LOGERROR("Failed to alloc paths for '%zu' dirs\n", cnt);
+        free(paths);
+        free(offs);
+        free(wds);
+        return;
+    }
+    struct fs_event_manager *mon = create_event_monitor(BENCH_BASE, IN_CREATE | IN_DELETE | IN_MOVE, 1, NULL, 0);
+    if (!mon){
+        return;
+    }
+    mon->watch_add = fake_watch_add;
+    next_wd = 1;
+    printf("%zu dirs, fanout %d\n", cnt, fanout);
+
+    size_t rss = rss_bytes();
+    uint64_t start = mon_monotonic_ns();
+    for (size_t i = 0; i < cnt; i++){
+        struct w_dir *wdir = add_watch_dir_to_monitor(paths + offs[i], mon);
+        wds[i] = wdir ? wdir->wd : -1;
+    }
+    report("add_watch_dir", cnt, mon_monotonic_ns() - start, cnt);
+    mon->base_wd = wds[0];
+    size_t reserved = 0;
+    size_t in_use = monitor_mem_in_use(mon, &reserved);
+    size_t rss_after = rss_bytes();
+    size_t rss_tree = rss_after > rss ? rss_after - rss : 0;
+
+    unsigned int seed = 1;
+    size_t found = 0;
+    start = mon_monotonic_ns();
+    for (size_t i = 0; i < lookups; i++){
+        found += get_dir_by_wd(wds[rand_r(&seed) % cnt], mon) != NULL;
+    }
+    report("get_dir_by_wd", cnt, mon_monotonic_ns() - start, lookups);
+
+    start = mon_monotonic_ns();
+    for (size_t i = 0; i < lookups; i++){
+        found += get_dir_by_path(paths + offs[rand_r(&seed) % cnt], mon) != NULL;
+    }
+    report("get_dir_by_path", cnt, mon_monotonic_ns() - start, lookups);
+
+    start = mon_monotonic_ns();
+    for (size_t i = 0; i < lookups; i++){
+        char *path = create_wd_full_path(wds[rand_r(&seed) % cnt], "file.txt", mon);
+        found += path != NULL;
+        free(path);
+    }
+    report("create_wd_full_path", cnt, mon_monotonic_ns() - start, lookups);
+
+    // Upper half of the dirs, deepest first so most calls remove a single dir. A call that 
+    // takes a whole subtree counts for all of it, ops are the dirs actually removed
+    size_t before = mon->watch_count;
+    start = mon_monotonic_ns();
+    for (size_t i = cnt; i > cnt - cnt / 2; i--){
+        struct w_dir *wdir = get_dir_by_wd(wds[i - 1], mon);
+        if (wdir){
+            remove_watch_dir(wdir, mon);
+        }
+    }
+    report("remove_watch_dir", cnt, mon_monotonic_ns() - start, before - mon->watch_count);
+
+    size_t left = mon->watch_count;
+    start = mon_monotonic_ns();
+    destroy_wdir_list(mon);
+    report("destroy_wdir_list", cnt, mon_monotonic_ns() - start, left);
+
+    if (found != lookups * 3){
+        printf("  !! only %zu of %zu lookups found their dir\n", found, lookups * 3);
+    }
+    printf("  %-20s %.1f bytes/dir in use, %.1f reserved, %.1f RSS\n", "memory",
+           (double)in_use / cnt, (double)reserved / cnt, (double)rss_tree / cnt);
+    destroy_event_monitor(mon);
+    free(paths);
+    free(offs);
+    free(wds);
+}
+
+int main(int argc, char **argv){
+    size_t max_dirs = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    int fanout = argc > 2 ? atoi(argv[2]) : 10;
+    size_t lookups = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000000;
+    struct rusage ru;
+    if (max_dirs < 2 || fanout < 1 || !lookups){
+        printf("usage: %s [max_dirs] [fanout] [lookups]\n", argv[0]);
+        return 1;
+    }
+    for (size_t cnt = 1000; ; cnt *= 10){
+        run_size(cnt < max_dirs ? cnt : max_dirs, fanout, lookups);
+        if (cnt >= max_dirs){
+            break;
+        }
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    printf("peak RSS: %.1f MB\n", ru.ru_maxrss / 1024.0);
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include "includes/mon_fs.h"
+#include "includes/mon_reactor.h"
+#include "includes/mon_metrics.h"
+#include "includes/mon_mqtt.h"
+#include "includes/mon_utils.h"
+
+/* Publish every change under dir to an mqtt broker, from one reactor thread. The bridge
+ * publishes each event, then hands it on to example_event_handler() to keep the tree up to date.
+ * usage: mqtt_bridge [dir] [host] [port] [topic_prefix] [stats_topic] [qos] [max_inflight] [queue_len] [pause|conflate]
+ *   dir          dir to monitor recursively, default /tmp/mqtt_bridge
+ *   host, port   broker, default localhost 1883
+ *   topic_prefix default event_kitchen
+ *   stats_topic  if set, bridge and monitor metrics are published there every 10s, "-" for none
+ *   qos          0 or 1, default 1
+ *   max_inflight QoS1 messages waiting for their ack, default MQTT_DEFAULT_INFLIGHT
+ *   queue_len    queued messages before backpressure, default MQTT_DEFAULT_QUEUE_LEN
+ *   pause        stop reading events while the queue is full (default), conflate replaces
+ *                queued messages on the same topic instead
+ * Bridge stats, including publish/ack rates and ack latency, are printed on exit.
+ * watch with: mosquitto_sub -v -t 'event_kitchen/#'
+ */
+
+static volatile sig_atomic_t run = 1;
+
+static void handle_signal(int sig){
+    (void)sig;
+    run = 0;
+}
+
+int main(int argc, char **argv){
+    char *dir = argc > 1 ? argv[1] : "/tmp/mqtt_bridge";
+    struct mon_mqtt_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.host = argc > 2 ? argv[2] : NULL;
+    cfg.port = argc > 3 ? atoi(argv[3]) : 0;
+    cfg.topic_prefix = argc > 4 ? argv[4] : NULL;
+    cfg.stats_topic = argc > 5 && strcmp(argv[5], "-") ? argv[5] : NULL;
+    cfg.qos = argc > 6 ? atoi(argv[6]) : 1;
+    cfg.max_inflight = argc > 7 ? strtoul(argv[7], NULL, 10) : 0;
+    cfg.queue_len = argc > 8 ? strtoul(argv[8], NULL, 10) : 0;
+    cfg.backpressure = argc > 9 && !strcmp(argv[9], "conflate") ? MQTT_BACKPRESSURE_CONFLATE : MQTT_BACKPRESSURE_PAUSE;
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    struct fs_event_manager *mon = create_event_monitor(dir, IN_CREATE | IN_DELETE | IN_MOVE | IN_CLOSE_WRITE, 1, example_event_handler, 0);
+    if (!mon){
+        return 1;
+    }
+    mon->restore_base_dir = 1;
+    struct mon_reactor *reactor = mon_reactor_create(0);
+    if (!reactor || monitor_enable_metrics(mon) || monitor_init(mon) || !mon_reactor_add_monitor(reactor, mon)){
+        LOGERROR("Failed to start monitor of:'%s'\n", dir);
+        mon_reactor_destroy(reactor);
+        destroy_event_monitor(mon);
+        return 1;
+    }
+    struct mon_mqtt *mqtt = mon_mqtt_create(reactor, mon, &cfg);
+    if (!mqtt){
+        mon_reactor_destroy(reactor);
+        destroy_event_monitor(mon);
+        return 1;
+    }
+    printf("Publishing changes under '%s' to '%s:%d' on '%s/#', qos:%d, max_inflight:%u, queue_len:%u\n", dir, mqtt->cfg.host,
+           mqtt->cfg.port, mqtt->cfg.topic_prefix, mqtt->cfg.qos, mqtt->cfg.max_inflight, mqtt->cfg.queue_len);
+    while (run){
+        if (mon_reactor_run_once(reactor, 1000) < 0){
+            break;
+        }
+    }
+    json_t *stats = mon_mqtt_stats_json(mqtt);
+    if (stats){
+        json_dumpf(stats, stdout, JSON_INDENT(2));
+        printf("\n");
+        json_decref(stats);
+    }
+    mon_mqtt_destroy(mqtt);
+    mon_reactor_destroy(reactor);
+    destroy_event_monitor(mon);
+    return 0;
+}